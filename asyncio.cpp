@@ -0,0 +1,133 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#include "asyncio.h"
+
+#include <chrono>
+#include <unistd.h>
+#include <errno.h>
+
+namespace external_sort {
+
+  typedef std::chrono::steady_clock clock;
+
+  AsyncIO::AsyncIO(unsigned int maxQueued)
+    : _maxQueued(maxQueued)
+    , _stopping(false)
+    , _thread(&AsyncIO::run, this)
+  {}
+
+  AsyncIO::~AsyncIO()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+      _submitted.notify_one();
+    }
+    _thread.join();
+  }
+
+  void AsyncIO::submit(Request* request)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_maxQueued && _queue.size() >= _maxQueued)
+    {
+      clock::time_point start = clock::now();
+      while (_queue.size() >= _maxQueued)
+      {
+        _started.wait(lock);
+      }
+      ++ _statistics._waits;
+      _statistics._waitNanoseconds += 
+        std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    }
+    request->_done = false;
+    _queue.push_back(request);
+    _submitted.notify_one();
+  }
+
+  void AsyncIO::wait(Request* request)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (!request->_done)
+    {
+      clock::time_point start = clock::now();
+      while (!request->_done)
+      {
+        _completed.wait(lock);
+      }
+      ++ _statistics._waits;
+      _statistics._waitNanoseconds += 
+        std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    }
+  }
+
+  AsyncIO::Statistics AsyncIO::statistics()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _statistics;
+  }
+
+  ssize_t AsyncIO::perform(const Request& request)
+  {
+    if (!request._isWrite)
+    {
+      return ::pread(request._fd, request._data, request._length,
+                     (off_t) request._offset);
+    }
+    const char* data = request._data;
+    size_t remaining = request._length;
+    off_t offset = (off_t) request._offset;
+    while (remaining)
+    {
+      ssize_t written = ::pwrite(request._fd, data, remaining, offset);
+      if (written <= 0)
+      {
+        return -1;
+      }
+      data += written;
+      offset += written;
+      remaining -= (size_t) written;
+    }
+    return (ssize_t) request._length;
+  }
+
+  void AsyncIO::run()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;)
+    {
+      while (_queue.empty() && !_stopping)
+      {
+        _submitted.wait(lock);
+      }
+      if (_queue.empty())
+      {
+        return;
+      }
+      Request* request = _queue.front();
+      _queue.pop_front();
+      _started.notify_all();
+
+      lock.unlock();
+      // Errors are reported to (and by) the waiting DiskRun.
+      errno = 0;
+      ssize_t result = perform(*request);
+      int error = (result < 0 ? errno : 0);
+      lock.lock();
+
+      request->_result = result;
+      request->_error = error;
+      request->_done = true;
+      ++ _statistics._requests;
+      if (result > 0)
+      {
+        _statistics._bytes += (unsigned long long) result;
+      }
+      _completed.notify_all();
+    }
+  }
+
+} // namespace external_sort
@@ -0,0 +1,104 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#ifndef EXTERNAL_SORT_ASYNCIO_H
+#define EXTERNAL_SORT_ASYNCIO_H
+
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/types.h>
+
+namespace external_sort {
+
+  /*
+    Reads and writes blocks of files on a background thread, in the order
+    the requests are submitted. DiskRuns use this in two ways:
+
+    * Read-ahead: a run being merged submits a read of its next block 
+      while it parses the current one, and only waits if the merge
+      reaches the end of the current block before the read completes.
+      Each merge has its own AsyncIO for its sources.
+
+    * Write-behind: a run being written submits each full buffer and
+      carries on filling a second one, only waiting if that buffer is
+      still being written when it fills in turn. The sorter has an
+      AsyncIO for each spill thread, with a bounded queue so that
+      writers can't get arbitrarily far ahead of the device.
+
+    The time producers spend waiting, on either a full queue or an
+    incomplete request, is accumulated in the statistics.
+  */
+  class AsyncIO {
+  public:
+    struct Request {
+      Request()
+        : _fd(-1)
+        , _data(nullptr)
+        , _length(0)
+        , _offset(0)
+        , _result(0)
+        , _error(0)
+        , _isWrite(false)
+        , _done(true) {}
+      // default dtor/copy/assign OK
+
+      int _fd;
+      char* _data;
+      size_t _length;
+      unsigned long long _offset;
+      ssize_t _result; // as from pread; for writes, -1 or _length
+      int _error;      // errno, if _result is -1
+      bool _isWrite;
+      bool _done;
+    };
+
+    struct Statistics {
+      Statistics()
+        : _requests(0)
+        , _bytes(0)
+        , _waits(0)
+        , _waitNanoseconds(0) {}
+      // default dtor/copy/assign OK
+
+      unsigned long long _requests;
+      unsigned long long _bytes;
+      unsigned long long _waits;
+      unsigned long long _waitNanoseconds;
+    };
+
+    // maxQueued bounds the requests waiting to start; 0 is unbounded
+    AsyncIO(unsigned int maxQueued = 0);
+    ~AsyncIO();
+
+    // The request must not be touched until wait() returns.
+    void submit(Request* request);
+    void wait(Request* request);
+
+    Statistics statistics();
+
+  private:
+    // Prohibit copy/assign; do not implement
+    AsyncIO(const AsyncIO&);
+    AsyncIO& operator=(const AsyncIO&);
+
+    std::mutex _mutex;
+    std::condition_variable _submitted;
+    std::condition_variable _completed;
+    std::condition_variable _started;
+    std::deque<Request*> _queue;
+    unsigned int _maxQueued;
+    Statistics _statistics;
+    bool _stopping;
+    std::thread _thread;
+
+    void run();
+    static ssize_t perform(const Request& request);
+  };
+
+} // namespace external_sort
+
+#endif // EXTERNAL_SORT_ASYNCIO_H
@@ -0,0 +1,180 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#include "asyncoutput.h"
+
+#include <algorithm>
+
+namespace external_sort {
+
+  AsyncOutput::AsyncOutput(Receiver* target, unsigned int blocks)
+    : _target(target)
+    , _batchTarget(dynamic_cast<BatchReceiver*>(target))
+    , _blocks(std::max(blocks, 1u))
+    , _filling(nullptr)
+    , _head(0)
+    , _queued(0)
+    , _stopping(false)
+    , _thread(&AsyncOutput::run, this)
+  {}
+
+  AsyncOutput::~AsyncOutput()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _stopping = true;
+      _queuedBlock.notify_one();
+    }
+    _thread.join();
+  }
+
+  void AsyncOutput::receive(const void* payload, unsigned int payloadLength)
+  {
+    if (_filling &&
+        _filling->_data.size() + payloadLength > BatchReceiver::MAX_BATCH_BYTES)
+    {
+      queue();
+    }
+    if (!_filling)
+    {
+      acquire();
+    }
+    const char* data = (const char*) payload;
+    _filling->_data.insert(_filling->_data.end(), data, data + payloadLength);
+    _filling->_ends.push_back(_filling->_data.size());
+    if (_filling->_ends.size() == BatchReceiver::MAX_BATCH_RECORDS)
+    {
+      queue();
+    }
+  }
+
+  void AsyncOutput::finish()
+  {
+    if (_filling && !_filling->_ends.empty())
+    {
+      queue();
+    }
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_queued && !_error)
+    {
+      _freedBlock.wait(lock);
+    }
+    if (_error)
+    {
+      std::rethrow_exception(_error);
+    }
+  }
+
+  AsyncOutput::Statistics AsyncOutput::statistics()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _statistics;
+  }
+
+  // Waits for a block that is neither queued nor being delivered.
+  void AsyncOutput::acquire()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_queued == _blocks.size() && !_error)
+    {
+      clock::time_point start = clock::now();
+      while (_queued == _blocks.size() && !_error)
+      {
+        _freedBlock.wait(lock);
+      }
+      ++ _statistics._waits;
+      _statistics._waitNanoseconds +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    }
+    if (_error)
+    {
+      std::rethrow_exception(_error);
+    }
+    _filling = &_blocks[(_head + _queued) % _blocks.size()];
+    _filling->_data.clear();
+    _filling->_ends.clear();
+  }
+
+  void AsyncOutput::queue()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _filling->_queued = clock::now();
+    _filling = nullptr;
+    ++ _queued;
+    _queuedBlock.notify_one();
+  }
+
+  void AsyncOutput::deliver(const Block& block, std::vector<Span>& batch)
+  {
+    size_t start = 0;
+    if (!_batchTarget)
+    {
+      for (auto end: block._ends)
+      {
+        _target->receive(block._data.data() + start, end - start);
+        start = end;
+      }
+      return;
+    }
+    batch.clear();
+    for (auto end: block._ends)
+    {
+      batch.push_back(Span(block._data.data() + start, end - start));
+      start = end;
+    }
+    _batchTarget->receiveBatch(batch.data(), batch.size());
+  }
+
+  void AsyncOutput::run()
+  {
+    std::vector<Span> batch;
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;)
+    {
+      while (!_queued && !_stopping)
+      {
+        _queuedBlock.wait(lock);
+      }
+      if (!_queued || _stopping)
+      {
+        // finish() has seen everything delivered, unless the sort was
+        // abandoned, in which case the rest is of no interest.
+        return;
+      }
+      Block& block = _blocks[_head];
+      _statistics._latencyNanoseconds +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - block._queued).count();
+
+      if (!_error)
+      {
+        lock.unlock();
+        bool delivered = false;
+        try
+        {
+          deliver(block, batch);
+          delivered = true;
+        }
+        catch (...)
+        {
+          lock.lock();
+          _error = std::current_exception();
+          lock.unlock();
+        }
+        lock.lock();
+        if (delivered)
+        {
+          // Only what the receiver actually got is counted.
+          ++ _statistics._blocks;
+          _statistics._bytes += block._data.size();
+        }
+      }
+
+      _head = (_head + 1) % _blocks.size();
+      -- _queued;
+      _freedBlock.notify_all();
+    }
+  }
+
+} // namespace external_sort
@@ -0,0 +1,104 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#ifndef EXTERNAL_SORT_ASYNCOUTPUT_H
+#define EXTERNAL_SORT_ASYNCOUTPUT_H
+
+#include "sorter.h" // for Receiver
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <exception>
+
+namespace external_sort {
+
+  /*
+    Delivers the sorted output to the real receiver on a thread of its
+    own, so that the receiver's work overlaps the merge (or in-memory
+    sort) producing the output. It is itself a receiver: records given
+    to it are copied into the block being filled, and each full block
+    (of up to BatchReceiver::MAX_BATCH_RECORDS records or MAX_BATCH_BYTES
+    bytes) is queued for the delivery thread. There is a fixed ring of
+    blocks, so the producer waits once they are all full or being
+    delivered (back-pressure), rather than getting arbitrarily far ahead
+    of the receiver.
+
+    The receiver is handed each block's records as a batch if it is a
+    BatchReceiver, and one at a time otherwise. If it throws, the rest
+    of the output is dropped, and the exception is rethrown to the
+    producer by its next receive() or by finish().
+  */
+  class AsyncOutput : public Receiver {
+  public:
+    struct Statistics {
+      Statistics()
+        : _blocks(0)
+        , _bytes(0)
+        , _waits(0)
+        , _waitNanoseconds(0)
+        , _latencyNanoseconds(0) {}
+      // default dtor/copy/assign OK
+
+      unsigned long long _blocks;
+      unsigned long long _bytes;
+      // The producer waiting for a free block
+      unsigned long long _waits;
+      unsigned long long _waitNanoseconds;
+      // Total time from each block being queued to its delivery starting
+      unsigned long long _latencyNanoseconds;
+    };
+
+    AsyncOutput(Receiver* target, unsigned int blocks);
+    ~AsyncOutput();
+
+    void receive(const void* payload, unsigned int payloadLength);
+
+    // Queues the last, partly filled block, and waits for everything to
+    // be delivered.
+    void finish();
+
+    Statistics statistics();
+
+  private:
+    // Prohibit copy/assign; do not implement
+    AsyncOutput(const AsyncOutput&);
+    AsyncOutput& operator=(const AsyncOutput&);
+
+    typedef std::chrono::steady_clock clock;
+
+    struct Block {
+      // default ctor/dtor/copy/assign OK
+      std::vector<char> _data;
+      std::vector<size_t> _ends; // of each record in _data
+      clock::time_point _queued;
+    };
+
+    Receiver* _target;
+    BatchReceiver* _batchTarget; // _target, if it takes batches
+    std::vector<Block> _blocks;
+    Block* _filling; // the producer's alone, between acquire and queue
+
+    std::mutex _mutex;
+    std::condition_variable _queuedBlock;
+    std::condition_variable _freedBlock;
+    unsigned int _head;   // the oldest queued block
+    unsigned int _queued; // blocks queued or being delivered
+    Statistics _statistics;
+    std::exception_ptr _error;
+    bool _stopping;
+    std::thread _thread;
+
+    void acquire();
+    void queue();
+    void deliver(const Block& block, std::vector<Span>& batch);
+    void run();
+  };
+
+} // namespace external_sort
+
+#endif // EXTERNAL_SORT_ASYNCOUTPUT_H
@@ -0,0 +1,74 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#ifndef EXTERNAL_SORT_COMBINE_H
+#define EXTERNAL_SORT_COMBINE_H
+
+#include "sorter.h" // for Combiner, FixedRecordSizeException
+
+#include <cstring> // for memcmp
+#include <string>
+
+/*
+  Applying a Combiner (see sorter.h) to records as they go by in key
+  order: the payloads of each group of consecutive records with equal
+  keys are folded into the first one's, and the group goes on as a
+  single record. This happens to each run as it is spilled (or output,
+  if it's the only one), in every merge, and for a cursor.
+
+  This is small and all inline, so there is no corresponding .cpp file.
+*/
+
+namespace external_sort {
+
+  class Combining {
+  public:
+    Combining()
+      : _combiner(nullptr)
+      , _fixedLength(false)
+      , _fixedPayloadLength(0) {}
+
+    Combining(Combiner* combiner, bool fixedLength, unsigned int fixedPayloadLength)
+      : _combiner(combiner)
+      , _fixedLength(fixedLength)
+      , _fixedPayloadLength(fixedPayloadLength) {}
+    // default dtor/copy/assign OK
+
+    inline
+    bool active() const
+    {
+      return _combiner != nullptr;
+    }
+
+    static inline
+    bool sameKey(const void* left, unsigned int leftLength,
+                 const void* right, unsigned int rightLength)
+    {
+      return leftLength == rightLength && memcmp(left, right, leftLength) == 0;
+    }
+
+    // Folds payload into the accumulator, which holds the combined
+    // payloads of the group so far. A fixed length payload has to keep
+    // its length.
+    inline
+    void combine(std::string& accumulator, unsigned int keyLength,
+                 const void* payload, unsigned int payloadLength) const
+    {
+      _combiner->combine(accumulator, payload, payloadLength);
+      if (_fixedLength && accumulator.size() != _fixedPayloadLength)
+      {
+        throw new FixedRecordSizeException(keyLength, accumulator.size());
+      }
+    }
+
+  private:
+    Combiner* _combiner;
+    bool _fixedLength;
+    unsigned int _fixedPayloadLength;
+  };
+
+} // namespace external_sort
+
+#endif // EXTERNAL_SORT_COMBINE_H
@@ -0,0 +1,276 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#include "compress.h"
+
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+namespace external_sort {
+
+  static const unsigned int MIN_MATCH = 4;
+  static const unsigned int MAX_OFFSET = 65535;
+  static const unsigned int HASH_BITS = 16;
+  static const unsigned int WINDOW_MASK = 65535; // for the hash chains
+
+  static inline
+  uint32_t read32(const unsigned char* p)
+  {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  static inline
+  uint32_t hashOf(uint32_t sequence)
+  {
+    return (sequence * 2654435761U) >> (32 - HASH_BITS);
+  }
+
+  // Appends a length's 255-valued extension bytes; false if out of room.
+  static inline
+  bool putExtension(size_t length, unsigned char*& out, const unsigned char* end)
+  {
+    while (length >= 255)
+    {
+      if (out == end)
+      {
+        return false;
+      }
+      *out++ = 255;
+      length -= 255;
+    }
+    if (out == end)
+    {
+      return false;
+    }
+    *out++ = (unsigned char) length;
+    return true;
+  }
+
+  // Emits one group: the literals, then (if matchLength) the match.
+  static inline
+  bool putSequence(const unsigned char* literals, size_t literalLength,
+                   unsigned int offset, size_t matchLength,
+                   unsigned char*& out, const unsigned char* end)
+  {
+    if (out == end)
+    {
+      return false;
+    }
+    size_t matchCode = matchLength ? matchLength - MIN_MATCH : 0;
+    unsigned char* token = out++;
+    *token = (unsigned char) ((std::min(literalLength, (size_t) 15) << 4) |
+                              std::min(matchCode, (size_t) 15));
+    if (literalLength >= 15 && !putExtension(literalLength - 15, out, end))
+    {
+      return false;
+    }
+    if ((size_t) (end - out) < literalLength)
+    {
+      return false;
+    }
+    memcpy(out, literals, literalLength);
+    out += literalLength;
+    if (matchLength)
+    {
+      if (end - out < 2)
+      {
+        return false;
+      }
+      *out++ = (unsigned char) (offset & 0xff);
+      *out++ = (unsigned char) (offset >> 8);
+      if (matchCode >= 15 && !putExtension(matchCode - 15, out, end))
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  size_t lzCompressBound(size_t length)
+  {
+    return length + length/255 + 16;
+  }
+
+  size_t lzCompress(const char* source, size_t length,
+                    char* target, size_t capacity, unsigned int level)
+  {
+    // Reused across calls, one set per spilling or merging thread
+    static thread_local std::vector<int32_t> heads;
+    static thread_local std::vector<int32_t> chain;
+    heads.assign(1u << HASH_BITS, -1);
+    level = std::max(1u, std::min(level, MAX_COMPRESSION_LEVEL));
+    unsigned int attempts = 1u << (level - 1);
+    if (attempts > 1)
+    {
+      chain.resize(WINDOW_MASK + 1);
+    }
+
+    const unsigned char* in = (const unsigned char*) source;
+    unsigned char* out = (unsigned char*) target;
+    const unsigned char* outEnd = out + capacity;
+    size_t position = 0;
+    size_t anchor = 0; // start of the pending literals
+    while (position + MIN_MATCH <= length)
+    {
+      uint32_t sequence = read32(in + position);
+      uint32_t hash = hashOf(sequence);
+      int32_t candidate = heads[hash];
+      size_t bestLength = 0;
+      size_t bestOffset = 0;
+      for (unsigned int tries = attempts;
+           candidate >= 0 && position - candidate <= MAX_OFFSET && tries > 0;
+           -- tries)
+      {
+        if (read32(in + candidate) == sequence)
+        {
+          size_t matchLength = MIN_MATCH;
+          while (position + matchLength < length &&
+                 in[candidate + matchLength] == in[position + matchLength])
+          {
+            ++ matchLength;
+          }
+          if (matchLength > bestLength)
+          {
+            bestLength = matchLength;
+            bestOffset = position - candidate;
+          }
+        }
+        if (attempts == 1)
+        {
+          break;
+        }
+        int32_t previous = chain[candidate & WINDOW_MASK];
+        if (previous >= candidate)
+        {
+          break; // the slot has been reused by a later position
+        }
+        candidate = previous;
+      }
+
+      if (attempts > 1)
+      {
+        chain[position & WINDOW_MASK] = heads[hash];
+      }
+      heads[hash] = (int32_t) position;
+
+      if (bestLength == 0)
+      {
+        // Level 1 skips faster the longer it goes without a match.
+        position += (attempts == 1 ? 1 + ((position - anchor) >> 6) : 1);
+        continue;
+      }
+
+      if (!putSequence(in + anchor, position - anchor, bestOffset, bestLength,
+                       out, outEnd))
+      {
+        return 0;
+      }
+      size_t matchEnd = position + bestLength;
+      if (attempts > 1)
+      {
+        // Index the matched positions too, for better later matches.
+        for (++ position; position + MIN_MATCH <= length && position < matchEnd; ++ position)
+        {
+          uint32_t h = hashOf(read32(in + position));
+          chain[position & WINDOW_MASK] = heads[h];
+          heads[h] = (int32_t) position;
+        }
+      }
+      position = matchEnd;
+      anchor = matchEnd;
+    }
+
+    if (!putSequence(in + anchor, length - anchor, 0, 0, out, outEnd))
+    {
+      return 0;
+    }
+    return (size_t) (out - (unsigned char*) target);
+  }
+
+  // Reads a length's extension bytes; false if the input ends first.
+  static inline
+  bool getExtension(size_t& length, const unsigned char*& in, const unsigned char* end)
+  {
+    unsigned char byte;
+    do
+    {
+      if (in == end)
+      {
+        return false;
+      }
+      byte = *in++;
+      length += byte;
+    } while (byte == 255);
+    return true;
+  }
+
+  bool lzDecompress(const char* source, size_t sourceLength,
+                    char* target, size_t length)
+  {
+    const unsigned char* in = (const unsigned char*) source;
+    const unsigned char* inEnd = in + sourceLength;
+    unsigned char* out = (unsigned char*) target;
+    unsigned char* outEnd = out + length;
+    while (in < inEnd)
+    {
+      unsigned char token = *in++;
+      size_t literalLength = token >> 4;
+      if (literalLength == 15 && !getExtension(literalLength, in, inEnd))
+      {
+        return false;
+      }
+      if ((size_t) (inEnd - in) < literalLength ||
+          (size_t) (outEnd - out) < literalLength)
+      {
+        return false;
+      }
+      memcpy(out, in, literalLength);
+      in += literalLength;
+      out += literalLength;
+      if (in == inEnd)
+      {
+        break; // the last group
+      }
+
+      if (inEnd - in < 2)
+      {
+        return false;
+      }
+      size_t offset = in[0] | (in[1] << 8);
+      in += 2;
+      size_t matchLength = token & 15;
+      if (matchLength == 15 && !getExtension(matchLength, in, inEnd))
+      {
+        return false;
+      }
+      matchLength += MIN_MATCH;
+      if (offset == 0 || offset > (size_t) (out - (unsigned char*) target) ||
+          (size_t) (outEnd - out) < matchLength)
+      {
+        return false;
+      }
+      const unsigned char* match = out - offset;
+      if (offset >= matchLength)
+      {
+        memcpy(out, match, matchLength);
+        out += matchLength;
+      }
+      else
+      {
+        // overlapping: the match repeats the bytes being written
+        for (size_t i = 0; i < matchLength; ++i)
+        {
+          *out++ = *match++;
+        }
+      }
+    }
+    return out == outEnd;
+  }
+
+} // namespace external_sort
@@ -0,0 +1,43 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#ifndef EXTERNAL_SORT_COMPRESS_H
+#define EXTERNAL_SORT_COMPRESS_H
+
+#include <cstddef>
+
+/*
+  A small LZ77 block codec, used to compress the blocks of spilled runs.
+  The format follows LZ4's: a sequence of (token, literals, match)
+  groups, where the token's high nibble is the literal count and its low
+  nibble the match length less MIN_MATCH, each extended by 255-valued
+  bytes when it is 15; the match is a 2-byte little-endian offset back
+  into the output. The last group has literals only.
+
+  Level 1 probes a single hash table slot per position, and skips ahead
+  faster through incompressible data; each higher level (up to
+  MAX_COMPRESSION_LEVEL) doubles the number of earlier positions with the
+  same hash that are tried, trading speed for ratio.
+*/
+
+namespace external_sort {
+
+  static const unsigned int DEFAULT_COMPRESSION_LEVEL = 1;
+  static const unsigned int MAX_COMPRESSION_LEVEL = 9;
+
+  // The largest compressed size of a block of the given length
+  size_t lzCompressBound(size_t length);
+
+  // Returns the compressed length, or 0 if it would exceed capacity.
+  size_t lzCompress(const char* source, size_t length,
+                    char* target, size_t capacity, unsigned int level);
+
+  // Returns false unless the source decompresses to exactly length bytes.
+  bool lzDecompress(const char* source, size_t sourceLength,
+                    char* target, size_t length);
+
+} // namespace external_sort
+
+#endif // EXTERNAL_SORT_COMPRESS_H
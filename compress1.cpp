@@ -0,0 +1,101 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#include "compress.h"
+#include "gtest/gtest.h"
+
+#include <string>
+#include <vector>
+#include <random>
+
+namespace {
+
+  // Compresses and decompresses source at every level, returning the
+  // compressed size at the first level.
+  size_t roundTrip(const std::string& source)
+  {
+    size_t firstSize = 0;
+    std::vector<char> packed(external_sort::lzCompressBound(source.size()));
+    for (unsigned int level = 1; level <= external_sort::MAX_COMPRESSION_LEVEL; ++level)
+    {
+      size_t packedLength = external_sort::lzCompress(source.data(), source.size(),
+                                                      packed.data(), packed.size(),
+                                                      level);
+      EXPECT_GT(packedLength, 0u) << "level " << level;
+      std::vector<char> result(source.size() + 1);
+      EXPECT_TRUE(external_sort::lzDecompress(packed.data(), packedLength,
+                                              result.data(), source.size()))
+        << "level " << level;
+      EXPECT_EQ(source, std::string(result.data(), source.size())) << "level " << level;
+      if (level == 1)
+      {
+        firstSize = packedLength;
+      }
+    }
+    return firstSize;
+  }
+
+  TEST(Compress, Empty)
+  {
+    roundTrip(std::string());
+  }
+
+  TEST(Compress, Short)
+  {
+    roundTrip("a");
+    roundTrip("abcabcabc");
+  }
+
+  TEST(Compress, Repetitive)
+  {
+    std::string source;
+    for (unsigned int i = 0; i < 10000; ++i)
+    {
+      source += "tenant-0042/2014-06-01/record " + std::to_string(i % 100) + "\n";
+    }
+    ASSERT_LT(roundTrip(source), source.size()/4);
+
+    // long runs of one byte overlap their own matches
+    ASSERT_LT(roundTrip(std::string(100000, 'x')), 1000u);
+  }
+
+  TEST(Compress, Random)
+  {
+    std::mt19937 generator(7);
+    std::string source(200000, ' ');
+    for (auto& c: source)
+    {
+      c = (char) generator();
+    }
+    ASSERT_LE(roundTrip(source), external_sort::lzCompressBound(source.size()));
+  }
+
+  TEST(Compress, TooSmall)
+  {
+    std::mt19937 generator(11);
+    std::string source(1000, ' ');
+    for (auto& c: source)
+    {
+      c = (char) generator();
+    }
+    std::vector<char> packed(100);
+    ASSERT_EQ(0u, external_sort::lzCompress(source.data(), source.size(),
+                                            packed.data(), packed.size(), 1));
+  }
+
+  TEST(Compress, Corrupt)
+  {
+    std::string source(1000, 'y');
+    std::vector<char> packed(external_sort::lzCompressBound(source.size()));
+    size_t packedLength = external_sort::lzCompress(source.data(), source.size(),
+                                                    packed.data(), packed.size(), 1);
+    std::vector<char> result(source.size());
+    // truncated input, and the wrong expected length
+    ASSERT_FALSE(external_sort::lzDecompress(packed.data(), packedLength/2,
+                                             result.data(), source.size()));
+    ASSERT_FALSE(external_sort::lzDecompress(packed.data(), packedLength,
+                                             result.data(), source.size() - 1));
+  }
+}
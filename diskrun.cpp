@@ -4,49 +4,130 @@
 // for the detailed license.
 
 #include "diskrun.h"
+#include "compress.h"
 #include "sortassert.h"
 
+#include <cstring>
+#include <algorithm>
 #include <sstream>
 #include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
 #include <unistd.h>
-#include <sys/uio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 
-// TBD: This initial implementation is drop-dead simple just to get it running.
-
 namespace external_sort {
 
   unsigned int DiskRun::_seq = 0;
 
-  DiskRun::DiskRun()
-    : _fd(-1)
+  // How much of a mapped run is read between releasing the pages behind
+  // the reader.
+  static const unsigned long long MAPPING_DROP_INTERVAL = 16 * 1024 * 1024;
+
+  template <typename T>
+  static inline
+  T roundUp(T size, unsigned int alignment)
+  {
+    return ((size + alignment - 1) / alignment) * alignment;
+  }
+
+  void DiskRun::Buffer::allocate(unsigned int size, unsigned int alignment)
+  {
+    _storage.reset(new char[size + alignment - 1]);
+    uintptr_t address = (uintptr_t) _storage.get();
+    _data = (char*) (((address + alignment - 1) / alignment) * alignment);
+  }
+
+  void DiskRun::Buffer::release()
+  {
+    _storage.reset();
+    _data = nullptr;
+  }
+
+  void DiskRun::Buffer::swap(Buffer& other)
+  {
+    _storage.swap(other._storage);
+    std::swap(_data, other._data);
+  }
+
+  DiskRun::DiskRun(const Options& options)
+    : _blockSize(std::max(options._bufferSize, (unsigned int) sizeof(Header)))
+    , _headroom(0)
+    , _bufferUsed(0)
+    , _bufferNext(0)
+    , _current(nullptr)
+    , _fd(-1)
+    , _fileOffset(0)
+    , _fileSize(0)
+    , _diskSize(0)
+    , _readAhead(nullptr)
+    , _writeBehind(options._writeBehind)
+    , _readPending(false)
+    , _mapping(nullptr)
+    , _mappingLength(0)
+    , _mappingNext(0)
+    , _mappingDropped(0)
+    , _alignment(1)
+    , _level(0)
     , _maxRecordSize(0)
+    , _keyBytes(0)
+    , _payloadBytes(0)
     , _isWritable(true)
+    , _compression(options._compression)
+    , _compressionLevel(options._compressionLevel)
+    , _packedSize(0)
+    , _frame(0)
+    , _frontCoded(options._frontCodedKeys && !options._fixedLength)
+    , _recordHeaderSize(options._fixedLength ? 0 :
+                        sizeof(Header) + (_frontCoded ? sizeof(unsigned int) : 0))
+    , _key(nullptr)
+    , _keyLength(0)
+    , _sharedLength(0)
+    , _maxKeyLength(0)
+    , _fixedLength(options._fixedLength)
   {
-    _writeVector[0].iov_base = &_header;
-    _writeVector[0].iov_len = sizeof(_header);
+    _fixedHeader._keyPlusPayloadLength = 
+      options._fixedKeyLength + options._fixedPayloadLength;
+    _fixedHeader._keyLength = options._fixedKeyLength;
+    SORT_ASSERT(!_fixedLength || _fixedHeader._keyPlusPayloadLength > 0);
   }
 
   void DiskRun::close()
   {
     if (_fd != -1)
     {
-      // TBD: real error handling
-      SORT_ASSERT(0 == ::close(_fd));
+      int result = ::close(_fd);
       _fd = -1;
+      if (result != 0)
+      {
+        throw new DiskIOException("close", errno);
+      }
     }
   }
 
   DiskRun::~DiskRun()
   {
-    close();
+    unmap();
+    stopReadAhead();
+    if (_writeBehind)
+    {
+      _writeBehind->wait(&_request);
+    }
+    if (_fd != -1)
+    {
+      // The run was abandoned, so there is no one to tell of an error.
+      ::close(_fd);
+    }
   }
 
   DiskRunSPtr DiskRun::getDiskRun(unsigned int level, 
-                                  unsigned int keyBytes,
-                                  unsigned int payloadBytes)
+                                  unsigned long long keyBytes,
+                                  unsigned long long payloadBytes,
+                                  const Options& options)
   {
-    DiskRunSPtr result(new DiskRun);
+    DiskRunSPtr result(new DiskRun(options));
     // TBD
     std::ostringstream s;
     s << "sort_level_" << level
@@ -55,81 +136,609 @@ namespace external_sort {
       << "_XXXXXX"
       ;
     std::string nameTemplate = s.str();
+    result->_level = level;
     result->_fd = ::mkstemp(const_cast<char*>(nameTemplate.data()));
-    SORT_ASSERT(result->_fd);
+    if (result->_fd == -1)
+    {
+      throw new DiskIOException("mkstemp", errno);
+    }
     // immediately unlink so we don't have to worry about cleanup
-    SORT_ASSERT(0 == unlink(const_cast<char*>(nameTemplate.data())));
+    if (0 != unlink(const_cast<char*>(nameTemplate.data())))
+    {
+      throw new DiskIOException("unlink", errno);
+    }
+
+    if (options._directIO && options._compression == NO_COMPRESSION)
+    {
+      // Not every file system supports O_DIRECT (tmpfs, for one); if 
+      // this one doesn't, carry on through the page cache.
+      int flags = ::fcntl(result->_fd, F_GETFL);
+      if (flags != -1 && ::fcntl(result->_fd, F_SETFL, flags | O_DIRECT) == 0)
+      {
+        result->_alignment = DIRECT_IO_ALIGNMENT;
+        result->_blockSize = roundUp(result->_blockSize, DIRECT_IO_ALIGNMENT);
+      }
+    }
+    result->allocateWriteBuffers();
 
     return result;
   }
 
+  void DiskRun::allocateWriteBuffers()
+  {
+    _buffer.allocate(_blockSize, _alignment);
+    if (isCompressed())
+    {
+      // Only the compressed frames need double buffering.
+      _packedSize = sizeof(FrameHeader) + (unsigned int) lzCompressBound(_blockSize);
+      _packed.allocate(_packedSize, 1);
+      if (_writeBehind)
+      {
+        _packedSpare.allocate(_packedSize, 1);
+      }
+    }
+    else if (_writeBehind)
+    {
+      _spare.allocate(_blockSize, _alignment);
+    }
+  }
+
+  inline
+  void DiskRun::append(const void* data, unsigned int length)
+  {
+    unsigned int space = _blockSize - _bufferUsed;
+    if (length < space)
+    {
+      memcpy(_buffer.data() + _bufferUsed, data, (size_t) length);
+      _bufferUsed += length;
+      return;
+    }
+
+    // Fill the block, write it, and carry on with the rest.
+    const char* source = (const char*) data;
+    while (length)
+    {
+      unsigned int amount = std::min(length, _blockSize - _bufferUsed);
+      memcpy(_buffer.data() + _bufferUsed, source, (size_t) amount);
+      _bufferUsed += amount;
+      source += amount;
+      length -= amount;
+      if (_bufferUsed == _blockSize)
+      {
+        flush();
+      }
+    }
+  }
+
+  void DiskRun::awaitWrite()
+  {
+    _writeBehind->wait(&_request);
+    if (_request._result != (ssize_t) _request._length)
+    {
+      throw new DiskIOException("pwrite", _request._error);
+    }
+  }
+
+  // Write what is in the buffer. Only the last block of the run can be
+  // partial; in direct mode it is padded out to the alignment.
+  void DiskRun::flush()
+  {
+    if (_bufferUsed == 0)
+    {
+      return;
+    }
+    if (isCompressed())
+    {
+      flushCompressed();
+      return;
+    }
+    unsigned int length = roundUp(_bufferUsed, _alignment);
+    memset(_buffer.data() + _bufferUsed, 0, (size_t) (length - _bufferUsed));
+    _fileSize += _bufferUsed;
+    writeBlock(_buffer, _spare, length);
+    _bufferUsed = 0;
+  }
+
+  // Compress the buffer into a frame, and write that. Blocks that don't
+  // compress are stored as they are.
+  void DiskRun::flushCompressed()
+  {
+    FrameHeader header;
+    header._length = _bufferUsed;
+    size_t packedLength = lzCompress(_buffer.data(), _bufferUsed,
+                                     _packed.data() + sizeof(FrameHeader),
+                                     _packedSize - sizeof(FrameHeader),
+                                     _compressionLevel);
+    if (packedLength == 0 || packedLength >= _bufferUsed)
+    {
+      memcpy(_packed.data() + sizeof(FrameHeader), _buffer.data(),
+             (size_t) _bufferUsed);
+      packedLength = _bufferUsed;
+    }
+    header._packedLength = (unsigned int) packedLength;
+    memcpy(_packed.data(), &header, sizeof(FrameHeader));
+    unsigned int frameLength = sizeof(FrameHeader) + header._packedLength;
+    _frameLengths.push_back(frameLength);
+    _fileSize += _bufferUsed;
+    writeBlock(_packed, _packedSpare, frameLength);
+    _bufferUsed = 0;
+  }
+
+  // Write length bytes of buffer at _fileOffset, either now or, when
+  // writing behind, by swapping it with spare and submitting it.
+  void DiskRun::writeBlock(Buffer& buffer, Buffer& spare, unsigned int length)
+  {
+    if (_writeBehind)
+    {
+      // spare may still be being written.
+      awaitWrite();
+      _request._fd = _fd;
+      _request._data = buffer.data();
+      _request._length = (size_t) length;
+      _request._offset = _fileOffset;
+      _request._isWrite = true;
+      buffer.swap(spare);
+      _writeBehind->submit(&_request);
+    }
+    else
+    {
+      const char* data = buffer.data();
+      size_t remaining = (size_t) length;
+      off_t offset = (off_t) _fileOffset;
+      while (remaining)
+      {
+        ssize_t written = ::pwrite(_fd, data, remaining, offset);
+        if (written <= 0)
+        {
+          throw new DiskIOException("pwrite", written < 0 ? errno : 0);
+        }
+        data += written;
+        offset += written;
+        remaining -= (size_t) written;
+      }
+    }
+    _fileOffset += length;
+    _diskSize += length;
+  }
+
   void DiskRun::write(const void* key, unsigned int keyLength,
                       const void* payload, unsigned int payloadLength)
   {
-    _header._keyPlusPayloadLength = + keyLength + payloadLength;
-    _header._keyLength = keyLength;
-    if (_header._keyPlusPayloadLength > _maxRecordSize)
+    unsigned int shared = 0;
+    if (_frontCoded)
+    {
+      shared = commonPrefixLength(_previousKey.data(), _previousKey.size(),
+                                  (const char*) key, keyLength);
+    }
+    writeRecord(key, keyLength, payload, payloadLength, shared);
+  }
+
+  inline
+  void DiskRun::writeRecord(const void* key, unsigned int keyLength,
+                            const void* payload, unsigned int payloadLength,
+                            unsigned int shared)
+  {
+    SORT_ASSERT_DEBUGONLY(_isWritable);
+    if (keyLength + payloadLength > _maxRecordSize)
     {
-      _maxRecordSize = _header._keyPlusPayloadLength;
+      _maxRecordSize = keyLength + payloadLength;
     }
-    _writeVector[1].iov_base = const_cast<void*>(key);
-    _writeVector[1].iov_len = (size_t) keyLength;
-    _writeVector[2].iov_base = const_cast<void*>(payload);
-    _writeVector[2].iov_len = (size_t) payloadLength;
-    ssize_t written = ::writev(_fd, _writeVector, 3);
-    // TBD: real exceptions
-    SORT_ASSERT(written == (ssize_t) _header._keyPlusPayloadLength + sizeof(Header));
+    _keyBytes += keyLength;
+    _payloadBytes += payloadLength;
+
+    if (_frontCoded)
+    {
+      // only the suffix of the previous key changes
+      _previousKey.replace(shared, std::string::npos,
+                           (const char*) key + shared, keyLength - shared);
+      _maxKeyLength = std::max(_maxKeyLength, keyLength);
+    }
+    if (_fixedLength)
+    {
+      SORT_ASSERT_DEBUGONLY(keyLength == _fixedHeader._keyLength);
+      SORT_ASSERT_DEBUGONLY(keyLength + payloadLength == 
+                            _fixedHeader._keyPlusPayloadLength);
+      append(key, keyLength);
+      append(payload, payloadLength);
+      return;
+    }
+    Header header;
+    header._keyPlusPayloadLength = keyLength - shared + payloadLength;
+    header._keyLength = keyLength - shared;
+    append(&header, sizeof(Header));
+    if (_frontCoded)
+    {
+      append(&shared, sizeof(shared));
+    }
+    append((const char*) key + shared, keyLength - shared);
+    append(payload, payloadLength);
   }
 
   void DiskRun::resetForRead()
   {
     SORT_ASSERT(_isWritable);
+    flush();
+    if (_writeBehind)
+    {
+      awaitWrite();
+      _writeBehind = nullptr;
+      _spare.release();
+      _packedSpare.release();
+    }
     _isWritable = false;
-    off_t where = ::lseek(_fd, 0, SEEK_SET);
-    // TBD: real exception
-    SORT_ASSERT(((off_t)0) == where);
-    _buffer.reset(new char[_maxRecordSize]);
+    _headroom = roundUp(_recordHeaderSize + _maxRecordSize, _alignment);
+    if (_frontCoded)
+    {
+      _keyBuffer.reset(new char[std::max(_maxKeyLength, 1u)]);
+      _previousKey.clear();
+    }
+    _buffer.release();
+    _fileOffset = 0;
+    _frame = 0;
+    _bufferUsed = _headroom;
+    _bufferNext = _headroom;
   }
 
-  struct Item {
-    const void* _data;
-    unsigned int _length;
-  };
+  void DiskRun::startReadAhead(AsyncIO* readAhead, unsigned int blockSize)
+  {
+    SORT_ASSERT(!_isWritable);
+    SORT_ASSERT(!_readAhead);
+    SORT_ASSERT(_fileOffset == 0);
+    _readAhead = readAhead;
+    if (isCompressed())
+    {
+      // The frames decompress to the blocks they were written from.
+      _packedSpare.allocate(_packedSize, 1);
+      requestFrame();
+      return;
+    }
+    _blockSize = roundUp(std::max(blockSize, (unsigned int) sizeof(Header)), _alignment);
+    _buffer.allocate(_headroom + _blockSize, _alignment);
+    _spare.allocate(_headroom + _blockSize, _alignment);
+    requestBlock();
+  }
 
-  bool DiskRun::next()
+  unsigned long long DiskRun::readAheadFootprint(unsigned int blockSize) const
   {
-    SORT_ASSERT_DEBUGONLY(!_isWritable);
-    ssize_t amountRead = read(_fd, &_header, sizeof(Header));
-    if (amountRead == sizeof(Header))
+    if (isCompressed())
     {
-      ssize_t dataLength = (size_t) (_header._keyPlusPayloadLength);
-      amountRead = read(_fd, _buffer.get(), dataLength);
-      if (amountRead == dataLength)
+      return _packedSize; // _packedSpare
+    }
+    unsigned int size = 
+      _headroom + roundUp(std::max(blockSize, (unsigned int) sizeof(Header)), _alignment);
+    return 2 * (unsigned long long) size; // _buffer and _spare
+  }
+
+  void DiskRun::stopReadAhead()
+  {
+    if (_readAhead)
+    {
+      if (_readPending)
       {
-        return true;
+        _readAhead->wait(&_request);
+        _readPending = false;
       }
-      // TBD
-      SORT_ASSERT(amountRead == dataLength);
+      _readAhead = nullptr;
     }
+  }
 
-    // TBD
-    SORT_ASSERT(amountRead == 0); // EOF
-    close();
-    return false;
+  inline
+  void DiskRun::requestBlock()
+  {
+    if (_fileOffset < _fileSize)
+    {
+      _request._fd = _fd;
+      _request._data = _spare.data() + _headroom;
+      _request._length = (size_t) _blockSize;
+      _request._offset = _fileOffset;
+      _request._isWrite = false;
+      _readAhead->submit(&_request);
+      _readPending = true;
+    }
+  }
+
+  inline
+  void DiskRun::requestFrame()
+  {
+    if (_frame < _frameLengths.size())
+    {
+      _request._fd = _fd;
+      _request._data = _packedSpare.data();
+      _request._length = (size_t) _frameLengths[_frame];
+      _request._offset = _fileOffset;
+      _request._isWrite = false;
+      _readAhead->submit(&_request);
+      _readPending = true;
+    }
+  }
+
+  bool DiskRun::fillCompressed(unsigned int needed)
+  {
+    unsigned int available = _bufferUsed - _bufferNext;
+    while (available < needed)
+    {
+      if (_frame >= _frameLengths.size())
+      {
+        // EOF, which must fall between records
+        SORT_ASSERT(available == 0);
+        return false;
+      }
+      unsigned int frameLength = _frameLengths[_frame];
+      if (_readAhead)
+      {
+        SORT_ASSERT(_readPending);
+        _readAhead->wait(&_request);
+        _readPending = false;
+        if (_request._result != (ssize_t) frameLength)
+        {
+          throw new DiskIOException("pread", _request._error);
+        }
+        _packed.swap(_packedSpare);
+      }
+      else
+      {
+        char* data = _packed.data();
+        size_t remaining = (size_t) frameLength;
+        off_t offset = (off_t) _fileOffset;
+        while (remaining)
+        {
+          ssize_t amountRead = ::pread(_fd, data, remaining, offset);
+          if (amountRead <= 0)
+          {
+            throw new DiskIOException("pread", amountRead < 0 ? errno : 0);
+          }
+          data += amountRead;
+          offset += amountRead;
+          remaining -= (size_t) amountRead;
+        }
+      }
+      _fileOffset += frameLength;
+      ++ _frame;
+      if (_readAhead)
+      {
+        // Read the next frame while this one is decompressed.
+        requestFrame();
+      }
+
+      FrameHeader header;
+      memcpy(&header, _packed.data(), sizeof(FrameHeader));
+      if (sizeof(FrameHeader) + header._packedLength != frameLength ||
+          header._length > _blockSize)
+      {
+        throw new DiskIOException("decompress", 0);
+      }
+      memmove(_buffer.data() + _headroom - available, 
+              _buffer.data() + _bufferNext, (size_t) available);
+      const char* packedData = _packed.data() + sizeof(FrameHeader);
+      char* target = _buffer.data() + _headroom;
+      if (header._packedLength == header._length)
+      {
+        memcpy(target, packedData, (size_t) header._length);
+      }
+      else if (!lzDecompress(packedData, header._packedLength,
+                             target, header._length))
+      {
+        throw new DiskIOException("decompress", 0);
+      }
+      _bufferNext = _headroom - available;
+      _bufferUsed = _headroom + header._length;
+      available += header._length;
+    }
+    return true;
+  }
+
+  bool DiskRun::fillAhead(unsigned int needed)
+  {
+    unsigned int available = _bufferUsed - _bufferNext;
+    while (available < needed)
+    {
+      if (!_readPending)
+      {
+        // EOF, which must fall between records
+        SORT_ASSERT(available == 0);
+        return false;
+      }
+      _readAhead->wait(&_request);
+      _readPending = false;
+      if (_request._result <= 0)
+      {
+        throw new DiskIOException("pread", _request._error);
+      }
+
+      // Since needed is never more than the largest record, the partial
+      // record always fits in the headroom.
+      unsigned int valid = (unsigned int) 
+        std::min((unsigned long long) _request._result, _fileSize - _fileOffset);
+      memcpy(_spare.data() + _headroom - available, 
+             _buffer.data() + _bufferNext, (size_t) available);
+      _buffer.swap(_spare);
+      _bufferNext = _headroom - available;
+      _bufferUsed = _headroom + valid;
+      _fileOffset += (unsigned long long) _request._result;
+      available += valid;
+      requestBlock();
+    }
+    return true;
+  }
+
+  bool DiskRun::startMapped()
+  {
+    SORT_ASSERT(!_isWritable);
+    SORT_ASSERT(!_readAhead);
+    SORT_ASSERT(_fileOffset == 0);
+    if (_fileSize == 0 || isCompressed())
+    {
+      return false;
+    }
+    size_t length = (size_t) roundUp(_fileSize, _alignment);
+    void* mapping = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, _fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+      return false;
+    }
+    ::madvise(mapping, length, MADV_SEQUENTIAL);
+    _mapping = (const char*) mapping;
+    _mappingLength = length;
+    _mappingNext = 0;
+    _mappingDropped = 0;
+    _buffer.release();
+    return true;
+  }
+
+  void DiskRun::unmap()
+  {
+    if (_mapping)
+    {
+      ::munmap(const_cast<char*>(_mapping), (size_t) _mappingLength);
+      _mapping = nullptr;
+    }
+  }
+
+  bool DiskRun::nextMapped()
+  {
+    if (_mappingNext >= _fileSize)
+    {
+      unmap();
+      close();
+      return false;
+    }
+    const char* record = _mapping + _mappingNext;
+    parseRecord(record);
+    _mappingNext += _recordHeaderSize + _header._keyPlusPayloadLength;
+    SORT_ASSERT(_mappingNext <= _fileSize);
+
+    // Release the pages wholly before the current record.
+    unsigned long long current = (unsigned long long) (record - _mapping);
+    if (current - _mappingDropped >= MAPPING_DROP_INTERVAL)
+    {
+      static const unsigned long long pageSize = (unsigned long long) sysconf(_SC_PAGESIZE);
+      unsigned long long dropTo = (current / pageSize) * pageSize;
+      ::madvise(const_cast<char*>(_mapping) + _mappingDropped, 
+                (size_t) (dropTo - _mappingDropped), MADV_DONTNEED);
+      _mappingDropped = dropTo;
+    }
+    return true;
+  }
+
+  // Make sure at least "needed" bytes of the file are in the buffer
+  // starting at _bufferNext. Returns false at the end of the file.
+  bool DiskRun::fill(unsigned int needed)
+  {
+    unsigned int available = _bufferUsed - _bufferNext;
+    if (available >= needed)
+    {
+      return true;
+    }
+    if (!_buffer.data())
+    {
+      _buffer.allocate(_headroom + _blockSize, _alignment);
+    }
+    if (isCompressed())
+    {
+      return fillCompressed(needed);
+    }
+    if (_readAhead)
+    {
+      return fillAhead(needed);
+    }
+
+    while (available < needed)
+    {
+      if (_fileOffset >= _fileSize)
+      {
+        // EOF, which must fall between records
+        SORT_ASSERT(available == 0);
+        return false;
+      }
+      memmove(_buffer.data() + _headroom - available, 
+              _buffer.data() + _bufferNext, (size_t) available);
+      ssize_t amountRead = ::pread(_fd, _buffer.data() + _headroom, 
+                                   (size_t) _blockSize, (off_t) _fileOffset);
+      if (amountRead <= 0)
+      {
+        // an error, or the file is shorter than was written
+        throw new DiskIOException("pread", amountRead < 0 ? errno : 0);
+      }
+      unsigned int valid = (unsigned int) 
+        std::min((unsigned long long) amountRead, _fileSize - _fileOffset);
+      _bufferNext = _headroom - available;
+      _bufferUsed = _headroom + valid;
+      _fileOffset += (unsigned long long) amountRead;
+      available += valid;
+    }
+    return true;
+  }
+
+  bool DiskRun::next()
+  {
+    SORT_ASSERT_DEBUGONLY(!_isWritable);
+    if (_mapping)
+    {
+      return nextMapped();
+    }
+    if (!fill(_fixedLength ? _fixedHeader._keyPlusPayloadLength : _recordHeaderSize))
+    {
+      stopReadAhead();
+      close();
+      return false;
+    }
+    if (!_fixedLength)
+    {
+      memcpy(&_header, _buffer.data() + _bufferNext, sizeof(Header));
+    }
+    else
+    {
+      _header = _fixedHeader;
+    }
+    unsigned int recordSize = _recordHeaderSize + _header._keyPlusPayloadLength;
+    SORT_ASSERT(fill(recordSize));
+    parseRecord(_buffer.data() + _bufferNext);
+    _bufferNext += recordSize;
+    return true;
+  }
+
+  // Point at the record's key and payload. A front-coded key is rebuilt
+  // in _keyBuffer, which still holds the previous key's prefix.
+  inline
+  void DiskRun::parseRecord(const char* record)
+  {
+    if (_fixedLength)
+    {
+      _header = _fixedHeader;
+    }
+    else
+    {
+      memcpy(&_header, record, sizeof(Header));
+    }
+    _current = record + _recordHeaderSize;
+    if (_frontCoded)
+    {
+      memcpy(&_sharedLength, record + sizeof(Header), sizeof(_sharedLength));
+      SORT_ASSERT_DEBUGONLY(_sharedLength + _header._keyLength <= _maxKeyLength);
+      memcpy(_keyBuffer.get() + _sharedLength, _current, (size_t) _header._keyLength);
+      _key = _keyBuffer.get();
+      _keyLength = _sharedLength + _header._keyLength;
+    }
+    else
+    {
+      _key = _current;
+      _keyLength = _header._keyLength;
+    }
   }
 
   DiskRun::Item DiskRun::getKey() const
   {
     SORT_ASSERT_DEBUGONLY(!_isWritable);
     SORT_ASSERT_DEBUGONLY(_fd != -1);
-    return Item(_buffer.get(), _header._keyLength);
+    return Item(_key, _keyLength);
   }
 
   DiskRun::Item DiskRun::getPayload() const
   {
     SORT_ASSERT_DEBUGONLY(!_isWritable);
     SORT_ASSERT_DEBUGONLY(_fd != -1);
-    return Item(_buffer.get()+_header._keyLength, _header._keyPlusPayloadLength - _header._keyLength);
+    return Item(_current + _header._keyLength, 
+                _header._keyPlusPayloadLength - _header._keyLength);
   }
 
   void DiskRun::copyCurrentFrom(const DiskRun& source)
@@ -138,14 +747,44 @@ namespace external_sort {
     SORT_ASSERT_DEBUGONLY(source._fd != -1);
     SORT_ASSERT_DEBUGONLY(_isWritable);
     SORT_ASSERT_DEBUGONLY(_fd != -1);
-    _writeVector[1].iov_base = const_cast<Header*>(&source._header);
-    _writeVector[1].iov_len = (size_t) sizeof(Header);
-    _writeVector[2].iov_base = const_cast<char*>(source._buffer.get());
-    _writeVector[2].iov_len = (size_t) sizeof(source._header._keyPlusPayloadLength);
-    ssize_t written = ::writev(_fd, &_writeVector[1], 2);
-    // TBD: real exceptions
-    SORT_ASSERT(written == (ssize_t) source._header._keyPlusPayloadLength + sizeof(Header));
+    if (_frontCoded || source._frontCoded || _fixedLength != source._fixedLength)
+    {
+      // The key has to be re-coded against this run's previous key, or
+      // the record laid out differently.
+      write(source._key, source._keyLength,
+            source._current + source._header._keyLength,
+            source._header._keyPlusPayloadLength - source._header._keyLength);
+      return;
+    }
+    const Header& header = source._header;
+    if (header._keyPlusPayloadLength > _maxRecordSize)
+    {
+      _maxRecordSize = header._keyPlusPayloadLength;
+    }
+    _keyBytes += header._keyLength;
+    _payloadBytes += header._keyPlusPayloadLength - header._keyLength;
+
+    // The source's header (if any) immediately precedes its key and payload.
+    append(source._current - _recordHeaderSize, 
+           _recordHeaderSize + header._keyPlusPayloadLength);
   }
 
+  void DiskRun::copyCurrentFrom(const DiskRun& source, unsigned int sharedPrefixLength)
+  {
+    if (!_frontCoded)
+    {
+      copyCurrentFrom(source);
+      return;
+    }
+    SORT_ASSERT_DEBUGONLY(!source._isWritable);
+    SORT_ASSERT_DEBUGONLY(_isWritable);
+    SORT_ASSERT_DEBUGONLY(sharedPrefixLength ==
+                          commonPrefixLength(_previousKey.data(), _previousKey.size(),
+                                             source._key, source._keyLength));
+    writeRecord(source._key, source._keyLength,
+                source._current + source._header._keyLength,
+                source._header._keyPlusPayloadLength - source._header._keyLength,
+                sharedPrefixLength);
+  }
 
 } // namespace external_sort
@@ -6,8 +6,15 @@
 #ifndef EXTERNAL_SORT_DISKRUN_H
 #define EXTERNAL_SORT_DISKRUN_H
 
+#include "sorter.h" // for Compression
+#include "asyncio.h"
+
+#include <vector>
+#include <string>
 #include <memory>
-#include <sys/uio.h> // for iovec
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
 
 namespace external_sort {
 
@@ -16,21 +23,112 @@ namespace external_sort {
 
   class DiskRun {
   public:
+    static const unsigned int DEFAULT_BUFFER_SIZE = 1024 * 1024;
+    static const unsigned int MAX_READ_AHEAD_BLOCK = 64 * 1024 * 1024;
+    static const unsigned int DIRECT_IO_ALIGNMENT = 4096;
+
+    struct Options {
+      Options()
+        : _bufferSize(DEFAULT_BUFFER_SIZE)
+        , _writeBehind(nullptr)
+        , _directIO(false)
+        , _compression(NO_COMPRESSION)
+        , _compressionLevel(1)
+        , _frontCodedKeys(false)
+        , _fixedLength(false)
+        , _fixedKeyLength(0)
+        , _fixedPayloadLength(0) {}
+      // default dtor/copy/assign OK
+
+      unsigned int _bufferSize;
+      AsyncIO* _writeBehind; // must outlive the run; null writes synchronously
+      bool _directIO;        // bypass the page cache, if the file system allows
+      Compression _compression; // compressed runs are never direct or mapped
+      unsigned int _compressionLevel;
+      bool _frontCodedKeys;  // store each key as its difference from the last
+      bool _fixedLength;     // every record has the lengths below, so none
+                             // are stored; overrides _frontCodedKeys
+      unsigned int _fixedKeyLength;
+      unsigned int _fixedPayloadLength;
+    };
+
     ~DiskRun();
     static DiskRunSPtr getDiskRun(unsigned int level, 
-                                  unsigned int keyBytes,
-                                  unsigned int payloadBytes);
+                                  unsigned long long keyBytes,
+                                  unsigned long long payloadBytes,
+                                  const Options& options = Options());
 
     bool isWritable() const
     {
       return _isWritable;
     }
 
+    // True if the run was asked for, and got, O_DIRECT I/O
+    bool isDirect() const
+    {
+      return _alignment != 1;
+    }
+
+    unsigned int level() const
+    {
+      return _level;
+    }
+
+    bool isCompressed() const
+    {
+      return _compression != NO_COMPRESSION;
+    }
+
+    bool isFrontCoded() const
+    {
+      return _frontCoded;
+    }
+
+    // The bytes of records written so far (before any compression)
+    unsigned long long fileSize() const
+    {
+      return _fileSize + (_isWritable ? _bufferUsed : 0);
+    }
+
+    // The bytes of the file written so far: after compression, and with
+    // a direct run's last block padded out to the alignment
+    unsigned long long diskSize() const
+    {
+      return _diskSize;
+    }
+
+    // Totals of the key and payload bytes written so far
+    unsigned long long keyBytes() const
+    {
+      return _keyBytes;
+    }
+
+    unsigned long long payloadBytes() const
+    {
+      return _payloadBytes;
+    }
+
     void write(const void* key, unsigned int keyLength,
                const void* payload, unsigned int payloadLength);
 
     void resetForRead();
 
+    // Once reset for reading, and before the first next(), the run can
+    // read ahead through the given AsyncIO, double buffering blocks of
+    // blockSize bytes. The AsyncIO must outlive the reading.
+    void startReadAhead(AsyncIO* readAhead, unsigned int blockSize);
+    void stopReadAhead();
+
+    // The memory startReadAhead() would allocate for blockSize
+    unsigned long long readAheadFootprint(unsigned int blockSize) const;
+
+    // Alternatively, once reset for reading, and before the first next(),
+    // the run can be memory-mapped, so that next() only advances through
+    // the mapping and the key and payload point straight into it. Pages
+    // already read are dropped as reading proceeds. Returns false if the
+    // run can't be mapped, in which case it reads as usual.
+    bool startMapped();
+
     struct Item {
       Item()
         : _data(0)
@@ -45,12 +143,55 @@ namespace external_sort {
       unsigned int _length;
     };
 
+    // The key and payload returned point into the read buffer (or the
+    // mapping), and are only valid until the next call to next().
     bool next();
     Item getKey() const;
     Item getPayload() const;
+
+    // For a front-coded run, how many leading bytes the current key
+    // shares with the previous one (0 for the first record, or when the
+    // run isn't front coded).
+    unsigned int sharedPrefixLength() const
+    {
+      return _frontCoded ? _sharedLength : 0;
+    }
+
     void copyCurrentFrom(const DiskRun& source);
+
+    // As above, when the caller already knows how many leading bytes the
+    // source's current key shares with the last key written here (as the
+    // offset-value coded merge does), which saves a front-coded run from
+    // finding out for itself.
+    void copyCurrentFrom(const DiskRun& source, unsigned int sharedPrefixLength);
+
+    // The length of the longest common prefix of two keys, compared a
+    // word at a time.
+    static inline
+    unsigned int commonPrefixLength(const char* left, unsigned int leftLength,
+                                    const char* right, unsigned int rightLength)
+    {
+      unsigned int length = std::min(leftLength, rightLength);
+      unsigned int i = 0;
+      for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+      {
+        uint64_t l, r;
+        memcpy(&l, left + i, sizeof(l));
+        memcpy(&r, right + i, sizeof(r));
+        if (l != r)
+        {
+          // the first differing byte is the lowest (little-endian)
+          return i + (unsigned int) (__builtin_ctzll(l ^ r) / 8);
+        }
+      }
+      while (i < length && left[i] == right[i])
+      {
+        ++ i;
+      }
+      return i;
+    }
   private:
-    DiskRun();
+    DiskRun(const Options& options);
     // Prohibit copy/assign; do not implement
     DiskRun(const DiskRun&);
     DiskRun& operator=(const DiskRun&);
@@ -61,14 +202,133 @@ namespace external_sort {
       unsigned int _keyLength;
     };
 
-    // Linux implementation
-    std::unique_ptr<char> _buffer;
-    iovec _writeVector[3];
-    Header _header;
+    struct FrameHeader {
+      // default ctor/dtor/copy/assign OK
+      unsigned int _packedLength; // equal to _length if stored as is
+      unsigned int _length;
+    };
+
+    // An I/O buffer aligned as O_DIRECT requires
+    class Buffer {
+    public:
+      Buffer()
+        : _data(nullptr) {}
+      // default dtor OK
+      void allocate(unsigned int size, unsigned int alignment);
+      void release();
+      void swap(Buffer& other);
+      char* data() const
+      {
+        return _data;
+      }
+    private:
+      // Prohibit copy/assign; do not implement
+      Buffer(const Buffer&);
+      Buffer& operator=(const Buffer&);
+      std::unique_ptr<char[]> _storage;
+      char* _data;
+    };
+
+    // Linux implementation. The file is a stream of records, each a
+    // Header followed by the key and payload. Writing packs the stream
+    // into _buffer and writes it a block at a time; records freely 
+    // straddle blocks. In direct mode the blocks, the buffers and the
+    // file offsets are all multiples of DIRECT_IO_ALIGNMENT, and the last
+    // block is padded; _fileSize excludes the padding.
+    //
+    // When writing behind, a full _buffer is swapped with _spare and 
+    // handed to the AsyncIO, and filling continues in the other buffer
+    // once its previous write (if any) completes.
+    //
+    // Reading reads each block into _buffer after _headroom bytes, room
+    // enough for the largest record, and parses the records in place.
+    // _buffer is only allocated by the first read, since a run that goes
+    // on to read ahead or be mapped has no use for one of the usual size.
+    // When a record straddles the end of a block, its first part is
+    // moved into the headroom just ahead of the next block. When reading
+    // ahead, the next block is read into _spare while _buffer is parsed,
+    // and the buffers are swapped once the first part has been copied.
+    //
+    // A mapped run has no buffers; _mapping covers the whole file.
+    //
+    // When keys are front coded, each record's Header is followed by the
+    // length of the prefix its key shares with the previous key, and the
+    // Header's lengths count only the rest of the key. Writing keeps the
+    // previous key in _previousKey; reading rebuilds each key over the
+    // previous one in _keyBuffer.
+    //
+    // Fixed length records have no Header on disk at all, just the key
+    // and the payload; reading takes each record's Header from
+    // _fixedHeader.
+    //
+    // A compressed run is a sequence of frames, each a FrameHeader and
+    // one block of the stream, compressed. A full _buffer is compressed
+    // into _packed, which is then written (or swapped with _packedSpare
+    // and written behind), and the frame lengths are remembered so that
+    // reading (ahead) can ask for exactly one frame at a time. Each frame
+    // read is decompressed into _buffer after the headroom, just as an
+    // uncompressed block would have been read there.
+    Buffer _buffer;
+    Buffer _spare;
+    unsigned int _blockSize;
+    unsigned int _headroom;
+    unsigned int _bufferUsed;  // writing: bytes filled; reading: end of data
+    unsigned int _bufferNext;  // reading: offset of the next record
+    const char* _current;      // reading: the current record's data
+    Header _header;            // reading: the current record's header
     int _fd;
+    unsigned long long _fileOffset;
+    unsigned long long _fileSize;
+    unsigned long long _diskSize;   // _fileSize as written, see diskSize()
+    AsyncIO* _readAhead;
+    AsyncIO* _writeBehind;
+    AsyncIO::Request _request;
+    bool _readPending;
+    const char* _mapping;
+    unsigned long long _mappingLength;
+    unsigned long long _mappingNext;    // offset of the next record
+    unsigned long long _mappingDropped; // pages before this are released
+    unsigned int _alignment;
+    unsigned int _level;
     unsigned int _maxRecordSize;
+    unsigned long long _keyBytes;
+    unsigned long long _payloadBytes;
     bool _isWritable;
+    Compression _compression;
+    unsigned int _compressionLevel;
+    Buffer _packed;
+    Buffer _packedSpare;
+    unsigned int _packedSize;           // the largest frame
+    std::vector<unsigned int> _frameLengths;
+    unsigned int _frame;                // reading: the next frame
+    bool _frontCoded;
+    unsigned int _recordHeaderSize;     // Header, plus the shared length
+    std::string _previousKey;           // writing, when front coded
+    std::unique_ptr<char[]> _keyBuffer; // reading, when front coded
+    const char* _key;                   // reading: the current key
+    unsigned int _keyLength;
+    unsigned int _sharedLength;
+    unsigned int _maxKeyLength;
+    bool _fixedLength;
+    Header _fixedHeader;
 
+    void writeRecord(const void* key, unsigned int keyLength,
+                     const void* payload, unsigned int payloadLength,
+                     unsigned int shared);
+    void allocateWriteBuffers();
+    void append(const void* data, unsigned int length);
+    void flush();
+    void flushCompressed();
+    void writeBlock(Buffer& buffer, Buffer& spare, unsigned int length);
+    void awaitWrite();
+    bool fill(unsigned int needed);
+    bool fillAhead(unsigned int needed);
+    bool fillCompressed(unsigned int needed);
+    void requestBlock();
+    void requestFrame();
+    bool nextMapped();
+    void parseRecord(const char* record);
+    void unmap();
     void close();
 
     static unsigned int _seq;
@@ -77,4 +337,3 @@ namespace external_sort {
 } // namespace external_sort
 
 #endif // EXTERNAL_SORT_DISKRUN_H
-
@@ -4,9 +4,15 @@
 // for the detailed license.
 
 #include "diskrun.h"
+#include "asyncio.h"
+#include "merger.h"
 #include "gtest/gtest.h"
 
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <errno.h>
 
 namespace {
 
@@ -43,4 +49,383 @@ namespace {
     }
     ASSERT_TRUE(!run->next());
   }
+
+  // Writes records to a run with the options of each test, then reads
+  // them back and checks them, however the run was read.
+  class DiskRunTest : public ::testing::Test {
+  protected:
+    typedef std::pair<std::string, std::string> Record; // key, payload
+
+    // A record keyed by its index, as an unsigned int
+    void addIndexed(const std::string& payload)
+    {
+      unsigned int i = _records.size();
+      add(std::string((const char*) &i, sizeof(i)), payload);
+    }
+
+    void add(const std::string& key, const std::string& payload)
+    {
+      _records.push_back(Record(key, payload));
+    }
+
+    // Writes the records to a new run, leaving it writable.
+    external_sort::DiskRunSPtr writeRecords(const external_sort::DiskRun::Options& options)
+    {
+      external_sort::DiskRunSPtr run = external_sort::DiskRun::getDiskRun(0,1,1,options);
+      for (auto record : _records)
+      {
+        run->write(record.first.data(), record.first.size(),
+                   record.second.data(), record.second.size());
+      }
+      return run;
+    }
+
+    // Copies the rest of run, which is being read, to a new run.
+    external_sort::DiskRunSPtr copyRun(external_sort::DiskRun& run,
+                                       const external_sort::DiskRun::Options& options)
+    {
+      external_sort::DiskRunSPtr copy = external_sort::DiskRun::getDiskRun(0,1,1,options);
+      while (run.next())
+      {
+        copy->copyCurrentFrom(run);
+      }
+      return copy;
+    }
+
+    // Reads the whole of run, which has been reset for reading (and
+    // perhaps started reading ahead or mapped), checking that it holds
+    // the records in order. If inPlace, the records must also be
+    // consecutive in memory, as in a mapping.
+    void checkRecords(external_sort::DiskRun& run, bool inPlace = false)
+    {
+      const char* previous = nullptr;
+      for (unsigned int i = 0; i < _records.size(); ++i)
+      {
+        ASSERT_TRUE(run.next());
+        external_sort::DiskRun::Item key = run.getKey();
+        external_sort::DiskRun::Item payload = run.getPayload();
+        ASSERT_EQ(_records[i].first, std::string((const char*) key._data, key._length));
+        ASSERT_EQ(_records[i].second, std::string((const char*) payload._data, payload._length));
+        if (run.isFrontCoded())
+        {
+          unsigned int shared = (i == 0 ? 0 :
+            external_sort::DiskRun::commonPrefixLength(_records[i].first.data(),
+                                                       _records[i].first.size(),
+                                                       _records[i-1].first.data(),
+                                                       _records[i-1].first.size()));
+          ASSERT_EQ(shared, run.sharedPrefixLength());
+        }
+        if (inPlace)
+        {
+          ASSERT_TRUE(previous == nullptr || previous < (const char*) payload._data);
+          previous = (const char*) payload._data;
+        }
+      }
+      ASSERT_TRUE(!run.next());
+    }
+
+    std::vector<Record> _records;
+  };
+
+  TEST_F(DiskRunTest, SmallBuffer)
+  {
+    // A buffer smaller than most records, so that nearly every record
+    // straddles a buffer boundary and some are larger than the buffer.
+    for (unsigned int i = 0; i < 200; ++i)
+    {
+      addIndexed(std::string(i % 37, (char) ('a' + i % 26)));
+    }
+
+    external_sort::DiskRun::Options options;
+    options._bufferSize = 16;
+    external_sort::DiskRunSPtr run = writeRecords(options);
+    run->resetForRead();
+    options._bufferSize = 24;
+    external_sort::DiskRunSPtr copy = copyRun(*run, options);
+    copy->resetForRead();
+    checkRecords(*copy);
+  }
+
+  TEST_F(DiskRunTest, ReadAhead)
+  {
+    // Blocks smaller than most records, so that nearly every record
+    // straddles a block boundary.
+    for (unsigned int i = 0; i < 500; ++i)
+    {
+      addIndexed(std::string(i % 53, (char) ('a' + i % 26)));
+    }
+
+    external_sort::DiskRunSPtr run = writeRecords(external_sort::DiskRun::Options());
+    external_sort::AsyncIO readAhead;
+    run->resetForRead();
+    run->startReadAhead(&readAhead, 20);
+    checkRecords(*run);
+    // Every block came through the AsyncIO.
+    ASSERT_EQ(run->fileSize(), readAhead.statistics()._bytes);
+  }
+
+  TEST_F(DiskRunTest, WriteBehind)
+  {
+    for (unsigned int i = 0; i < 500; ++i)
+    {
+      addIndexed(std::string(i % 61, (char) ('a' + i % 26)));
+    }
+
+    // A tiny queue and buffer, with some records larger than the buffer.
+    external_sort::AsyncIO writeBehind(1);
+    external_sort::DiskRun::Options options;
+    options._bufferSize = 32;
+    options._writeBehind = &writeBehind;
+    external_sort::DiskRunSPtr run = writeRecords(options);
+    run->resetForRead();
+    checkRecords(*run);
+    // Every block went through the AsyncIO.
+    ASSERT_EQ(run->fileSize(), writeBehind.statistics()._bytes);
+    ASSERT_EQ((run->fileSize() + 31)/32, writeBehind.statistics()._requests);
+  }
+
+  TEST_F(DiskRunTest, Compressed)
+  {
+    // Compressible records, with some longer than the buffer, written
+    // behind and read back both directly and ahead.
+    for (unsigned int i = 0; i < 2000; ++i)
+    {
+      addIndexed(std::string(i % 701, (char) ('a' + i % 26)) + std::to_string(i));
+    }
+
+    external_sort::DiskRun::Options uncompressedOptions;
+    uncompressedOptions._bufferSize = 512;
+    external_sort::DiskRunSPtr uncompressed = writeRecords(uncompressedOptions);
+    uncompressed->resetForRead();
+
+    for (unsigned int readAhead = 0; readAhead < 2; ++readAhead)
+    {
+      external_sort::AsyncIO writeBehind(2);
+      external_sort::DiskRun::Options options;
+      options._bufferSize = 512;
+      options._writeBehind = &writeBehind;
+      options._compression = external_sort::LZ_COMPRESSION;
+      external_sort::DiskRunSPtr run = writeRecords(options);
+      ASSERT_TRUE(run->isCompressed());
+      ASSERT_FALSE(run->isDirect());
+
+      run->resetForRead();
+      ASSERT_FALSE(run->startMapped());
+      external_sort::AsyncIO reader;
+      if (readAhead)
+      {
+        run->startReadAhead(&reader, 4096);
+      }
+      checkRecords(*run);
+      // The frames written are far smaller than the records.
+      ASSERT_EQ(uncompressed->fileSize(), run->fileSize());
+      ASSERT_EQ(writeBehind.statistics()._bytes, run->diskSize());
+      ASSERT_LT(run->diskSize(), uncompressed->diskSize()/4);
+    }
+  }
+
+  TEST_F(DiskRunTest, FrontCoded)
+  {
+    // Sorted keys with long shared prefixes of varying length, some
+    // keys prefixes of the next, some records straddling the buffer.
+    std::vector<std::string> keys;
+    for (unsigned int i = 0; i < 1000; ++i)
+    {
+      std::string key = "tenant-" + std::to_string(i / 100) + "/day-" +
+        std::to_string(i / 10);
+      keys.push_back(i % 10 ? key + "/" + std::to_string(i) : key);
+    }
+    std::sort(keys.begin(), keys.end());
+    for (unsigned int i = 0; i < keys.size(); ++i)
+    {
+      add(keys[i], std::string((const char*) &i, sizeof(i)));
+    }
+
+    external_sort::DiskRun::Options options;
+    options._bufferSize = 64;
+    options._frontCodedKeys = true;
+    external_sort::DiskRunSPtr run = writeRecords(options);
+    ASSERT_TRUE(run->isFrontCoded());
+
+    // Copy to a run with whole keys, and back to a front-coded one.
+    run->resetForRead();
+    options._frontCodedKeys = false;
+    external_sort::DiskRunSPtr plain = copyRun(*run, options);
+    ASSERT_LT(run->fileSize(), (plain->fileSize() * 2)/3);
+    plain->resetForRead();
+    options._frontCodedKeys = true;
+    external_sort::DiskRunSPtr copy = copyRun(*plain, options);
+
+    copy->resetForRead();
+    ASSERT_TRUE(copy->startMapped());
+    checkRecords(*copy);
+  }
+
+  TEST_F(DiskRunTest, FixedLength)
+  {
+    // 12 byte records, some straddling the small buffer.
+    for (unsigned int i = 0; i < 1000; ++i)
+    {
+      unsigned long long payload = 1000000 + i;
+      addIndexed(std::string((const char*) &payload, sizeof(payload)));
+    }
+
+    external_sort::DiskRun::Options options;
+    options._bufferSize = 64;
+    options._fixedLength = true;
+    options._fixedKeyLength = 4;
+    options._fixedPayloadLength = 8;
+    external_sort::DiskRunSPtr run = writeRecords(options);
+    run->resetForRead();
+    // No lengths are stored.
+    ASSERT_EQ(1000u * 12, run->fileSize());
+
+    // Copy to a run with per-record headers, then back again.
+    options._fixedLength = false;
+    external_sort::DiskRunSPtr plain = copyRun(*run, options);
+    ASSERT_EQ(1000u * (12 + 8), plain->fileSize());
+    plain->resetForRead();
+    options._fixedLength = true;
+    external_sort::DiskRunSPtr copy = copyRun(*plain, options);
+    copy->resetForRead();
+    ASSERT_TRUE(copy->startMapped());
+    checkRecords(*copy, true);
+  }
+
+  TEST_F(DiskRunTest, KeysOnly)
+  {
+    // Bare 4 byte keys
+    for (unsigned int i = 0; i < 1000; ++i)
+    {
+      addIndexed("");
+    }
+
+    external_sort::DiskRun::Options options;
+    options._bufferSize = 64;
+    options._fixedLength = true;
+    options._fixedKeyLength = 4;
+    external_sort::DiskRunSPtr run = writeRecords(options);
+    run->resetForRead();
+    ASSERT_EQ(1000u * 4, run->fileSize());
+    checkRecords(*run);
+  }
+
+  TEST_F(DiskRunTest, DirectIO)
+  {
+    // Enough data for several blocks plus a partial (padded) last one.
+    // If the file system doesn't do O_DIRECT, this is a buffered run.
+    for (unsigned int i = 0; i < 1000; ++i)
+    {
+      addIndexed(std::string(i % 97, (char) ('a' + i % 26)));
+    }
+
+    external_sort::AsyncIO writeBehind;
+    external_sort::DiskRun::Options options;
+    options._bufferSize = 5000; // rounded up to the alignment
+    options._writeBehind = &writeBehind;
+    options._directIO = true;
+    external_sort::DiskRunSPtr run = writeRecords(options);
+    external_sort::AsyncIO readAhead;
+    run->resetForRead();
+    const unsigned int alignment = external_sort::DiskRun::DIRECT_IO_ALIGNMENT;
+    ASSERT_NE(0u, run->fileSize() % alignment);
+    if (run->isDirect())
+    {
+      // The last block is padded out to the alignment.
+      ASSERT_EQ(0u, run->diskSize() % alignment);
+      ASSERT_GT(run->diskSize(), run->fileSize());
+      ASSERT_LT(run->diskSize() - run->fileSize(), alignment);
+    }
+    else
+    {
+      // Buffered, so nothing is padded.
+      ASSERT_EQ(run->fileSize(), run->diskSize());
+    }
+    run->startReadAhead(&readAhead, 3000);
+    checkRecords(*run);
+  }
+
+  TEST_F(DiskRunTest, DirectIOCompressed)
+  {
+    // Frames are of any length, so a compressed run is always buffered.
+    for (unsigned int i = 0; i < 1000; ++i)
+    {
+      addIndexed(std::string(i % 97, (char) ('a' + i % 26)));
+    }
+
+    external_sort::DiskRun::Options options;
+    options._bufferSize = 5000;
+    options._directIO = true;
+    options._compression = external_sort::LZ_COMPRESSION;
+    external_sort::DiskRunSPtr run = writeRecords(options);
+    ASSERT_FALSE(run->isDirect());
+    run->resetForRead();
+    checkRecords(*run);
+  }
+
+  TEST_F(DiskRunTest, Mapped)
+  {
+    for (unsigned int i = 0; i < 1000; ++i)
+    {
+      addIndexed(std::string(i % 97, (char) ('a' + i % 26)));
+    }
+
+    external_sort::DiskRun::Options options;
+    options._bufferSize = 100;
+    external_sort::DiskRunSPtr run = writeRecords(options);
+    run->resetForRead();
+    ASSERT_TRUE(run->startMapped());
+    // Records are consecutive in the mapping; nothing is copied.
+    checkRecords(*run, true);
+  }
+
+  TEST(AsyncIO, Error)
+  {
+    // A failed request reports the errno, for the DiskRun to throw.
+    external_sort::AsyncIO io;
+    char data[16];
+    external_sort::AsyncIO::Request request;
+    request._data = data;
+    request._length = sizeof(data);
+    io.submit(&request);
+    io.wait(&request);
+    ASSERT_EQ(-1, request._result);
+    ASSERT_EQ(EBADF, request._error);
+  }
+
+  TEST(Merger, ReadAheadWithinMemory)
+  {
+    // More sources than the read-ahead memory can give blocks of a
+    // useful size, so only some of them read ahead.
+    const unsigned int sources = 100;
+    const unsigned int recordsPerSource = 50;
+    const unsigned long long readAheadMemory = 4 * 1024 * 1024;
+    external_sort::Merger::Options options;
+    options._readAheadMemory = readAheadMemory;
+    external_sort::Merger merger(options);
+    for (unsigned int s = 0; s < sources; ++s)
+    {
+      external_sort::DiskRunSPtr run = external_sort::DiskRun::getDiskRun(0,1,1);
+      for (unsigned int i = 0; i < recordsPerSource; ++i)
+      {
+        char key[16];
+        snprintf(key, sizeof(key), "%08u", i * sources + s);
+        run->write(key, 8, &s, sizeof(s));
+      }
+      merger.addSource(run);
+    }
+
+    for (unsigned int i = 0; i < sources * recordsPerSource; ++i)
+    {
+      const external_sort::DiskRun* run = merger.next();
+      ASSERT_TRUE(run != nullptr);
+      char key[16];
+      snprintf(key, sizeof(key), "%08u", i);
+      external_sort::DiskRun::Item item = run->getKey();
+      ASSERT_EQ(std::string(key), std::string((const char*) item._data, item._length));
+    }
+    ASSERT_TRUE(merger.next() == nullptr);
+    ASSERT_GT(merger.readAheadBytes(), 0u);
+    ASSERT_LE(merger.readAheadBytes(), readAheadMemory);
+  }
 }
@@ -0,0 +1,1365 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#include "sorter.h"
+#include "keyconvert.h"
+#include "gtest/gtest.h"
+
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+
+namespace {
+
+  // Keys are uint32 values; each payload is the key followed by the 
+  // record's position in the input, so both order and stability can be
+  // checked from the output alone.
+  struct Record {
+    uint32_t _key;
+    uint32_t _sequence;
+  };
+
+  class NullReceiver : public ::external_sort::Receiver {
+  public:
+    void receive(const void*, unsigned int) {}
+  };
+
+  class ExternalTest : public ::testing::Test,
+                       public ::external_sort::Receiver
+  {
+  protected:
+    std::vector<Record> source;
+    std::vector<Record> result;
+    ::external_sort::Sorter sorter;
+
+    ExternalTest()
+    {
+      sorter
+        .withReceiver(this)
+        .withRunSize(16 * 1024)
+        .stable();
+    }
+
+    void generate(unsigned int count, uint32_t keyRange)
+    {
+      std::mt19937 generator(count);
+      std::uniform_int_distribution<uint32_t> keys(0, keyRange);
+      for (unsigned int i = 0; i < count; ++i)
+      {
+        source.push_back({keys(generator), i});
+      }
+    }
+
+    void doTheSort()
+    {
+      sorter.create();
+      for (auto r: source)
+      {
+        char key[4];
+        ::external_sort::uint32ToKey(r._key, key);
+        sorter.sort(key, sizeof(key), &r, sizeof(r));
+      }
+      sorter.finish();
+    }
+
+    // The same, through sortBatch(), in batches of varying size: as
+    // spans, or (for fixed length records) packed.
+    void doTheSortInBatches(bool packed)
+    {
+      sorter.create();
+      std::vector<char> keys(4 * source.size());
+      std::vector<char> records((4 + sizeof(Record)) * source.size());
+      std::vector< ::external_sort::Span> keySpans;
+      std::vector< ::external_sort::Span> payloadSpans;
+      for (unsigned int i = 0; i < source.size(); ++i)
+      {
+        ::external_sort::uint32ToKey(source[i]._key, &keys[4*i]);
+        keySpans.push_back(::external_sort::Span(&keys[4*i], 4));
+        payloadSpans.push_back(::external_sort::Span(&source[i], sizeof(Record)));
+        char* record = &records[(4 + sizeof(Record)) * i];
+        memcpy(record, &keys[4*i], 4);
+        memcpy(record + 4, &source[i], sizeof(Record));
+      }
+      unsigned int done = 0;
+      for (unsigned int batch = 1; done < source.size(); batch = (batch * 7) % 3001)
+      {
+        unsigned int count = std::min(batch, (unsigned int) source.size() - done);
+        if (packed)
+        {
+          sorter.sortBatch(&records[(4 + sizeof(Record)) * done], count);
+        }
+        else
+        {
+          sorter.sortBatch(&keySpans[done], &payloadSpans[done], count);
+        }
+        done += count;
+      }
+      sorter.finish();
+    }
+
+    // The same, through sortBatch() in batches of 1000 spans, with a
+    // record too large for any run block in the middle of one. That one
+    // batch is cut short by the exception, and the rest of it is sorted
+    // after, so every record of the source is accepted.
+    void doTheSortInBatchesWithTooLarge(unsigned int tooLarge, bool toCursor)
+    {
+      if (toCursor)
+      {
+        sorter
+          .withReceiver(nullptr)
+          .withCursor();
+      }
+      sorter.create();
+      std::vector<char> keys(4 * source.size());
+      std::vector< ::external_sort::Span> keySpans;
+      std::vector< ::external_sort::Span> payloadSpans;
+      for (unsigned int i = 0; i < source.size(); ++i)
+      {
+        ::external_sort::uint32ToKey(source[i]._key, &keys[4*i]);
+        keySpans.push_back(::external_sort::Span(&keys[4*i], 4));
+        payloadSpans.push_back(::external_sort::Span(&source[i], sizeof(Record)));
+      }
+      std::string huge(2 * 1024 * 1024, 'x');
+      keySpans.insert(keySpans.begin() + tooLarge, keySpans[tooLarge]);
+      payloadSpans.insert(payloadSpans.begin() + tooLarge,
+                          ::external_sort::Span(huge.data(), huge.size()));
+      unsigned int done = 0;
+      while (done < keySpans.size())
+      {
+        unsigned int count = std::min(1000u, (unsigned int) keySpans.size() - done);
+        if (done <= tooLarge && tooLarge < done + count)
+        {
+          ASSERT_THROW(sorter.sortBatch(&keySpans[done], &payloadSpans[done], count),
+                       ::external_sort::RecordSizeException*);
+          done = tooLarge + 1;
+          continue;
+        }
+        sorter.sortBatch(&keySpans[done], &payloadSpans[done], count);
+        done += count;
+      }
+      if (toCursor)
+      {
+        receiveFromCursor();
+      }
+      else
+      {
+        sorter.finish();
+      }
+    }
+
+    // The same, pulling the output from a cursor instead of having it
+    // pushed to the receiver, and checking each key against the copy of
+    // it in the payload.
+    void doTheSortToCursor()
+    {
+      sorter
+        .withReceiver(nullptr)
+        .withCursor()
+        .create();
+      for (auto r: source)
+      {
+        char key[4];
+        ::external_sort::uint32ToKey(r._key, key);
+        sorter.sort(key, sizeof(key), &r, sizeof(r));
+      }
+      receiveFromCursor();
+    }
+
+    void receiveFromCursor()
+    {
+      ::external_sort::Cursor& cursor = sorter.finishToCursor();
+      while (cursor.next())
+      {
+        ::external_sort::Span payload = cursor.payload();
+        receive(payload._data, payload._length);
+        ::external_sort::Span key = cursor.key();
+        char expected[4];
+        ::external_sort::uint32ToKey(result.back()._key, expected);
+        ASSERT_EQ(4u, key._length);
+        ASSERT_EQ(0, memcmp(expected, key._data, 4));
+      }
+      ASSERT_FALSE(cursor.next());
+    }
+
+    void receive(const void* payload, unsigned int payloadLength)
+    {
+      ASSERT_EQ(sizeof(Record), payloadLength);
+      result.push_back(*(const Record*) payload);
+    }
+
+    struct less {
+      bool operator() (const Record& l, const Record& r)
+      {
+        return l._key < r._key;
+      }
+    };
+
+    void checkResult() {
+      ASSERT_EQ(source.size(), result.size())
+        << "Source and result vector lengths differ. source: "
+        << source.size() << ", result: " << result.size();
+
+      std::stable_sort(source.begin(), source.end(), less());
+
+      for (unsigned int i = 0; i < source.size(); ++i)
+      {
+        ASSERT_TRUE(source[i]._key == result[i]._key &&
+                    source[i]._sequence == result[i]._sequence)
+          << "difference at " << i << ". source: (" 
+          << source[i]._key << ", " << source[i]._sequence
+          << "), result: (" << result[i]._key << ", " 
+          << result[i]._sequence << ")";
+      }
+    }
+
+    void sortAndCheck()
+    {
+      doTheSort();
+      checkResult();
+    }
+
+    // Sorts the same source with a second sorter, set up as the fixture's
+    // is and then by configure, and returns its statistics, to compare a
+    // feature's statistics with those of a sort without it. Must be
+    // called before checkResult(), which reorders the source.
+    template <typename Configure>
+    ::external_sort::SorterStatistics referenceStatistics(Configure configure)
+    {
+      NullReceiver receiver;
+      ::external_sort::Sorter reference;
+      reference
+        .withReceiver(&receiver)
+        .withRunSize(16 * 1024)
+        .stable();
+      configure(reference);
+      reference.create();
+      for (auto r: source)
+      {
+        char key[4];
+        ::external_sort::uint32ToKey(r._key, key);
+        reference.sort(key, sizeof(key), &r, sizeof(r));
+      }
+      reference.finish();
+      return reference.statistics();
+    }
+
+    // For a sort with a limit: only the first limit records are expected.
+    void checkLimitedResult(unsigned int limit)
+    {
+      std::stable_sort(source.begin(), source.end(), less());
+      source.resize(std::min((size_t) limit, source.size()));
+      checkResult();
+    }
+  };
+
+  TEST_F(ExternalTest, SingleMerge)
+  {
+    generate(5000, 1000000);
+    sortAndCheck();
+    ASSERT_GT(sorter.statistics()._writeBehindBlocks, 0u);
+  }
+
+  TEST_F(ExternalTest, MultiLevelMerge)
+  {
+    sorter.withMaxMergeWidth(3);
+    generate(50000, 1000000);
+    sortAndCheck();
+  }
+
+  TEST_F(ExternalTest, ManyDuplicates)
+  {
+    sorter.withMaxMergeWidth(4);
+    generate(50000, 10);
+    sortAndCheck();
+  }
+
+  TEST_F(ExternalTest, SpillThreads)
+  {
+    sorter
+      .withMaxMergeWidth(4)
+      .withThreads(4);
+    generate(50000, 1000);
+    ::external_sort::SorterStatistics oneThread = 
+      referenceStatistics([](::external_sort::Sorter& reference) {
+          reference
+            .withMaxMergeWidth(4)
+            .withThreads(1);
+        });
+    sortAndCheck();
+    // The runs are filled the same way whichever thread spills them, and
+    // none is lost or spilled twice; since they are added to the levels
+    // in order, the same merges follow.
+    ASSERT_GT(oneThread._runs, 4u);
+    ASSERT_EQ(oneThread._runs, sorter.statistics()._runs);
+    ASSERT_EQ(oneThread._writeBehindBytes, sorter.statistics()._writeBehindBytes);
+  }
+
+  TEST_F(ExternalTest, WriteBehindPerThread)
+  {
+    sorter
+      .withMaxMergeWidth(4)
+      .withThreads(4)
+      .withWriteBehindDepth(1);
+    generate(50000, 1000);
+    sortAndCheck();
+    // Every spilled record went through one queue or another, and the
+    // statistics cover them all.
+    ::external_sort::SorterStatistics statistics = sorter.statistics();
+    ASSERT_GE(statistics._writeBehindBytes, source.size() * (4 + sizeof(Record)));
+    ASSERT_LE(statistics._writeBehindWaits, 2 * statistics._writeBehindBlocks);
+    ASSERT_TRUE(statistics._writeBehindWaits > 0 ||
+                statistics._writeBehindWaitNanoseconds == 0);
+  }
+
+  TEST_F(ExternalTest, IOBufferSize)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withIOBufferSize(4096);
+    generate(50000, 1000);
+    sortAndCheck();
+    // Runs are written a (mostly full) buffer at a time, rather than a
+    // write per record.
+    ::external_sort::SorterStatistics statistics = sorter.statistics();
+    ASSERT_GT(statistics._writeBehindBlocks, 0u);
+    ASSERT_LE(statistics._writeBehindBytes, 4096 * statistics._writeBehindBlocks);
+    ASSERT_LT(4096 * statistics._writeBehindBlocks, 2 * statistics._writeBehindBytes);
+  }
+
+  TEST_F(ExternalTest, NoReadAhead)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withReadAheadMemory(0);
+    generate(50000, 1000);
+    sortAndCheck();
+  }
+
+  TEST_F(ExternalTest, NoWriteBehind)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withWriteBehindDepth(0);
+    generate(50000, 1000);
+    sortAndCheck();
+    ASSERT_EQ(0u, sorter.statistics()._writeBehindBlocks);
+    ASSERT_EQ(0u, sorter.statistics()._mappedRuns); // none by default
+  }
+
+  TEST_F(ExternalTest, DirectIO)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .directIO();
+    generate(50000, 1000);
+    sortAndCheck();
+  }
+
+  TEST_F(ExternalTest, MappedRuns)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withMaxMappedRunSize(1024 * 1024);
+    generate(50000, 1000);
+    sortAndCheck();
+    // Every run is well under 1MB, so every merge source is mapped.
+    ASSERT_GT(sorter.statistics()._mappedRuns, sorter.statistics()._runs);
+  }
+
+  TEST_F(ExternalTest, MappedRunsCursor)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withMaxMappedRunSize(1024 * 1024);
+    generate(50000, 1000);
+    doTheSortToCursor();
+    checkResult();
+    ASSERT_GT(sorter.statistics()._mappedRuns, sorter.statistics()._runs);
+  }
+
+  TEST_F(ExternalTest, HeapMerge)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withMergeAlgorithm(::external_sort::HEAP_MERGE);
+    generate(50000, 1000);
+    sortAndCheck();
+  }
+
+  TEST_F(ExternalTest, RadixSort)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withSortAlgorithm(::external_sort::RADIX_SORT);
+    generate(50000, 1000);
+    sortAndCheck();
+  }
+
+  TEST_F(ExternalTest, SortThreads)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withSortThreads(2);
+    generate(50000, 1000);
+    sortAndCheck();
+  }
+
+  TEST_F(ExternalTest, Compressed)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withIOBufferSize(4096)
+      .withCompression(::external_sort::LZ_COMPRESSION, 3);
+    generate(50000, 1000);
+    ::external_sort::SorterStatistics uncompressed = 
+      referenceStatistics([](::external_sort::Sorter& reference) {
+          reference
+            .withMaxMergeWidth(5)
+            .withIOBufferSize(4096);
+        });
+    sortAndCheck();
+    // The same runs and merges, in well under half the bytes (the keys
+    // are repeated in the payloads, and sorted runs repeat them too)
+    ::external_sort::SorterStatistics statistics = sorter.statistics();
+    ASSERT_EQ(uncompressed._runs, statistics._runs);
+    ASSERT_LT(2 * statistics._writeBehindBytes, uncompressed._writeBehindBytes);
+  }
+
+  TEST_F(ExternalTest, FrontCodedKeys)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .frontCodeKeys();
+    generate(50000, 1000);
+    sortAndCheck();
+  }
+
+  TEST_F(ExternalTest, FixedLength)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withFixedLengthRecords(4, sizeof(Record));
+    generate(50000, 1000);
+    sortAndCheck();
+    // 12 bytes a record, with no per-record lengths, is about 1365
+    // records to a 16KB run.
+    ASSERT_LT(sorter.statistics()._runs, 40u);
+  }
+
+  TEST_F(ExternalTest, Batches)
+  {
+    sorter.withMaxMergeWidth(5);
+    generate(50000, 1000);
+    ::external_sort::SorterStatistics oneAtATime = 
+      referenceStatistics([](::external_sort::Sorter& reference) {
+          reference.withMaxMergeWidth(5);
+        });
+    doTheSortInBatches(false);
+    checkResult();
+    // Batches fill the runs just as the records one at a time would.
+    ASSERT_GT(oneAtATime._runs, 1u);
+    ASSERT_EQ(oneAtATime._runs, sorter.statistics()._runs);
+    ASSERT_EQ(oneAtATime._writeBehindBytes, sorter.statistics()._writeBehindBytes);
+  }
+
+  TEST_F(ExternalTest, PackedBatches)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withFixedLengthRecords(4, sizeof(Record));
+    generate(50000, 1000);
+    ::external_sort::SorterStatistics oneAtATime = 
+      referenceStatistics([](::external_sort::Sorter& reference) {
+          reference
+            .withMaxMergeWidth(5)
+            .withFixedLengthRecords(4, sizeof(Record));
+        });
+    doTheSortInBatches(true);
+    checkResult();
+    ASSERT_GT(oneAtATime._runs, 1u);
+    ASSERT_EQ(oneAtATime._runs, sorter.statistics()._runs);
+    ASSERT_EQ(oneAtATime._writeBehindBytes, sorter.statistics()._writeBehindBytes);
+  }
+
+  TEST_F(ExternalTest, PackedBatchesInMemory)
+  {
+    sorter
+      .withRunSize(1024 * 1024)
+      .withFixedLengthRecords(4, sizeof(Record));
+    generate(5000, 1000);
+    doTheSortInBatches(true);
+    checkResult();
+    ASSERT_EQ(0u, sorter.statistics()._runs);
+  }
+
+  TEST_F(ExternalTest, BatchRecordTooLarge)
+  {
+    generate(50000, 1000000);
+    doTheSortInBatchesWithTooLarge(20500, false);
+    checkResult();
+  }
+
+  TEST_F(ExternalTest, BatchRecordTooLargeInMemory)
+  {
+    sorter.withRunSize(1024 * 1024);
+    generate(5000, 1000000);
+    doTheSortInBatchesWithTooLarge(2500, false);
+    checkResult();
+    ASSERT_EQ(0u, sorter.statistics()._runs);
+  }
+
+  TEST_F(ExternalTest, BatchRecordTooLargeCursor)
+  {
+    // The cursor reads as many records as the run counts.
+    sorter.withRunSize(1024 * 1024);
+    generate(5000, 1000000);
+    doTheSortInBatchesWithTooLarge(2500, true);
+    checkResult();
+    ASSERT_EQ(0u, sorter.statistics()._runs);
+  }
+
+  TEST_F(ExternalTest, PackedBatchesReplacementSelection)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withRunGeneration(::external_sort::REPLACEMENT_SELECTION)
+      .withFixedLengthRecords(4, sizeof(Record));
+    generate(50000, 1000);
+    doTheSortInBatches(true);
+    checkResult();
+  }
+
+  TEST_F(ExternalTest, ReplacementSelection)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withRunGeneration(::external_sort::REPLACEMENT_SELECTION);
+    generate(50000, 1000);
+    ::external_sort::SorterStatistics filled = 
+      referenceStatistics([](::external_sort::Sorter& reference) {
+          reference.withMaxMergeWidth(5);
+        });
+    sortAndCheck();
+    // Each record takes a 32 byte chunk, so 16KB holds 512 of them and
+    // the input is about 98 memory loads; runs average twice that size
+    // on random input. That's still fewer runs than filling and sorting
+    // the same memory makes, despite the chunks' overhead.
+    ASSERT_LT(sorter.statistics()._runs, 60u);
+    ASSERT_LT(sorter.statistics()._runs, filled._runs);
+  }
+
+  TEST_F(ExternalTest, ReplacementSelectionNearlySorted)
+  {
+    sorter.withRunGeneration(::external_sort::REPLACEMENT_SELECTION);
+    for (unsigned int i = 0; i < 50000; ++i)
+    {
+      // each key is out of order by at most a few records
+      source.push_back({i + (i * 7919) % 16, i});
+    }
+    sortAndCheck();
+    ASSERT_EQ(1u, sorter.statistics()._runs);
+  }
+
+  TEST_F(ExternalTest, Limit)
+  {
+    sorter.withLimit(1000);
+    generate(50000, 1000000);
+    doTheSort();
+    checkLimitedResult(1000);
+    ASSERT_EQ(0u, sorter.statistics()._runs);
+    ASSERT_EQ(0u, sorter.statistics()._writeBehindBlocks);
+  }
+
+  TEST_F(ExternalTest, LimitManyDuplicates)
+  {
+    // the cut falls among equal keys, which have to keep their order
+    sorter.withLimit(1234);
+    generate(50000, 10);
+    doTheSort();
+    checkLimitedResult(1234);
+    ASSERT_EQ(0u, sorter.statistics()._runs);
+  }
+
+  TEST_F(ExternalTest, LimitAboveInput)
+  {
+    sorter.withLimit(100000);
+    generate(5000, 1000);
+    sortAndCheck();
+    ASSERT_EQ(0u, sorter.statistics()._runs);
+  }
+
+  TEST_F(ExternalTest, LimitCursor)
+  {
+    sorter.withLimit(100);
+    generate(50000, 1000);
+    doTheSortToCursor();
+    checkLimitedResult(100);
+    ASSERT_EQ(0u, sorter.statistics()._runs);
+    ASSERT_EQ(0u, sorter.statistics()._writeBehindBlocks);
+  }
+
+  TEST_F(ExternalTest, LimitPackedBatches)
+  {
+    sorter
+      .withLimit(500)
+      .withRunGeneration(::external_sort::REPLACEMENT_SELECTION)
+      .withFixedLengthRecords(4, sizeof(Record));
+    generate(50000, 1000);
+    doTheSortInBatches(true);
+    checkLimitedResult(500);
+    ASSERT_EQ(0u, sorter.statistics()._runs);
+  }
+
+  TEST_F(ExternalTest, ReplacementSelectionInMemory)
+  {
+    sorter
+      .withRunSize(1024 * 1024)
+      .withRunGeneration(::external_sort::REPLACEMENT_SELECTION);
+    generate(5000, 1000);
+    sortAndCheck();
+    ASSERT_EQ(0u, sorter.statistics()._runs);
+  }
+
+  TEST_F(ExternalTest, CursorMerge)
+  {
+    sorter.withMaxMergeWidth(3);
+    generate(50000, 1000);
+    doTheSortToCursor();
+    checkResult();
+  }
+
+  TEST_F(ExternalTest, CursorHeapMerge)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withMergeAlgorithm(::external_sort::HEAP_MERGE);
+    generate(50000, 1000);
+    doTheSortToCursor();
+    checkResult();
+  }
+
+  TEST_F(ExternalTest, CursorFrontCodedKeys)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .frontCodeKeys();
+    generate(50000, 1000);
+    doTheSortToCursor();
+    checkResult();
+    ASSERT_GT(sorter.statistics()._offsetValueMerges, 1u);
+  }
+
+  TEST_F(ExternalTest, CursorInMemory)
+  {
+    sorter.withRunSize(1024 * 1024);
+    generate(5000, 1000);
+    doTheSortToCursor();
+    checkResult();
+    ASSERT_EQ(0u, sorter.statistics()._runs);
+  }
+
+  TEST_F(ExternalTest, CursorReplacementSelection)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withRunGeneration(::external_sort::REPLACEMENT_SELECTION);
+    generate(50000, 1000);
+    doTheSortToCursor();
+    checkResult();
+  }
+
+  TEST_F(ExternalTest, CursorReplacementSelectionInMemory)
+  {
+    sorter
+      .withRunSize(1024 * 1024)
+      .withRunGeneration(::external_sort::REPLACEMENT_SELECTION);
+    generate(5000, 1000);
+    doTheSortToCursor();
+    checkResult();
+    ASSERT_EQ(0u, sorter.statistics()._runs);
+  }
+
+  TEST(External, NoReceiver)
+  {
+    ::external_sort::Sorter sorter;
+    ASSERT_THROW(sorter.create(), ::external_sort::NoReceiverException*);
+
+    ::external_sort::Sorter pulled;
+    pulled.withCursor().create();
+    ASSERT_THROW(pulled.finish(), ::external_sort::NoReceiverException*);
+  }
+
+  TEST_F(ExternalTest, FinishTwice)
+  {
+    generate(5000, 1000);
+    sortAndCheck();
+    ASSERT_THROW(sorter.finish(), ::external_sort::SorterFinishedMoreThanOnceException*);
+    ASSERT_THROW(sorter.finishToCursor(), ::external_sort::SorterFinishedMoreThanOnceException*);
+  }
+
+  TEST_F(ExternalTest, CursorFinishTwice)
+  {
+    generate(5000, 1000);
+    doTheSortToCursor();
+    checkResult();
+    ASSERT_THROW(sorter.finishToCursor(), ::external_sort::SorterFinishedMoreThanOnceException*);
+  }
+
+  // Hands each batch on to the test a record at a time, noting the
+  // batches' sizes and whether their payloads were packed together.
+  class BatchCounter : public ::external_sort::BatchReceiver {
+  public:
+    ::external_sort::Receiver* _target;
+    unsigned int _batches;
+    unsigned int _largestBatch;
+    bool _packed;
+
+    BatchCounter(::external_sort::Receiver* target)
+      : _target(target)
+      , _batches(0)
+      , _largestBatch(0)
+      , _packed(true) {}
+
+    void receiveBatch(const ::external_sort::Span* payloads, unsigned int count)
+    {
+      ++_batches;
+      _largestBatch = std::max(_largestBatch, count);
+      for (unsigned int i = 0; i < count; ++i)
+      {
+        if (i > 0 &&
+            payloads[i]._data != (const char*) payloads[i-1]._data + payloads[i-1]._length)
+        {
+          _packed = false;
+        }
+        _target->receive(payloads[i]._data, payloads[i]._length);
+      }
+    }
+  };
+
+  TEST_F(ExternalTest, BatchReceiverMerge)
+  {
+    BatchCounter counter(this);
+    sorter
+      .withReceiver(&counter)
+      .withMaxMergeWidth(5);
+    generate(50000, 1000);
+    sortAndCheck();
+    ASSERT_EQ(13u, counter._batches); // 50000 records, 4096 at a time
+    ASSERT_EQ(::external_sort::BatchReceiver::MAX_BATCH_RECORDS, counter._largestBatch);
+    ASSERT_TRUE(counter._packed);
+  }
+
+  TEST_F(ExternalTest, BatchReceiverInMemory)
+  {
+    BatchCounter counter(this);
+    sorter
+      .withReceiver(&counter)
+      .withRunSize(1024 * 1024);
+    generate(5000, 1000);
+    sortAndCheck();
+    ASSERT_EQ(0u, sorter.statistics()._runs);
+    ASSERT_EQ(2u, counter._batches);
+  }
+
+  TEST_F(ExternalTest, BatchReceiverReplacementSelection)
+  {
+    BatchCounter counter(this);
+    sorter
+      .withReceiver(&counter)
+      .withMaxMergeWidth(5)
+      .withRunGeneration(::external_sort::REPLACEMENT_SELECTION);
+    generate(50000, 1000);
+    sortAndCheck();
+    ASSERT_EQ(13u, counter._batches);
+  }
+
+  TEST_F(ExternalTest, AsyncOutput)
+  {
+    sorter
+      .withMaxMergeWidth(5)
+      .withAsyncOutput(2);
+    generate(50000, 1000);
+    sortAndCheck();
+    ::external_sort::SorterStatistics statistics = sorter.statistics();
+    ASSERT_EQ(13u, statistics._outputBlocks); // 50000 records, 4096 at a time
+    ASSERT_EQ(50000u * sizeof(Record), statistics._outputBytes);
+  }
+
+  TEST_F(ExternalTest, AsyncOutputInMemory)
+  {
+    sorter
+      .withRunSize(1024 * 1024)
+      .withAsyncOutput(2);
+    generate(5000, 1000);
+    sortAndCheck();
+    ASSERT_EQ(0u, sorter.statistics()._runs);
+    ASSERT_EQ(2u, sorter.statistics()._outputBlocks);
+  }
+
+  TEST_F(ExternalTest, AsyncOutputReplacementSelectionInMemory)
+  {
+    sorter
+      .withRunSize(1024 * 1024)
+      .withRunGeneration(::external_sort::REPLACEMENT_SELECTION)
+      .withAsyncOutput(1);
+    generate(5000, 1000);
+    sortAndCheck();
+    ASSERT_EQ(2u, sorter.statistics()._outputBlocks);
+  }
+
+  TEST_F(ExternalTest, AsyncOutputToBatchReceiver)
+  {
+    BatchCounter counter(this);
+    sorter
+      .withReceiver(&counter)
+      .withMaxMergeWidth(5)
+      .withAsyncOutput(4);
+    generate(50000, 1000);
+    sortAndCheck();
+    ASSERT_EQ(13u, counter._batches);
+    ASSERT_TRUE(counter._packed);
+  }
+
+  struct ReceiverFailure {};
+
+  // Fails partway through the output.
+  class FailingReceiver : public ::external_sort::Receiver {
+  public:
+    unsigned int _received;
+
+    FailingReceiver()
+      : _received(0) {}
+
+    void receive(const void*, unsigned int)
+    {
+      if (++_received == 10000)
+      {
+        throw new ReceiverFailure;
+      }
+    }
+  };
+
+  TEST(External, AsyncOutputReceiverFails)
+  {
+    FailingReceiver receiver;
+    ::external_sort::Sorter sorter;
+    sorter
+      .withReceiver(&receiver)
+      .withRunSize(16 * 1024)
+      .withAsyncOutput(2)
+      .create();
+    for (uint32_t i = 0; i < 50000; ++i)
+    {
+      char key[4];
+      ::external_sort::uint32ToKey(i * 7919, key);
+      sorter.sort(key, sizeof(key), &i, sizeof(i));
+    }
+    ASSERT_THROW(sorter.finish(), ReceiverFailure*);
+    ASSERT_EQ(10000u, receiver._received);
+    // Only the blocks delivered in full are counted.
+    ::external_sort::SorterStatistics statistics = sorter.statistics();
+    ASSERT_EQ(10000u / ::external_sort::BatchReceiver::MAX_BATCH_RECORDS,
+              statistics._outputBlocks);
+    ASSERT_EQ(statistics._outputBlocks * ::external_sort::BatchReceiver::MAX_BATCH_RECORDS * 4,
+              statistics._outputBytes);
+  }
+
+  // Changes the working directory until destroyed, so that a test
+  // that fails or throws part way through still changes back.
+  class WorkingDirectory {
+  public:
+    WorkingDirectory(const char* directory)
+      : _changed(false)
+    {
+      _changed = (getcwd(_previous, sizeof(_previous)) != nullptr &&
+                  chdir(directory) == 0);
+    }
+
+    ~WorkingDirectory()
+    {
+      if (_changed && chdir(_previous) != 0)
+      {
+        ADD_FAILURE() << "couldn't change back to " << _previous;
+      }
+    }
+
+    bool changed() const
+    {
+      return _changed;
+    }
+
+  private:
+    // prohibit copy/assign; do not implement
+    WorkingDirectory(const WorkingDirectory&);
+    WorkingDirectory& operator=(const WorkingDirectory&);
+    char _previous[4096];
+    bool _changed;
+  };
+
+  TEST(External, SpillFails)
+  {
+    // Run files are created in the current directory, and none can be
+    // created in /proc. The spill thread's exception reaches the caller.
+    WorkingDirectory proc("/proc");
+    ASSERT_TRUE(proc.changed());
+    NullReceiver receiver;
+    ::external_sort::Sorter sorter;
+    sorter
+      .withReceiver(&receiver)
+      .withRunSize(16 * 1024)
+      .create();
+    const char* operation = nullptr;
+    try
+    {
+      for (uint32_t i = 0; i < 50000; ++i)
+      {
+        char key[4];
+        ::external_sort::uint32ToKey(i * 7919, key);
+        sorter.sort(key, sizeof(key), &i, sizeof(i));
+      }
+      sorter.finish();
+    }
+    catch (::external_sort::DiskIOException* e)
+    {
+      operation = e->operation();
+      delete e;
+    }
+    catch (...)
+    {
+      FAIL() << "expected a DiskIOException";
+    }
+    ASSERT_STREQ("mkstemp", operation);
+  }
+
+  class StringReceiver : public ::external_sort::Receiver {
+  public:
+    std::vector<std::string> result;
+
+    void receive(const void* payload, unsigned int payloadLength)
+    {
+      result.push_back(std::string((const char*) payload, payloadLength));
+    }
+  };
+
+  void sortVariableLength(::external_sort::RunGeneration generation,
+                          bool frontCode = false,
+                          ::external_sort::SorterStatistics* statistics = nullptr)
+  {
+    // Keys and payloads of widely varying size; each payload is the
+    // key followed by the record's position in the input.
+    std::vector<std::pair<std::string, std::string> > source;
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<unsigned int> lengths(0, 200);
+    std::uniform_int_distribution<int> letters('a', 'c');
+    for (unsigned int i = 0; i < 3000; ++i)
+    {
+      std::string key(lengths(generator), ' ');
+      for (auto& c: key)
+      {
+        c = (char) letters(generator);
+      }
+      source.push_back({key, key + "/" + std::to_string(i)});
+    }
+
+    StringReceiver receiver;
+    ::external_sort::Sorter sorter;
+    sorter
+      .withReceiver(&receiver)
+      .withRunSize(8 * 1024)
+      .withMaxMergeWidth(5)
+      .withRunGeneration(generation)
+      .setFrontCodeKeys(frontCode)
+      .stable()
+      .create();
+    for (auto& kp: source)
+    {
+      sorter.sort(kp.first.data(), kp.first.size(), 
+                  kp.second.data(), kp.second.size());
+    }
+    sorter.finish();
+
+    std::stable_sort(source.begin(), source.end(), 
+                     [](const std::pair<std::string, std::string>& l,
+                        const std::pair<std::string, std::string>& r) 
+                     { 
+                       return l.first < r.first;
+                     });
+    ASSERT_EQ(source.size(), receiver.result.size());
+    for (unsigned int i = 0; i < source.size(); ++i)
+    {
+      ASSERT_EQ(source[i].second, receiver.result[i]) << "difference at " << i;
+    }
+    if (statistics)
+    {
+      *statistics = sorter.statistics();
+    }
+  }
+
+  TEST(External, VariableLength)
+  {
+    sortVariableLength(::external_sort::FILL_AND_SORT);
+  }
+
+  TEST(External, VariableLengthReplacementSelection)
+  {
+    sortVariableLength(::external_sort::REPLACEMENT_SELECTION);
+  }
+
+  TEST(External, VariableLengthFrontCoded)
+  {
+    // Short alphabets make for long shared prefixes, and many of the
+    // merge's offset-value codes tie.
+    ::external_sort::SorterStatistics statistics;
+    sortVariableLength(::external_sort::FILL_AND_SORT, true, &statistics);
+    // every merge, of intermediate runs and the final one
+    ASSERT_GT(statistics._runs, 5u);
+    ASSERT_GT(statistics._offsetValueMerges, 1u);
+
+    sortVariableLength(::external_sort::FILL_AND_SORT, false, &statistics);
+    ASSERT_EQ(0u, statistics._offsetValueMerges);
+  }
+
+  class KeyReceiver : public ::external_sort::Receiver {
+  public:
+    std::vector<uint64_t> result;
+
+    void receive(const void* key, unsigned int keyLength)
+    {
+      ASSERT_EQ(8u, keyLength);
+      uint64_t value;
+      memcpy(&value, key, sizeof(value));
+      result.push_back(__builtin_bswap64(value)); // keys are big-endian
+    }
+  };
+
+  void sortKeysOnly(::external_sort::RunGeneration generation, unsigned int count)
+  {
+    std::vector<uint64_t> source;
+    std::mt19937_64 generator(count);
+    for (unsigned int i = 0; i < count; ++i)
+    {
+      source.push_back(generator() % 100000);
+    }
+
+    KeyReceiver receiver;
+    ::external_sort::Sorter sorter;
+    sorter
+      .withReceiver(&receiver)
+      .withRunSize(16 * 1024)
+      .withMaxMergeWidth(5)
+      .withRunGeneration(generation)
+      .withFixedLengthRecords(8, 0)
+      .create();
+    for (auto value: source)
+    {
+      char key[8];
+      ::external_sort::uint64ToKey(value, key);
+      sorter.sort(key, sizeof(key), nullptr, 0);
+    }
+    sorter.finish();
+
+    std::sort(source.begin(), source.end());
+    ASSERT_EQ(source, receiver.result);
+  }
+
+  TEST(External, KeysOnly)
+  {
+    sortKeysOnly(::external_sort::FILL_AND_SORT, 100);
+    sortKeysOnly(::external_sort::FILL_AND_SORT, 50000);
+  }
+
+  TEST(External, KeysOnlyReplacementSelection)
+  {
+    sortKeysOnly(::external_sort::REPLACEMENT_SELECTION, 100);
+    sortKeysOnly(::external_sort::REPLACEMENT_SELECTION, 50000);
+  }
+
+  TEST(External, FixedLengthMismatch)
+  {
+    KeyReceiver receiver;
+    ::external_sort::Sorter sorter;
+    sorter
+      .withReceiver(&receiver)
+      .withFixedLengthRecords(8, 0)
+      .create();
+    char key[8] = {0};
+    ::external_sort::FixedRecordSizeException* error = nullptr;
+    try
+    {
+      sorter.sort(key, 4, nullptr, 0);
+    }
+    catch (::external_sort::FixedRecordSizeException* e)
+    {
+      error = e;
+    }
+    ASSERT_TRUE(error != nullptr);
+    ASSERT_EQ(4u, error->keyLength());
+    delete error;
+  }
+
+  TEST(External, FixedLengthEmptyKey)
+  {
+    ::external_sort::Sorter sorter;
+    ::external_sort::FixedKeyLengthException* error = nullptr;
+    try
+    {
+      sorter.withFixedLengthRecords(0, 8);
+    }
+    catch (::external_sort::FixedKeyLengthException* e)
+    {
+      error = e;
+    }
+    ASSERT_TRUE(error != nullptr);
+    delete error;
+  }
+
+  // A group-by: each record counts one occurrence of its key, and the
+  // combiner adds up the counts.
+  struct Count {
+    uint32_t _key;
+    uint32_t _count;
+  };
+
+  class CountCombiner : public ::external_sort::Combiner {
+  public:
+    bool _grow; // make the payload longer, which fixed length can't take
+
+    CountCombiner()
+      : _grow(false) {}
+
+    void combine(std::string& accumulator, const void* payload, unsigned int payloadLength)
+    {
+      ASSERT_EQ(sizeof(Count), payloadLength);
+      ASSERT_EQ(sizeof(Count), accumulator.size());
+      Count total;
+      Count more;
+      memcpy(&total, accumulator.data(), sizeof(total));
+      memcpy(&more, payload, sizeof(more));
+      total._count += more._count;
+      accumulator.assign((const char*) &total, sizeof(total));
+      if (_grow)
+      {
+        accumulator.push_back('!');
+      }
+    }
+  };
+
+  class CountReceiver : public ::external_sort::Receiver {
+  public:
+    std::vector<Count> result;
+
+    void receive(const void* payload, unsigned int payloadLength)
+    {
+      ASSERT_EQ(sizeof(Count), payloadLength);
+      result.push_back(*(const Count*) payload);
+    }
+  };
+
+  // Sorts records with keys drawn from 1000 values, combining them,
+  // then checks that each key comes out once, with its count.
+  void countKeys(::external_sort::Sorter& sorter, unsigned int records, bool useCursor = false)
+  {
+    CountCombiner combiner;
+    CountReceiver receiver;
+    sorter.withCombiner(&combiner);
+    if (useCursor)
+    {
+      sorter.withCursor();
+    }
+    else
+    {
+      sorter.withReceiver(&receiver);
+    }
+    sorter.create();
+
+    std::mt19937 generator(records);
+    std::uniform_int_distribution<uint32_t> keys(0, 999);
+    std::vector<uint32_t> expected(1000);
+    for (unsigned int i = 0; i < records; ++i)
+    {
+      Count count = {keys(generator), 1};
+      ++ expected[count._key];
+      char key[4];
+      ::external_sort::uint32ToKey(count._key, key);
+      sorter.sort(key, sizeof(key), &count, sizeof(count));
+    }
+    if (useCursor)
+    {
+      ::external_sort::Cursor& cursor = sorter.finishToCursor();
+      while (cursor.next())
+      {
+        ::external_sort::Span payload = cursor.payload();
+        receiver.receive(payload._data, payload._length);
+      }
+    }
+    else
+    {
+      sorter.finish();
+    }
+
+    unsigned int next = 0;
+    for (auto count: receiver.result)
+    {
+      while (next < count._key)
+      {
+        ASSERT_EQ(0u, expected[next]) << "key " << next << " is missing";
+        ++ next;
+      }
+      ASSERT_EQ(next, count._key) << "key out of order or repeated";
+      ASSERT_EQ(expected[next], count._count) << "key " << next;
+      ++ next;
+    }
+  }
+
+  // Sorts the same records as countKeys(sorter, records) does, with a
+  // sorter set up the same way but without the combiner, and returns
+  // its statistics.
+  ::external_sort::SorterStatistics uncombinedStatistics(::external_sort::Sorter& sorter,
+                                                         unsigned int records)
+  {
+    NullReceiver receiver;
+    sorter
+      .withReceiver(&receiver)
+      .create();
+    std::mt19937 generator(records);
+    std::uniform_int_distribution<uint32_t> keys(0, 999);
+    for (unsigned int i = 0; i < records; ++i)
+    {
+      Count count = {keys(generator), 1};
+      char key[4];
+      ::external_sort::uint32ToKey(count._key, key);
+      sorter.sort(key, sizeof(key), &count, sizeof(count));
+    }
+    sorter.finish();
+    return sorter.statistics();
+  }
+
+  TEST(External, Combine)
+  {
+    ::external_sort::Sorter sorter;
+    sorter
+      .withRunSize(16 * 1024)
+      .withMaxMergeWidth(3);
+    countKeys(sorter, 50000);
+
+    // each run collapses to (at most) 1000 records before it is spilled
+    ::external_sort::Sorter uncombined;
+    CountReceiver receiver;
+    uncombined
+      .withReceiver(&receiver)
+      .withRunSize(16 * 1024)
+      .withMaxMergeWidth(3)
+      .create();
+    for (uint32_t i = 0; i < 50000; ++i)
+    {
+      Count count = {i % 1000, 1};
+      char key[4];
+      ::external_sort::uint32ToKey(count._key, key);
+      uncombined.sort(key, sizeof(key), &count, sizeof(count));
+    }
+    uncombined.finish();
+    ASSERT_LT(sorter.statistics()._writeBehindBytes * 2,
+              uncombined.statistics()._writeBehindBytes);
+  }
+
+  TEST(External, CombineInMemory)
+  {
+    ::external_sort::Sorter sorter;
+    sorter.withRunSize(1024 * 1024);
+    countKeys(sorter, 5000);
+    ASSERT_EQ(0u, sorter.statistics()._runs);
+  }
+
+  TEST(External, CombineReplacementSelection)
+  {
+    ::external_sort::Sorter sorter;
+    sorter
+      .withRunSize(16 * 1024)
+      .withMaxMergeWidth(3)
+      .withRunGeneration(::external_sort::REPLACEMENT_SELECTION);
+    countKeys(sorter, 50000);
+
+    ::external_sort::Sorter uncombined;
+    uncombined
+      .withRunSize(16 * 1024)
+      .withMaxMergeWidth(3)
+      .withRunGeneration(::external_sort::REPLACEMENT_SELECTION);
+    ::external_sort::SorterStatistics statistics = uncombinedStatistics(uncombined, 50000);
+    ASSERT_LT(sorter.statistics()._writeBehindBytes * 2, statistics._writeBehindBytes);
+  }
+
+  TEST(External, CombineReplacementSelectionInMemory)
+  {
+    ::external_sort::Sorter sorter;
+    sorter
+      .withRunSize(1024 * 1024)
+      .withRunGeneration(::external_sort::REPLACEMENT_SELECTION);
+    countKeys(sorter, 5000);
+  }
+
+  TEST(External, CombineCursor)
+  {
+    ::external_sort::Sorter merged;
+    merged
+      .withRunSize(16 * 1024)
+      .withMaxMergeWidth(5);
+    countKeys(merged, 50000, true);
+
+    ::external_sort::Sorter uncombined;
+    uncombined
+      .withRunSize(16 * 1024)
+      .withMaxMergeWidth(5);
+    ::external_sort::SorterStatistics statistics = uncombinedStatistics(uncombined, 50000);
+    ASSERT_LT(merged.statistics()._writeBehindBytes * 2, statistics._writeBehindBytes);
+
+    ::external_sort::Sorter inMemory;
+    inMemory.withRunSize(1024 * 1024);
+    countKeys(inMemory, 5000, true);
+  }
+
+  TEST(External, CombineFixedLength)
+  {
+    ::external_sort::Sorter sorter;
+    sorter
+      .withRunSize(16 * 1024)
+      .withMaxMergeWidth(5)
+      .withFixedLengthRecords(4, sizeof(Count));
+    countKeys(sorter, 50000);
+  }
+
+  TEST(External, CombineFixedLengthMismatch)
+  {
+    CountCombiner combiner;
+    combiner._grow = true;
+    CountReceiver receiver;
+    ::external_sort::Sorter sorter;
+    sorter
+      .withReceiver(&receiver)
+      .withCombiner(&combiner)
+      .withFixedLengthRecords(4, sizeof(Count))
+      .create();
+    Count count = {7, 1};
+    char key[4];
+    ::external_sort::uint32ToKey(count._key, key);
+    sorter.sort(key, sizeof(key), &count, sizeof(count));
+    sorter.sort(key, sizeof(key), &count, sizeof(count));
+    ASSERT_THROW(sorter.finish(), ::external_sort::FixedRecordSizeException*);
+  }
+
+  TEST(External, LimitWithCombiner)
+  {
+    CountCombiner combiner;
+    CountReceiver receiver;
+    ::external_sort::Sorter sorter;
+    sorter
+      .withReceiver(&receiver)
+      .withCombiner(&combiner)
+      .withLimit(10);
+    ASSERT_THROW(sorter.create(), ::external_sort::SorterException*);
+  }
+}
@@ -7,6 +7,14 @@
 #define EXTERNAL_SORT_KEYCONVERT_H
 
 #include <stdint.h>
+#include <cstddef>
+#include <cstring> // for memcpy
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define EXTERNAL_SORT_KEYCONVERT_X86
+#include <immintrin.h>
+#endif
 
 namespace external_sort {
   /*
@@ -19,7 +27,8 @@ namespace external_sort {
 
     Note that composite keys containing variable-length values (strings,
     byte strings) require additional handling, as it's not possible to
-    simply concatenate the values.
+    simply concatenate the values; keyschema.h builds such keys (and
+    descending and nullable fields) on top of these routines.
 
     These routines presume:
   
@@ -185,5 +194,293 @@ namespace external_sort {
       bytes[7] = raw._bytes[0];
     }
   }
+
+  /*
+    Array-at-a-time conversions, for encoding whole columns of values:
+    each converts count values from source, writing their keys stride
+    bytes apart starting at target (a stride of the key size packs
+    them). The keys are exactly those of the single-value routines
+    above.
+
+    The work is the same for every value - flip the sign bit (or, for
+    a negative float, every bit) and reverse the bytes - so it's done a
+    vector at a time: with AVX2 where the CPU has it, else with SSSE3,
+    else with one byte swap instruction per value. The CPU is checked
+    once, at the first call; a KeyConversion may be given to use a
+    lesser one (more than the CPU has gets the CPU's best).
+  */
+
+  enum KeyConversion {
+    SCALAR_CONVERSION,
+    SSSE3_CONVERSION,
+    AVX2_CONVERSION
+  };
+
+  static inline
+  KeyConversion bestKeyConversion()
+  {
+#ifdef EXTERNAL_SORT_KEYCONVERT_X86
+    static const KeyConversion best =
+      (__builtin_cpu_supports("avx2") ? AVX2_CONVERSION :
+       __builtin_cpu_supports("ssse3") ? SSSE3_CONVERSION : SCALAR_CONVERSION);
+    return best;
+#else
+    return SCALAR_CONVERSION;
+#endif
+  }
+
+  namespace keyconvert_detail {
+
+    // What is done to each value's bits before the bytes are reversed
+    enum Flip {
+      FLIP_NONE,  // unsigned
+      FLIP_SIGN,  // signed: invert the sign bit
+      FLIP_FLOAT  // floating: invert the sign bit, or all bits if negative
+    };
+
+    static inline uint32_t swap(uint32_t value) { return __builtin_bswap32(value); }
+    static inline uint64_t swap(uint64_t value) { return __builtin_bswap64(value); }
+
+    template <typename Bits, Flip flip>
+    static inline
+    void convertScalar(const void* source, size_t count, char* target, size_t stride)
+    {
+      static const unsigned int SHIFT = 8 * sizeof(Bits) - 1;
+      static const Bits SIGN = (Bits) 1 << SHIFT;
+      const char* in = (const char*) source;
+      for (size_t i = 0; i < count; ++i, in += sizeof(Bits), target += stride)
+      {
+        Bits bits;
+        memcpy(&bits, in, sizeof(bits));
+        if (flip == FLIP_SIGN)
+        {
+          bits ^= SIGN;
+        }
+        else if (flip == FLIP_FLOAT)
+        {
+          bits ^= (Bits) (0 - (bits >> SHIFT)) | SIGN;
+        }
+        bits = swap(bits);
+        memcpy(target, &bits, sizeof(bits));
+      }
+    }
+
+#ifdef EXTERNAL_SORT_KEYCONVERT_X86
+    // Writes each key of a vector stride bytes apart.
+    template <typename Bits>
+    __attribute__((target("ssse3")))
+    static inline
+    void scatter(__m128i keys, char* target, size_t stride)
+    {
+      if (sizeof(Bits) == 8)
+      {
+        _mm_storel_epi64((__m128i*) target, keys);
+        _mm_storeh_pd((double*) (target + stride), _mm_castsi128_pd(keys));
+      }
+      else
+      {
+        for (unsigned int i = 0; i < 4; ++i, target += stride)
+        {
+          uint32_t key = (uint32_t) _mm_cvtsi128_si32(keys);
+          memcpy(target, &key, sizeof(key));
+          keys = _mm_srli_si128(keys, 4);
+        }
+      }
+    }
+
+    // The same, compiled for AVX2 so as not to mix in legacy SSE
+    // instructions (which would stall on the transitions).
+    template <typename Bits>
+    __attribute__((target("avx2")))
+    static inline
+    void scatterAvx2(__m128i keys, char* target, size_t stride)
+    {
+      if (sizeof(Bits) == 8)
+      {
+        _mm_storel_epi64((__m128i*) target, keys);
+        _mm_storeh_pd((double*) (target + stride), _mm_castsi128_pd(keys));
+      }
+      else
+      {
+        for (unsigned int i = 0; i < 4; ++i, target += stride)
+        {
+          uint32_t key = (uint32_t) _mm_cvtsi128_si32(keys);
+          memcpy(target, &key, sizeof(key));
+          keys = _mm_srli_si128(keys, 4);
+        }
+      }
+    }
+
+    template <typename Bits, Flip flip>
+    __attribute__((target("ssse3")))
+    static void convertSsse3(const void* source, size_t count, char* target, size_t stride)
+    {
+      static const unsigned int PER_VECTOR = sizeof(__m128i)/sizeof(Bits);
+      const __m128i reverse = (sizeof(Bits) == 8
+                               ? _mm_setr_epi8(7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8)
+                               : _mm_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12));
+      const __m128i sign = (sizeof(Bits) == 8
+                            ? _mm_set1_epi64x((long long) 0x8000000000000000ULL)
+                            : _mm_set1_epi32((int) 0x80000000U));
+      const char* in = (const char*) source;
+      size_t i = 0;
+      for (; i + PER_VECTOR <= count; i += PER_VECTOR)
+      {
+        __m128i v = _mm_loadu_si128((const __m128i*) (in + sizeof(Bits) * i));
+        if (flip == FLIP_SIGN)
+        {
+          v = _mm_xor_si128(v, sign);
+        }
+        else if (flip == FLIP_FLOAT)
+        {
+          // all ones where negative: the high half's sign, in both halves
+          __m128i negative = _mm_srai_epi32(v, 31);
+          if (sizeof(Bits) == 8)
+          {
+            negative = _mm_shuffle_epi32(negative, _MM_SHUFFLE(3,3,1,1));
+          }
+          v = _mm_xor_si128(v, _mm_or_si128(negative, sign));
+        }
+        v = _mm_shuffle_epi8(v, reverse);
+        char* out = target + stride * i;
+        if (stride == sizeof(Bits))
+        {
+          _mm_storeu_si128((__m128i*) out, v);
+        }
+        else
+        {
+          scatter<Bits>(v, out, stride);
+        }
+      }
+      convertScalar<Bits, flip>(in + sizeof(Bits) * i, count - i,
+                                target + stride * i, stride);
+    }
+
+    template <typename Bits, Flip flip>
+    __attribute__((target("avx2")))
+    static void convertAvx2(const void* source, size_t count, char* target, size_t stride)
+    {
+      static const unsigned int PER_VECTOR = sizeof(__m256i)/sizeof(Bits);
+      // vpshufb works within each 16 byte lane, which suits a byte swap
+      const __m256i reverse = (sizeof(Bits) == 8
+                               ? _mm256_setr_epi8(7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8,
+                                                  7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8)
+                               : _mm256_setr_epi8(3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12,
+                                                  3,2,1,0, 7,6,5,4, 11,10,9,8, 15,14,13,12));
+      const __m256i sign = (sizeof(Bits) == 8
+                            ? _mm256_set1_epi64x((long long) 0x8000000000000000ULL)
+                            : _mm256_set1_epi32((int) 0x80000000U));
+      const char* in = (const char*) source;
+      size_t i = 0;
+      for (; i + PER_VECTOR <= count; i += PER_VECTOR)
+      {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (in + sizeof(Bits) * i));
+        if (flip == FLIP_SIGN)
+        {
+          v = _mm256_xor_si256(v, sign);
+        }
+        else if (flip == FLIP_FLOAT)
+        {
+          __m256i negative = _mm256_srai_epi32(v, 31);
+          if (sizeof(Bits) == 8)
+          {
+            negative = _mm256_shuffle_epi32(negative, _MM_SHUFFLE(3,3,1,1));
+          }
+          v = _mm256_xor_si256(v, _mm256_or_si256(negative, sign));
+        }
+        v = _mm256_shuffle_epi8(v, reverse);
+        char* out = target + stride * i;
+        if (stride == sizeof(Bits))
+        {
+          _mm256_storeu_si256((__m256i*) out, v);
+        }
+        else
+        {
+          scatterAvx2<Bits>(_mm256_castsi256_si128(v), out, stride);
+          scatterAvx2<Bits>(_mm256_extracti128_si256(v, 1),
+                            out + stride * (PER_VECTOR/2), stride);
+        }
+      }
+      convertScalar<Bits, flip>(in + sizeof(Bits) * i, count - i,
+                                target + stride * i, stride);
+    }
+#endif
+
+    template <typename Bits, Flip flip>
+    static inline
+    void convert(const void* source, size_t count, void* target, size_t stride,
+                 KeyConversion conversion)
+    {
+      conversion = std::min(conversion, bestKeyConversion());
+#ifdef EXTERNAL_SORT_KEYCONVERT_X86
+      if (conversion == AVX2_CONVERSION)
+      {
+        convertAvx2<Bits, flip>(source, count, (char*) target, stride);
+        return;
+      }
+      if (conversion == SSSE3_CONVERSION)
+      {
+        convertSsse3<Bits, flip>(source, count, (char*) target, stride);
+        return;
+      }
+#endif
+      convertScalar<Bits, flip>(source, count, (char*) target, stride);
+    }
+  }
+
+  static inline
+  void uint32ArrayToKeys(const uint32_t* source, size_t count, void* target,
+                         size_t stride = sizeof(uint32_t),
+                         KeyConversion conversion = AVX2_CONVERSION)
+  {
+    keyconvert_detail::convert<uint32_t, keyconvert_detail::FLIP_NONE>
+      (source, count, target, stride, conversion);
+  }
+
+  static inline
+  void uint64ArrayToKeys(const uint64_t* source, size_t count, void* target,
+                         size_t stride = sizeof(uint64_t),
+                         KeyConversion conversion = AVX2_CONVERSION)
+  {
+    keyconvert_detail::convert<uint64_t, keyconvert_detail::FLIP_NONE>
+      (source, count, target, stride, conversion);
+  }
+
+  static inline
+  void int32ArrayToKeys(const int32_t* source, size_t count, void* target,
+                        size_t stride = sizeof(int32_t),
+                        KeyConversion conversion = AVX2_CONVERSION)
+  {
+    keyconvert_detail::convert<uint32_t, keyconvert_detail::FLIP_SIGN>
+      (source, count, target, stride, conversion);
+  }
+
+  // Also for timestamps held as signed counts since an epoch
+  static inline
+  void int64ArrayToKeys(const int64_t* source, size_t count, void* target,
+                        size_t stride = sizeof(int64_t),
+                        KeyConversion conversion = AVX2_CONVERSION)
+  {
+    keyconvert_detail::convert<uint64_t, keyconvert_detail::FLIP_SIGN>
+      (source, count, target, stride, conversion);
+  }
+
+  static inline
+  void floatArrayToKeys(const float* source, size_t count, void* target,
+                        size_t stride = sizeof(float),
+                        KeyConversion conversion = AVX2_CONVERSION)
+  {
+    keyconvert_detail::convert<uint32_t, keyconvert_detail::FLIP_FLOAT>
+      (source, count, target, stride, conversion);
+  }
+
+  static inline
+  void doubleArrayToKeys(const double* source, size_t count, void* target,
+                         size_t stride = sizeof(double),
+                         KeyConversion conversion = AVX2_CONVERSION)
+  {
+    keyconvert_detail::convert<uint64_t, keyconvert_detail::FLIP_FLOAT>
+      (source, count, target, stride, conversion);
+  }
 }
 #endif // EXTERNAL_SORT_KEYCONVERT_H
@@ -0,0 +1,104 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#include "keyconvert.h"
+#include "gtest/gtest.h"
+
+#include <vector>
+#include <string>
+#include <random>
+#include <limits>
+#include <stdint.h>
+
+namespace {
+
+  using namespace ::external_sort;
+
+  static const KeyConversion conversions[] = {
+    SCALAR_CONVERSION, SSSE3_CONVERSION, AVX2_CONVERSION
+  };
+
+  // Converts the values one at a time and as an array, with every
+  // conversion, packed and with a stride (which has to leave the bytes
+  // between the keys alone), and for every length up to the values'.
+  template <typename T>
+  void checkArray(const std::vector<T>& values,
+                  void (*one)(T, void*),
+                  void (*array)(const T*, size_t, void*, size_t, KeyConversion))
+  {
+    static const size_t SIZE = sizeof(T);
+    std::string expected(SIZE * values.size(), ' ');
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+      one(values[i], &expected[SIZE * i]);
+    }
+
+    for (auto conversion: conversions)
+    {
+      for (size_t count = 0; count <= values.size(); count += (count < 40 ? 1 : 97))
+      {
+        std::string packed(SIZE * count, ' ');
+        array(values.data(), count, &packed[0], SIZE, conversion);
+        ASSERT_EQ(expected.substr(0, SIZE * count), packed)
+          << "conversion " << conversion << ", count " << count;
+
+        size_t stride = SIZE + 3;
+        std::string strided(stride * count, '-');
+        array(values.data(), count, &strided[0], stride, conversion);
+        for (size_t i = 0; i < count; ++i)
+        {
+          ASSERT_EQ(expected.substr(SIZE * i, SIZE), strided.substr(stride * i, SIZE))
+            << "conversion " << conversion << ", count " << count << ", key " << i;
+          ASSERT_EQ("---", strided.substr(stride * i + SIZE, 3));
+        }
+      }
+    }
+  }
+
+  template <typename T>
+  std::vector<T> randomIntegers()
+  {
+    std::mt19937_64 generator(sizeof(T));
+    std::vector<T> values = {0, 1, std::numeric_limits<T>::min(),
+                             std::numeric_limits<T>::max()};
+    while (values.size() < 1000)
+    {
+      values.push_back((T) generator());
+    }
+    return values;
+  }
+
+  template <typename T>
+  std::vector<T> randomFloats()
+  {
+    std::mt19937_64 generator(sizeof(T));
+    std::uniform_real_distribution<T> reals(-1e6, 1e6);
+    std::vector<T> values = {0.0, -0.0, 1.0, -1.0,
+                             std::numeric_limits<T>::infinity(),
+                             -std::numeric_limits<T>::infinity(),
+                             std::numeric_limits<T>::denorm_min(),
+                             -std::numeric_limits<T>::denorm_min(),
+                             std::numeric_limits<T>::quiet_NaN()};
+    while (values.size() < 1000)
+    {
+      values.push_back(reals(generator));
+    }
+    return values;
+  }
+
+  TEST(KeyConvert, Integers)
+  {
+    checkArray<uint32_t>(randomIntegers<uint32_t>(), uint32ToKey, uint32ArrayToKeys);
+    checkArray<uint64_t>(randomIntegers<uint64_t>(), uint64ToKey, uint64ArrayToKeys);
+    checkArray<int32_t>(randomIntegers<int32_t>(), int32ToKey, int32ArrayToKeys);
+    checkArray<int64_t>(randomIntegers<int64_t>(), int64ToKey, int64ArrayToKeys);
+  }
+
+  TEST(KeyConvert, Floats)
+  {
+    checkArray<float>(randomFloats<float>(), floatToKey, floatArrayToKeys);
+    checkArray<double>(randomFloats<double>(), doubleToKey, doubleArrayToKeys);
+  }
+}
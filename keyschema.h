@@ -0,0 +1,331 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#ifndef EXTERNAL_SORT_KEYSCHEMA_H
+#define EXTERNAL_SORT_KEYSCHEMA_H
+
+#include "sorter.h" // for SorterException
+#include "keyconvert.h"
+
+#include <cstring> // for memchr/memcpy
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/*
+  Composite keys. A KeySchema lists the fields of a key in order, each
+  with its type, direction, and whether (and where) it may be null; a
+  KeyBuilder then turns one value per field into a single key that
+  memcmp orders as the tuple of fields would be ordered.
+
+    KeySchema schema;
+    schema
+      .add(KEY_STRING)
+      .add(KEY_INT64, DESCENDING)
+      .add(KEY_DOUBLE, ASCENDING, NULLS_LAST);
+
+    KeyBuilder key(schema);
+    key.addString(name).addInt64(count).addNull();
+    sorter.sort(key.data(), key.length(), ...);
+    key.clear(); // and on to the next record
+
+  The fields are encoded one after the other:
+
+  * Scalars are converted as in keyconvert.h.
+
+  * Strings (byte strings, compared bytewise) can't simply be
+    concatenated, since a shorter string must order before any longer
+    one that it prefixes, whatever follows it. Each 0x00 byte is
+    escaped as 0x00 0xFF, and the string ends with 0x00 0x01, which is
+    lower than any escape or other byte that could follow at that point.
+
+  * A descending field has every byte of its encoding inverted. Since
+    no field's encoding is a prefix of another value's encoding of the
+    same field, this exactly reverses the field's order.
+
+  * A nullable field starts with an indicator byte, 0x01 for a value
+    and 0x00 (NULLS_FIRST) or 0x02 (NULLS_LAST) for null, which is all
+    that a null is encoded as. The indicator isn't inverted for a
+    descending field, so nulls go first or last either way.
+
+  Like keyconvert.h, this is all inline, so there is no corresponding
+  .cpp file.
+*/
+
+namespace external_sort {
+
+  class KeySchemaException : public SorterException {
+  public:
+    KeySchemaException(const char* what)
+      : _what(what) {}
+    ~KeySchemaException() noexcept {}
+    // default copy/assign OK
+    virtual const char* what() const noexcept
+    {
+      return _what.c_str();
+    }
+  private:
+    std::string _what;
+  };
+
+  enum KeyFieldType {
+    KEY_UINT8,
+    KEY_UINT16,
+    KEY_UINT32,
+    KEY_UINT64,
+    KEY_INT8,
+    KEY_INT16,
+    KEY_INT32,
+    KEY_INT64,
+    KEY_FLOAT,
+    KEY_DOUBLE,
+    KEY_STRING
+  };
+
+  enum KeyOrder {
+    ASCENDING,
+    DESCENDING
+  };
+
+  enum KeyNulls {
+    NOT_NULL,     // the field always has a value
+    NULLS_FIRST,
+    NULLS_LAST
+  };
+
+  class KeySchema {
+  public:
+    struct Field {
+      // default ctor/dtor/copy/assign OK
+      KeyFieldType _type;
+      KeyOrder _order;
+      KeyNulls _nulls;
+    };
+
+    KeySchema() {}
+    // default dtor/copy/assign OK
+
+    KeySchema& add(KeyFieldType type, KeyOrder order = ASCENDING,
+                   KeyNulls nulls = NOT_NULL)
+    {
+      Field field = {type, order, nulls};
+      _fields.push_back(field);
+      return *this;
+    }
+
+    unsigned int fields() const
+    {
+      return _fields.size();
+    }
+
+    const Field& field(unsigned int i) const
+    {
+      return _fields[i];
+    }
+
+  private:
+    std::vector<Field> _fields;
+  };
+
+  class KeyBuilder {
+  public:
+    static const unsigned char NULL_FIRST_INDICATOR = 0x00;
+    static const unsigned char VALUE_INDICATOR = 0x01;
+    static const unsigned char NULL_LAST_INDICATOR = 0x02;
+
+    // The schema must outlive the builder.
+    KeyBuilder(const KeySchema& schema)
+      : _schema(schema)
+      , _next(0) {}
+    // default dtor OK
+
+    // Start the next key, keeping the buffer.
+    inline
+    void clear()
+    {
+      _key.clear();
+      _next = 0;
+    }
+
+    // The key, once every field has been added
+    inline
+    const char* data() const
+    {
+      checkComplete();
+      return _key.data();
+    }
+
+    inline
+    unsigned int length() const
+    {
+      checkComplete();
+      return _key.size();
+    }
+
+    KeyBuilder& addUint8(uint8_t value)
+    {
+      return addScalar<uint8_t, uint8ToKey>(KEY_UINT8, value);
+    }
+
+    KeyBuilder& addUint16(uint16_t value)
+    {
+      return addScalar<uint16_t, uint16ToKey>(KEY_UINT16, value);
+    }
+
+    KeyBuilder& addUint32(uint32_t value)
+    {
+      return addScalar<uint32_t, uint32ToKey>(KEY_UINT32, value);
+    }
+
+    KeyBuilder& addUint64(uint64_t value)
+    {
+      return addScalar<uint64_t, uint64ToKey>(KEY_UINT64, value);
+    }
+
+    KeyBuilder& addInt8(int8_t value)
+    {
+      return addScalar<int8_t, int8ToKey>(KEY_INT8, value);
+    }
+
+    KeyBuilder& addInt16(int16_t value)
+    {
+      return addScalar<int16_t, int16ToKey>(KEY_INT16, value);
+    }
+
+    KeyBuilder& addInt32(int32_t value)
+    {
+      return addScalar<int32_t, int32ToKey>(KEY_INT32, value);
+    }
+
+    KeyBuilder& addInt64(int64_t value)
+    {
+      return addScalar<int64_t, int64ToKey>(KEY_INT64, value);
+    }
+
+    KeyBuilder& addFloat(float value)
+    {
+      return addScalar<float, floatToKey>(KEY_FLOAT, value);
+    }
+
+    KeyBuilder& addDouble(double value)
+    {
+      return addScalar<double, doubleToKey>(KEY_DOUBLE, value);
+    }
+
+    KeyBuilder& addString(const void* value, unsigned int length)
+    {
+      const KeySchema::Field& field = startField(KEY_STRING);
+      size_t start = _key.size();
+      const char* remaining = (const char*) value;
+      const char* end = remaining + length;
+      while (remaining < end)
+      {
+        // copy up to and including each zero byte, then escape it
+        const char* zero = (const char*) memchr(remaining, 0, end - remaining);
+        if (!zero)
+        {
+          _key.append(remaining, end - remaining);
+          break;
+        }
+        _key.append(remaining, zero + 1 - remaining);
+        _key.push_back((char) 0xFF);
+        remaining = zero + 1;
+      }
+      _key.push_back((char) 0x00);
+      _key.push_back((char) 0x01);
+      finishField(field, start);
+      return *this;
+    }
+
+    KeyBuilder& addString(const std::string& value)
+    {
+      return addString(value.data(), value.size());
+    }
+
+    // Only for a field that allows nulls
+    KeyBuilder& addNull()
+    {
+      if (_next >= _schema.fields())
+      {
+        throw new KeySchemaException("More fields were added than the schema has.");
+      }
+      const KeySchema::Field& field = _schema.field(_next++);
+      if (field._nulls == NOT_NULL)
+      {
+        throw new KeySchemaException("A null was added for a field that can't be null.");
+      }
+      _key.push_back((char) (field._nulls == NULLS_FIRST
+                             ? NULL_FIRST_INDICATOR : NULL_LAST_INDICATOR));
+      return *this;
+    }
+
+  private:
+    // Prohibit copy/assign; do not implement
+    KeyBuilder(const KeyBuilder&);
+    KeyBuilder& operator=(const KeyBuilder&);
+
+    // Checks that the next field is of the given type, and writes its
+    // null indicator, if it has one.
+    inline
+    const KeySchema::Field& startField(KeyFieldType type)
+    {
+      if (_next >= _schema.fields())
+      {
+        throw new KeySchemaException("More fields were added than the schema has.");
+      }
+      const KeySchema::Field& field = _schema.field(_next++);
+      if (field._type != type)
+      {
+        throw new KeySchemaException("A field was added with the wrong type.");
+      }
+      if (field._nulls != NOT_NULL)
+      {
+        _key.push_back((char) VALUE_INDICATOR);
+      }
+      return field;
+    }
+
+    // Inverts a descending field's encoding, from start on.
+    inline
+    void finishField(const KeySchema::Field& field, size_t start)
+    {
+      if (field._order == DESCENDING)
+      {
+        for (size_t i = start; i < _key.size(); ++i)
+        {
+          _key[i] = ~_key[i];
+        }
+      }
+    }
+
+    template <typename T, void (*convert)(T, void*)>
+    inline
+    KeyBuilder& addScalar(KeyFieldType type, T value)
+    {
+      const KeySchema::Field& field = startField(type);
+      size_t start = _key.size();
+      _key.resize(start + sizeof(T));
+      convert(value, &_key[start]);
+      finishField(field, start);
+      return *this;
+    }
+
+    inline
+    void checkComplete() const
+    {
+      if (_next != _schema.fields())
+      {
+        throw new KeySchemaException("Not every field of the key was added.");
+      }
+    }
+
+    const KeySchema& _schema;
+    unsigned int _next; // the field to be added next
+    std::string _key;
+  };
+
+} // namespace external_sort
+
+#endif // EXTERNAL_SORT_KEYSCHEMA_H
@@ -0,0 +1,149 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#include "keyschema.h"
+#include "gtest/gtest.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <stdint.h>
+
+namespace {
+
+  using ::external_sort::KeySchema;
+  using ::external_sort::KeyBuilder;
+
+  // (string ascending, int64 descending, double nulls last,
+  //  int32 descending with nulls first)
+  struct Row {
+    std::string _name;
+    int64_t _count;
+    bool _hasScore;
+    double _score;
+    bool _hasRank;
+    int32_t _rank;
+  };
+
+  // The order the encoded keys should have, worked out field by field
+  bool rowLess(const Row& l, const Row& r)
+  {
+    if (l._name != r._name)
+    {
+      return l._name < r._name; // std::string compares as unsigned bytes
+    }
+    if (l._count != r._count)
+    {
+      return l._count > r._count;
+    }
+    if (l._hasScore != r._hasScore)
+    {
+      return l._hasScore;
+    }
+    if (l._hasScore && l._score != r._score)
+    {
+      return l._score < r._score;
+    }
+    if (l._hasRank != r._hasRank)
+    {
+      return !l._hasRank;
+    }
+    return l._hasRank && l._rank > r._rank;
+  }
+
+  std::string encode(const KeySchema& schema, const Row& row)
+  {
+    KeyBuilder key(schema);
+    key.addString(row._name).addInt64(row._count);
+    if (row._hasScore)
+    {
+      key.addDouble(row._score);
+    }
+    else
+    {
+      key.addNull();
+    }
+    if (row._hasRank)
+    {
+      key.addInt32(row._rank);
+    }
+    else
+    {
+      key.addNull();
+    }
+    return std::string(key.data(), key.length());
+  }
+
+  TEST(KeySchema, Order)
+  {
+    KeySchema schema;
+    schema
+      .add(::external_sort::KEY_STRING)
+      .add(::external_sort::KEY_INT64, ::external_sort::DESCENDING)
+      .add(::external_sort::KEY_DOUBLE, ::external_sort::ASCENDING,
+           ::external_sort::NULLS_LAST)
+      .add(::external_sort::KEY_INT32, ::external_sort::DESCENDING,
+           ::external_sort::NULLS_FIRST);
+
+    // Few distinct values per field, so that every field gets compared;
+    // the strings include zero and 0xFF bytes and prefixes of each other.
+    std::mt19937 generator(3);
+    std::uniform_int_distribution<unsigned int> small(0, 3);
+    static const char letters[] = {'\0', 'a', '\xff'};
+    std::vector<std::pair<std::string, Row> > rows;
+    for (unsigned int i = 0; i < 5000; ++i)
+    {
+      Row row;
+      unsigned int length = small(generator);
+      for (unsigned int j = 0; j < length; ++j)
+      {
+        row._name += letters[small(generator) % 3];
+      }
+      row._count = (int64_t) small(generator) - 2;
+      row._hasScore = small(generator) != 0;
+      row._score = ((double) small(generator) - 1.5) * 1e10;
+      row._hasRank = small(generator) != 0;
+      row._rank = (int32_t) small(generator) - 1;
+      rows.push_back({encode(schema, row), row});
+    }
+
+    std::sort(rows.begin(), rows.end(),
+              [](const std::pair<std::string, Row>& l,
+                 const std::pair<std::string, Row>& r)
+              {
+                // as the sorter compares keys: memcmp, then length
+                return l.first < r.first;
+              });
+    for (unsigned int i = 1; i < rows.size(); ++i)
+    {
+      ASSERT_FALSE(rowLess(rows[i].second, rows[i-1].second))
+        << "out of order at " << i;
+      if (rows[i].first == rows[i-1].first)
+      {
+        ASSERT_FALSE(rowLess(rows[i-1].second, rows[i].second))
+          << "different rows with the same key at " << i;
+      }
+    }
+  }
+
+  TEST(KeySchema, Misuse)
+  {
+    KeySchema schema;
+    schema
+      .add(::external_sort::KEY_UINT32)
+      .add(::external_sort::KEY_STRING);
+    KeyBuilder key(schema);
+    ASSERT_THROW(key.addString("wrong type"), ::external_sort::KeySchemaException*);
+    key.clear();
+    ASSERT_THROW(key.addNull(), ::external_sort::KeySchemaException*);
+    key.clear();
+    key.addUint32(7);
+    ASSERT_THROW(key.length(), ::external_sort::KeySchemaException*);
+    key.addString("");
+    ASSERT_EQ(6u, key.length());
+    ASSERT_THROW(key.addUint32(8), ::external_sort::KeySchemaException*);
+  }
+}
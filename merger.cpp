@@ -4,60 +4,218 @@
 // for the detailed license.
 
 #include "merger.h"
+#include "mergetree.h"
 #include "diskrun.h"
 #include "sorter.h"
 #include "sortassert.h"
+#include "asyncio.h"
 
-#include <cstring>
 #include <algorithm>
+#include <string>
 
 namespace external_sort {
 
-  struct MergeItem {
-    DiskRun::Item _key;
-    unsigned int _runIndex;
+  // Smaller read-ahead blocks would cost more in thread hand-offs than
+  // they save.
+  static const unsigned int MIN_READ_AHEAD_BLOCK = 64 * 1024;
 
-    MergeItem() {}
-    MergeItem(const DiskRun::Item& key, unsigned int runIndex)
-      : _key(key)
-      , _runIndex(runIndex) {}
-    // default dtor/copy/assign OK
+  class MergeWriter {
+  public:
+    // default ctor/copy/assign OK
+    virtual ~MergeWriter() {}
+    virtual void writeFrom(const DiskRun* run) = 0;
+
+    // A record that isn't the current one of any run
+    virtual void write(const DiskRun::Item& key, const DiskRun::Item& payload) = 0;
 
-    inline
-    bool less(const MergeItem& rhs) const
+    // As above, also given how much of the run's current key is shared
+    // with the key written before it.
+    virtual void writeFrom(const DiskRun* run, unsigned int /*sharedPrefixLength*/)
     {
-      unsigned int leftLength = _key._length;
-      unsigned int rightLength = rhs._key._length;
-      size_t compareLength = (size_t) std::min(leftLength, rightLength);
-      int result = memcmp(_key._data, rhs._key._data, compareLength);
-      if (result == 0) 
+      writeFrom(run);
+    }
+
+    // Called once the merge has written everything.
+    virtual void finish() {}
+  };
+
+  // Combines each group of consecutive records with equal keys before it
+  // goes on to the target. A run's current record is gone once the run
+  // advances, so the group's key and payload are copied.
+  class CombiningWriter : public MergeWriter {
+  public:
+    CombiningWriter(MergeWriter& target, const Combining& combining)
+      : _target(target)
+      , _combining(combining)
+      , _pending(false) {}
+    // default dtor OK
+
+    void writeFrom(const DiskRun* run)
+    {
+      write(run->getKey(), run->getPayload());
+    }
+
+    void write(const DiskRun::Item& key, const DiskRun::Item& payload)
+    {
+      if (_pending && Combining::sameKey(key._data, key._length, _key.data(), _key.size()))
       {
-        return (leftLength < rightLength ? true : false);
+        _combining.combine(_payload, key._length, payload._data, payload._length);
+        return;
       }
-      return (result < 0 ? true : false);
+      writePending();
+      _key.assign((const char*) key._data, key._length);
+      _payload.assign((const char*) payload._data, payload._length);
+      _pending = true;
     }
-  };
 
-  struct RunOrder {
-    bool operator() (const MergeItem& left, const MergeItem& right) const
+    void finish()
     {
-      // The heap needs to be ordered smallest to largest, so invert the
-      // usual sense of order.
-      return right.less(left);
+      writePending();
+      _target.finish();
+    }
+
+  private:
+    // prohibit copy/assign; do not implement
+    CombiningWriter(const CombiningWriter&);
+    CombiningWriter& operator=(const CombiningWriter&);
+
+    void writePending()
+    {
+      if (_pending)
+      {
+        _target.write(DiskRun::Item(_key.data(), _key.size()),
+                      DiskRun::Item(_payload.data(), _payload.size()));
+        _pending = false;
+      }
     }
+
+    MergeWriter& _target;
+    Combining _combining;
+    bool _pending;
+    std::string _key;
+    std::string _payload;
   };
 
-  class MergeWriter {
+  // Steps a merge one record at a time, for Merger::next().
+  class MergePuller {
   public:
     // default ctor/copy/assign OK
-    virtual ~MergeWriter() {}
-    virtual void writeFrom(const DiskRun* run) = 0;
+    virtual ~MergePuller() {}
+    virtual const DiskRun* next() = 0;
   };
 
-  class MergerImpl {
+  inline
+  void replaceTop(HeapMergeTree& tree, const DiskRun* run)
+  {
+    tree.replaceTop(run->getKey());
+  }
+
+  inline
+  void replaceTop(LoserMergeTree& tree, const DiskRun* run)
+  {
+    tree.replaceTop(run->getKey());
+  }
+
+  inline
+  void replaceTop(OffsetValueMergeTree& tree, const DiskRun* run)
+  {
+    tree.replaceTop(run->getKey(), run->sharedPrefixLength());
+  }
+
+  // The loop of MergerImpl::mergeWith, turned inside out: the source
+  // returned is only advanced on the following call.
+  template <typename Tree>
+  class TreePuller : public MergePuller {
   public:
-    MergerImpl() {}
+    TreePuller(std::vector<DiskRunSPtr>& sources)
+      : _sources(sources)
+      , _started(false)
+      , _lowest(0)
+    {
+      _tree.reset(_sources.size());
+      for (unsigned int i = 0; i < _sources.size(); ++i)
+      {
+        _tree.setKey(i, _sources[i]->getKey());
+      }
+      _tree.build();
+    }
     // default dtor OK
+
+    const DiskRun* next()
+    {
+      if (_started && !_tree.empty())
+      {
+        DiskRun* lowestRun = _sources[_lowest].get();
+        if (lowestRun->next())
+        {
+          replaceTop(_tree, lowestRun);
+        }
+        else
+        {
+          _sources[_lowest].reset();
+          _tree.removeTop();
+        }
+      }
+      _started = true;
+      if (_tree.empty())
+      {
+        return nullptr;
+      }
+      _lowest = _tree.top();
+      return _sources[_lowest].get();
+    }
+
+  private:
+    // prohibit copy/assign; do not implement
+    TreePuller(const TreePuller&);
+    TreePuller& operator=(const TreePuller&);
+
+    std::vector<DiskRunSPtr>& _sources;
+    Tree _tree;
+    bool _started;
+    unsigned int _lowest;
+  };
+
+  class MergerImpl {
+  public:
+    MergerImpl(const Merger::Options& options)
+      : _options(options)
+      , _readAheadBytes(0)
+      , _mappedSources(0)
+      , _offsetValueCoded(false) {}
+
+    ~MergerImpl()
+    {
+      // Sources abandoned mid-merge may still have reads in progress.
+      for (auto source: _sources)
+      {
+        if (source)
+        {
+          source->stopReadAhead();
+        }
+      }
+    }
+
+    bool receiveKeys() const
+    {
+      return _options._receiveKeys;
+    }
+
+    unsigned long long readAheadBytes() const
+    {
+      return _readAheadBytes;
+    }
+
+    unsigned int mappedSources() const
+    {
+      return _mappedSources;
+    }
+
+    bool offsetValueCoded() const
+    {
+      return _offsetValueCoded;
+    }
+
     void addSource(DiskRunSPtr source)
     {
       SORT_ASSERT(source);
@@ -65,36 +223,42 @@ namespace external_sort {
       {
         source->resetForRead();
       }
-      if (source->next())
+      _sources.push_back(source);
+    }
+
+    void merge(MergeWriter& target)
+    {
+      if (_options._combining.active())
+      {
+        CombiningWriter combining(target, _options._combining);
+        mergeTo(combining);
+      }
+      else
       {
-        _sources.push_back(source);
-        _mergeItems.emplace_back(source->getKey(), _mergeItems.size()-1);
+        mergeTo(target);
       }
     }
 
-    void merge(MergeWriter& target)
+    const DiskRun* next()
     {
-      const unsigned int first = 0;
-      unsigned int last = _mergeItems.size()-1;
-      std::make_heap(_mergeItems.begin(), _mergeItems.end(), RunOrder());
-      while (!_mergeItems.empty())
+      if (!_puller)
       {
-        DiskRun* lowestRun = _sources[_mergeItems[first]._runIndex].get();
-        target.writeFrom(lowestRun);
-        std::pop_heap(_mergeItems.begin(), _mergeItems.end(), RunOrder()); // move front to back
-        if (lowestRun->next())
+        startSources();
+        if (_options._algorithm == HEAP_MERGE)
+        {
+          _puller.reset(new TreePuller<HeapMergeTree>(_sources));
+        }
+        else if (allFrontCoded())
         {
-          // get the new key and float the item to its new place
-          _mergeItems[last]._key = lowestRun->getKey();
-          std::push_heap(_mergeItems.begin(), _mergeItems.end(), RunOrder());
+          _offsetValueCoded = true;
+          _puller.reset(new TreePuller<OffsetValueMergeTree>(_sources));
         }
         else
         {
-          // done with this run
-          _sources[_mergeItems[last]._runIndex].reset();
-          _mergeItems.resize(last--);
+          _puller.reset(new TreePuller<LoserMergeTree>(_sources));
         }
       }
+      return _puller->next();
     }
 
   private:
@@ -102,18 +266,198 @@ namespace external_sort {
     MergerImpl(const Merger&);
     MergerImpl& operator=(const Merger&);
 
+    void mergeTo(MergeWriter& target)
+    {
+      startSources();
+      if (_options._algorithm == HEAP_MERGE)
+      {
+        HeapMergeTree tree;
+        mergeWith(tree, target);
+      }
+      else if (allFrontCoded())
+      {
+        _offsetValueCoded = true;
+        OffsetValueMergeTree tree;
+        mergeWithCodes(tree, target);
+      }
+      else
+      {
+        LoserMergeTree tree;
+        mergeWith(tree, target);
+      }
+      target.finish();
+    }
+
+    // Map the sources small enough to map, and read ahead on the rest,
+    // splitting the read-ahead memory evenly across them (two blocks 
+    // each). If there are too many sources for each to get blocks of at
+    // least MIN_READ_AHEAD_BLOCK, only the largest ones read ahead, and
+    // the rest are read synchronously; either way the buffers given to
+    // reading ahead never total more than _readAheadMemory. Then position
+    // each source on its first record, dropping any that are empty.
+    void startSources()
+    {
+      std::vector<DiskRun*> unmapped;
+      for (auto source: _sources)
+      {
+        if (source->fileSize() > _options._maxMappedRunSize || 
+            !source->startMapped())
+        {
+          unmapped.push_back(source.get());
+        }
+        else
+        {
+          ++ _mappedSources;
+        }
+      }
+      unsigned long long maxReadAheadSources = 
+        _options._readAheadMemory / (2 * MIN_READ_AHEAD_BLOCK);
+      if (maxReadAheadSources && !unmapped.empty())
+      {
+        std::stable_sort(unmapped.begin(), unmapped.end(), 
+                         [](const DiskRun* left, const DiskRun* right) {
+                           return left->fileSize() > right->fileSize();
+                         });
+        unsigned long long readAheadSources = 
+          std::min(maxReadAheadSources, (unsigned long long) unmapped.size());
+        unsigned int blockSize = (unsigned int) 
+          std::min(_options._readAheadMemory / (2 * readAheadSources),
+                   (unsigned long long) DiskRun::MAX_READ_AHEAD_BLOCK);
+        _readAhead.reset(new AsyncIO);
+        for (auto source: unmapped)
+        {
+          // The headroom for a run's largest record comes out of the
+          // memory too, which can leave too little for the last few.
+          unsigned long long footprint = source->readAheadFootprint(blockSize);
+          if (_readAheadBytes + footprint <= _options._readAheadMemory)
+          {
+            source->startReadAhead(_readAhead.get(), blockSize);
+            _readAheadBytes += footprint;
+          }
+        }
+      }
+      std::vector<DiskRunSPtr> sources;
+      sources.swap(_sources);
+      for (auto source: sources)
+      {
+        if (source->next())
+        {
+          _sources.push_back(source);
+        }
+      }
+    }
+
+    template <typename Tree>
+    void mergeWith(Tree& tree, MergeWriter& target)
+    {
+      tree.reset(_sources.size());
+      for (unsigned int i = 0; i < _sources.size(); ++i)
+      {
+        tree.setKey(i, _sources[i]->getKey());
+      }
+      tree.build();
+      while (!tree.empty())
+      {
+        unsigned int lowest = tree.top();
+        DiskRun* lowestRun = _sources[lowest].get();
+        target.writeFrom(lowestRun);
+        if (lowestRun->next())
+        {
+          tree.replaceTop(lowestRun->getKey());
+        }
+        else
+        {
+          // done with this run
+          _sources[lowest].reset();
+          tree.removeTop();
+        }
+      }
+      _sources.clear();
+    }
+
+    // Front-coded sources carry the prefix each key shares with the one
+    // before it, which is all the offset-value coded merge needs.
+    bool allFrontCoded() const
+    {
+      for (auto source: _sources)
+      {
+        if (!source->isFrontCoded())
+        {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Like mergeWith, but the codes mean most matches are decided without
+    // comparing keys, and the target learns each key's shared prefix with
+    // the last one written without comparing them either.
+    void mergeWithCodes(OffsetValueMergeTree& tree, MergeWriter& target)
+    {
+      tree.reset(_sources.size());
+      for (unsigned int i = 0; i < _sources.size(); ++i)
+      {
+        tree.setKey(i, _sources[i]->getKey());
+      }
+      tree.build();
+      while (!tree.empty())
+      {
+        unsigned int lowest = tree.top();
+        DiskRun* lowestRun = _sources[lowest].get();
+        target.writeFrom(lowestRun, tree.topOffset());
+        if (lowestRun->next())
+        {
+          tree.replaceTop(lowestRun->getKey(), lowestRun->sharedPrefixLength());
+        }
+        else
+        {
+          // done with this run
+          _sources[lowest].reset();
+          tree.removeTop();
+        }
+      }
+      _sources.clear();
+    }
+
+    Merger::Options _options;
+    std::unique_ptr<AsyncIO> _readAhead; // outlives the sources' reads
+    unsigned long long _readAheadBytes;
+    unsigned int _mappedSources;
+    bool _offsetValueCoded;
     std::vector<DiskRunSPtr> _sources;
-    std::vector<MergeItem> _mergeItems;
+    std::unique_ptr<MergePuller> _puller; // refers to _sources
   };
 
-  Merger::Merger()
-    : _impl(new MergerImpl) {}
+  Merger::Merger(const Options& options)
+    : _impl(new MergerImpl(options)) {}
+
+  Merger::~Merger() {}
 
   void Merger::addSource(DiskRunSPtr source)
   {
     _impl->addSource(source);
   }
   
+  const DiskRun* Merger::next()
+  {
+    return _impl->next();
+  }
+
+  unsigned long long Merger::readAheadBytes() const
+  {
+    return _impl->readAheadBytes();
+  }
+
+  unsigned int Merger::mappedSources() const
+  {
+    return _impl->mappedSources();
+  }
+
+  bool Merger::offsetValueCoded() const
+  {
+    return _impl->offsetValueCoded();
+  }
+
   class DiskRunWriter : public MergeWriter {
   public:
     DiskRunWriter(DiskRunSPtr target)
@@ -123,6 +467,14 @@ namespace external_sort {
     {
       _target->copyCurrentFrom(*run);
     }
+    void writeFrom(const DiskRun* run, unsigned int sharedPrefixLength)
+    {
+      _target->copyCurrentFrom(*run, sharedPrefixLength);
+    }
+    void write(const DiskRun::Item& key, const DiskRun::Item& payload)
+    {
+      _target->write(key._data, key._length, payload._data, payload._length);
+    }
   private:
     DiskRunSPtr _target;
   };
@@ -135,21 +487,105 @@ namespace external_sort {
 
   class ReceiverWriter : public MergeWriter {
   public:
-    ReceiverWriter(Receiver* target)
-      : _target(target) {}
+    ReceiverWriter(Receiver* target, bool receiveKeys)
+      : _target(target)
+      , _receiveKeys(receiveKeys) {}
     // default dtor/copy/assign OK
     void writeFrom(const DiskRun* run)
     {
-      DiskRun::Item payload = run->getPayload();
+      DiskRun::Item payload = (_receiveKeys ? run->getKey() : run->getPayload());
       _target->receive(payload._data, payload._length);
     }
+    void write(const DiskRun::Item& key, const DiskRun::Item& payload)
+    {
+      const DiskRun::Item& item = (_receiveKeys ? key : payload);
+      _target->receive(item._data, item._length);
+    }
   private:
     Receiver* _target;
+    bool _receiveKeys;
+  };
+
+  // A run's current payload only lasts until its next record is read, so
+  // the batch's payloads are copied, back to back, into a buffer.
+  class BatchReceiverWriter : public MergeWriter {
+  public:
+    BatchReceiverWriter(BatchReceiver* target, bool receiveKeys)
+      : _target(target)
+      , _receiveKeys(receiveKeys)
+    {
+      _buffer.reserve(BatchReceiver::MAX_BATCH_BYTES);
+      _ends.reserve(BatchReceiver::MAX_BATCH_RECORDS);
+      _batch.reserve(BatchReceiver::MAX_BATCH_RECORDS);
+    }
+    // default dtor OK
+    void writeFrom(const DiskRun* run)
+    {
+      add(_receiveKeys ? run->getKey() : run->getPayload());
+    }
+    void write(const DiskRun::Item& key, const DiskRun::Item& payload)
+    {
+      add(_receiveKeys ? key : payload);
+    }
+    void finish()
+    {
+      if (!_ends.empty())
+      {
+        flush();
+      }
+    }
+  private:
+    // prohibit copy/assign; do not implement
+    BatchReceiverWriter(const BatchReceiverWriter&);
+    BatchReceiverWriter& operator=(const BatchReceiverWriter&);
+
+    void add(const DiskRun::Item& payload)
+    {
+      if (!_ends.empty() && _buffer.size() + payload._length > BatchReceiver::MAX_BATCH_BYTES)
+      {
+        flush();
+      }
+      const char* data = (const char*) payload._data;
+      _buffer.insert(_buffer.end(), data, data + payload._length);
+      _ends.push_back(_buffer.size());
+      if (_ends.size() == BatchReceiver::MAX_BATCH_RECORDS)
+      {
+        flush();
+      }
+    }
+
+    void flush()
+    {
+      // the buffer may have moved as it grew, so the views are made now
+      size_t start = 0;
+      for (auto end: _ends)
+      {
+        _batch.push_back(Span(_buffer.data() + start, end - start));
+        start = end;
+      }
+      _target->receiveBatch(_batch.data(), _batch.size());
+      _batch.clear();
+      _ends.clear();
+      _buffer.clear();
+    }
+
+    BatchReceiver* _target;
+    bool _receiveKeys;
+    std::vector<char> _buffer;
+    std::vector<size_t> _ends; // of each payload in _buffer
+    std::vector<Span> _batch;
   };
 
   void Merger::merge(Receiver* target)
   {
-    ReceiverWriter writer(target);
+    BatchReceiver* batchTarget = dynamic_cast<BatchReceiver*>(target);
+    if (batchTarget)
+    {
+      BatchReceiverWriter writer(batchTarget, _impl->receiveKeys());
+      _impl->merge(writer);
+      return;
+    }
+    ReceiverWriter writer(target, _impl->receiveKeys());
     _impl->merge(writer);
   }
 
@@ -6,6 +6,9 @@
 #ifndef EXTERNAL_SORT_MERGER_H
 #define EXTERNAL_SORT_MERGER_H
 
+#include "sorter.h" // for MergeAlgorithm
+#include "combine.h"
+
 #include <vector>
 #include <memory>
 
@@ -19,12 +22,51 @@ namespace external_sort {
 
   class Merger {
   public:
-    Merger();
-    // default dtor OK
+    struct Options {
+      Options()
+        : _algorithm(LOSER_TREE_MERGE)
+        , _readAheadMemory(0)
+        , _maxMappedRunSize(0)
+        , _receiveKeys(false) {}
+      // default dtor/copy/assign OK
+
+      MergeAlgorithm _algorithm;
+      // The total memory used to read ahead on the sources; 0 reads each
+      // source synchronously as it is consumed.
+      unsigned long long _readAheadMemory;
+      // Sources no larger than this are memory-mapped rather than read;
+      // 0 maps none.
+      unsigned long long _maxMappedRunSize;
+      // Merging to a Receiver hands it each key rather than the payload
+      // (for a sort of keys only).
+      bool _receiveKeys;
+      // Records with equal keys are combined by merge(), though not by
+      // next().
+      Combining _combining;
+    };
+
+    Merger(const Options& options = Options());
+    ~Merger(); // out of line, where MergerImpl is complete
     void addSource(DiskRunSPtr);
     void merge(DiskRunSPtr);
     void merge(Receiver*);
 
+    // Or pull the merged records one at a time: each call returns the
+    // source positioned on the next record (whose key and payload are
+    // valid until the following call), or null once there are no more.
+    const DiskRun* next();
+
+    // The memory given to the sources' read-ahead buffers, once the
+    // merge has started; never more than Options::_readAheadMemory.
+    unsigned long long readAheadBytes() const;
+
+    // The sources memory-mapped, once the merge has started
+    unsigned int mappedSources() const;
+
+    // True once a merge of front-coded sources has started, which
+    // compares offset-value codes rather than whole keys
+    bool offsetValueCoded() const;
+
   private:
     // Prohibit copy/assign; do not implement
     Merger(const Merger&);
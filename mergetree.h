@@ -0,0 +1,480 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#ifndef EXTERNAL_SORT_MERGETREE_H
+#define EXTERNAL_SORT_MERGETREE_H
+
+#include "diskrun.h" // for DiskRun::Item
+
+#include <cstring> // for memcmp
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+/*
+  The selection structures used by the merge to pick the source with the
+  lowest current key. Both present the same interface, so the merge loop
+  can be instantiated with either:
+
+    reset(n)          - prepare for n sources, all initially exhausted
+    setKey(i, key)    - give source i its first key (before build())
+    build()           - establish the initial order
+    empty()           - true when every source is exhausted
+    top()             - the index of the source with the lowest key
+    replaceTop(key)   - the top source advanced to a new key
+    removeTop()       - the top source is exhausted
+
+  Equal keys are ordered by source index, so a merge of sources added
+  oldest first is stable.
+
+  OffsetValueMergeTree is a variant of the loser tree for sources that
+  know how much of each key is shared with the one before it (as a
+  front-coded DiskRun does). Its replaceTop(key, shared) takes that
+  length too, and topOffset() gives the top key's shared prefix with the
+  previous top, so the merge output can be front coded for free.
+
+  Like runstate.h, this is all inline for
+  performance, so there is no corresponding .cpp file.
+*/
+
+namespace external_sort {
+
+  // The order of keys everywhere in the sort: bytewise, with a key that
+  // is a prefix of another first.
+  inline
+  int compareKeys(const void* left, unsigned int leftLength,
+                  const void* right, unsigned int rightLength)
+  {
+    size_t compareLength = (size_t) std::min(leftLength, rightLength);
+    int result = memcmp(left, right, compareLength);
+    if (result == 0) 
+    {
+      return (leftLength < rightLength ? -1 : (leftLength == rightLength ? 0 : 1));
+    }
+    return result;
+  }
+
+  inline
+  int compareKeys(const DiskRun::Item& left, const DiskRun::Item& right)
+  {
+    return compareKeys(left._data, left._length, right._data, right._length);
+  }
+
+  struct MergeItem {
+    DiskRun::Item _key;
+    unsigned int _runIndex;
+
+    MergeItem() {}
+    MergeItem(const DiskRun::Item& key, unsigned int runIndex)
+      : _key(key)
+      , _runIndex(runIndex) {}
+    // default dtor/copy/assign OK
+
+    inline
+    bool less(const MergeItem& rhs) const
+    {
+      int result = compareKeys(_key, rhs._key);
+      if (result == 0) 
+      {
+        return _runIndex < rhs._runIndex;
+      }
+      return (result < 0 ? true : false);
+    }
+  };
+
+  // A binary heap of the sources' current keys. Each output record costs
+  // a pop_heap and a push_heap, about 2*log2(k) comparisons.
+  class HeapMergeTree {
+  public:
+    HeapMergeTree() {}
+    // default dtor OK
+
+    void reset(unsigned int sources)
+    {
+      _items.clear();
+      _items.reserve(sources);
+    }
+
+    void setKey(unsigned int source, const DiskRun::Item& key)
+    {
+      _items.emplace_back(key, source);
+    }
+
+    void build()
+    {
+      std::make_heap(_items.begin(), _items.end(), RunOrder());
+    }
+
+    inline
+    bool empty() const
+    {
+      return _items.empty();
+    }
+
+    inline
+    unsigned int top() const
+    {
+      return _items.front()._runIndex;
+    }
+
+    inline
+    void replaceTop(const DiskRun::Item& key)
+    {
+      // move front to back, then float it to its new place
+      std::pop_heap(_items.begin(), _items.end(), RunOrder());
+      _items.back()._key = key;
+      std::push_heap(_items.begin(), _items.end(), RunOrder());
+    }
+
+    inline
+    void removeTop()
+    {
+      std::pop_heap(_items.begin(), _items.end(), RunOrder());
+      _items.pop_back();
+    }
+
+  private:
+    // Prohibit copy/assign; do not implement
+    HeapMergeTree(const HeapMergeTree&);
+    HeapMergeTree& operator=(const HeapMergeTree&);
+
+    struct RunOrder {
+      bool operator() (const MergeItem& left, const MergeItem& right) const
+      {
+        // The heap needs to be ordered smallest to largest, so invert the
+        // usual sense of order.
+        return right.less(left);
+      }
+    };
+
+    std::vector<MergeItem> _items;
+  };
+
+  // A tournament tree of losers. The sources are the leaves (source i is
+  // node i+k), each internal node 1..k-1 holds the source that lost the
+  // match played there, and the overall winner is kept separately. When
+  // the winner's key changes, it replays only the matches on its path to
+  // the root: exactly ceil(log2(k)) comparisons per output record,
+  // always touching the same nodes in the same order.
+  class LoserMergeTree {
+  public:
+    LoserMergeTree()
+      : _sources(0)
+      , _winner(0)
+      , _live(0) {}
+    // default dtor OK
+
+    void reset(unsigned int sources)
+    {
+      _sources = sources;
+      _keys.assign(sources, DiskRun::Item());
+      _exhausted.assign(sources, true);
+      _losers.assign(std::max(sources, 1u), 0);
+      _winner = 0;
+      _live = 0;
+    }
+
+    void setKey(unsigned int source, const DiskRun::Item& key)
+    {
+      _keys[source] = key;
+      if (_exhausted[source])
+      {
+        _exhausted[source] = false;
+        ++ _live;
+      }
+    }
+
+    void build()
+    {
+      if (_sources > 0)
+      {
+        _winner = play(1);
+      }
+    }
+
+    inline
+    bool empty() const
+    {
+      return _live == 0;
+    }
+
+    inline
+    unsigned int top() const
+    {
+      return _winner;
+    }
+
+    inline
+    void replaceTop(const DiskRun::Item& key)
+    {
+      _keys[_winner] = key;
+      replay();
+    }
+
+    inline
+    void removeTop()
+    {
+      _exhausted[_winner] = true;
+      -- _live;
+      replay();
+    }
+
+  private:
+    // Prohibit copy/assign; do not implement
+    LoserMergeTree(const LoserMergeTree&);
+    LoserMergeTree& operator=(const LoserMergeTree&);
+
+    // Exhausted sources lose to everything.
+    inline
+    bool less(unsigned int left, unsigned int right) const
+    {
+      if (_exhausted[left] || _exhausted[right])
+      {
+        return _exhausted[right] && (!_exhausted[left] || left < right);
+      }
+      int result = compareKeys(_keys[left], _keys[right]);
+      if (result == 0)
+      {
+        return left < right;
+      }
+      return result < 0;
+    }
+
+    // Returns the winner of the subtree rooted at node, recording the
+    // losers along the way.
+    unsigned int play(unsigned int node)
+    {
+      if (node >= _sources)
+      {
+        return node - _sources;
+      }
+      unsigned int left = play(2*node);
+      unsigned int right = play(2*node + 1);
+      if (less(right, left))
+      {
+        _losers[node] = left;
+        return right;
+      }
+      _losers[node] = right;
+      return left;
+    }
+
+    inline
+    void replay()
+    {
+      unsigned int winner = _winner;
+      for (unsigned int node = (winner + _sources)/2; node > 0; node /= 2)
+      {
+        unsigned int loser = _losers[node];
+        if (less(loser, winner))
+        {
+          _losers[node] = winner;
+          winner = loser;
+        }
+      }
+      _winner = winner;
+    }
+
+    unsigned int _sources;
+    unsigned int _winner;
+    unsigned int _live;
+    std::vector<DiskRun::Item> _keys;
+    std::vector<char> _exhausted;
+    std::vector<unsigned int> _losers;
+  };
+
+  // A tree of losers over offset-value codes. Each source's current key
+  // is coded relative to a base key no greater than it: the offset is the
+  // length of the prefix it shares with the base, and the value is its
+  // byte at that offset (or 0 if the key ends there, i.e. it equals the
+  // base). If two keys are coded against the same base, the one with the
+  // larger offset is lower, and for equal offsets the one with the lower
+  // value, so the codes (packed so that this is integer order) usually
+  // decide a match without looking at the keys. Only when the codes are
+  // equal are the keys compared, from just past the offset, and then the
+  // loser is recoded against the winner.
+  //
+  // This works because every key in the tree is coded against the winner
+  // of the match that put it there: a source's new key starts out coded
+  // against its own previous key, which was the last key output, and the
+  // keys it meets on the way up were all coded against that same key.
+  // Initial keys are coded against the empty key.
+  class OffsetValueMergeTree {
+  public:
+    OffsetValueMergeTree()
+      : _sources(0)
+      , _winner(0)
+      , _live(0) {}
+    // default dtor OK
+
+    void reset(unsigned int sources)
+    {
+      _sources = sources;
+      _keys.assign(sources, DiskRun::Item());
+      _codes.assign(sources, (uint64_t) EXHAUSTED);
+      _losers.assign(std::max(sources, 1u), 0);
+      _winner = 0;
+      _live = 0;
+    }
+
+    void setKey(unsigned int source, const DiskRun::Item& key)
+    {
+      if (_codes[source] == EXHAUSTED)
+      {
+        ++ _live;
+      }
+      _keys[source] = key;
+      _codes[source] = codeOf(key, 0);
+    }
+
+    void build()
+    {
+      if (_sources > 0)
+      {
+        _winner = play(1);
+      }
+    }
+
+    inline
+    bool empty() const
+    {
+      return _live == 0;
+    }
+
+    inline
+    unsigned int top() const
+    {
+      return _winner;
+    }
+
+    // How many leading bytes the top key shares with the previous top
+    // (0 for the first).
+    inline
+    unsigned int topOffset() const
+    {
+      return (unsigned int) (MAX_OFFSET - (_codes[_winner] >> VALUE_BITS));
+    }
+
+    // shared is the length of the prefix the new key shares with the top
+    // source's previous key.
+    inline
+    void replaceTop(const DiskRun::Item& key, unsigned int shared)
+    {
+      _keys[_winner] = key;
+      _codes[_winner] = codeOf(key, shared);
+      replay();
+    }
+
+    inline
+    void removeTop()
+    {
+      _codes[_winner] = EXHAUSTED;
+      -- _live;
+      replay();
+    }
+
+  private:
+    // Prohibit copy/assign; do not implement
+    OffsetValueMergeTree(const OffsetValueMergeTree&);
+    OffsetValueMergeTree& operator=(const OffsetValueMergeTree&);
+
+    static const unsigned int VALUE_BITS = 9; // byte+1, or 0 at the end
+    static const uint64_t MAX_OFFSET = 0xFFFFFFFFull;
+    static const uint64_t EXHAUSTED = ~0ull;  // above every real code
+
+    static inline
+    uint64_t codeOf(const DiskRun::Item& key, unsigned int offset)
+    {
+      uint64_t value = (offset < key._length 
+                        ? (uint64_t) ((const unsigned char*) key._data)[offset] + 1
+                        : 0);
+      return ((MAX_OFFSET - offset) << VALUE_BITS) | value;
+    }
+
+    // Plays a match between two sources coded against the same base,
+    // returning the winner and recoding the loser against it. Exhausted
+    // sources lose to everything.
+    inline
+    unsigned int match(unsigned int left, unsigned int right)
+    {
+      uint64_t leftCode = _codes[left];
+      uint64_t rightCode = _codes[right];
+      if (leftCode != rightCode)
+      {
+        return leftCode < rightCode ? left : right;
+      }
+      if (leftCode == EXHAUSTED || (leftCode & ((1u << VALUE_BITS) - 1)) == 0)
+      {
+        // both exhausted, or both equal to the base
+        return std::min(left, right);
+      }
+
+      // Same offset and byte; compare what follows.
+      const DiskRun::Item& leftKey = _keys[left];
+      const DiskRun::Item& rightKey = _keys[right];
+      const char* leftData = (const char*) leftKey._data;
+      const char* rightData = (const char*) rightKey._data;
+      unsigned int start = (unsigned int) (MAX_OFFSET - (leftCode >> VALUE_BITS)) + 1;
+      unsigned int offset = start +
+        DiskRun::commonPrefixLength(leftData + start, leftKey._length - start,
+                                    rightData + start, rightKey._length - start);
+      bool leftWins;
+      if (offset == leftKey._length || offset == rightKey._length)
+      {
+        leftWins = leftKey._length < rightKey._length ||
+          (leftKey._length == rightKey._length && left < right);
+      }
+      else
+      {
+        leftWins = (unsigned char) leftData[offset] < (unsigned char) rightData[offset];
+      }
+      unsigned int winner = leftWins ? left : right;
+      unsigned int loser = leftWins ? right : left;
+      _codes[loser] = codeOf(_keys[loser], offset);
+      return winner;
+    }
+
+    // Returns the winner of the subtree rooted at node, recording the
+    // losers along the way.
+    unsigned int play(unsigned int node)
+    {
+      if (node >= _sources)
+      {
+        return node - _sources;
+      }
+      unsigned int left = play(2*node);
+      unsigned int right = play(2*node + 1);
+      unsigned int winner = match(left, right);
+      _losers[node] = (winner == left ? right : left);
+      return winner;
+    }
+
+    inline
+    void replay()
+    {
+      unsigned int winner = _winner;
+      for (unsigned int node = (winner + _sources)/2; node > 0; node /= 2)
+      {
+        unsigned int loser = _losers[node];
+        if (match(loser, winner) == loser)
+        {
+          _losers[node] = winner;
+          winner = loser;
+        }
+      }
+      _winner = winner;
+    }
+
+    unsigned int _sources;
+    unsigned int _winner;
+    unsigned int _live;
+    std::vector<DiskRun::Item> _keys;
+    std::vector<uint64_t> _codes;
+    std::vector<unsigned int> _losers;
+  };
+
+} // namespace external_sort
+
+#endif // EXTERNAL_SORT_MERGETREE_H
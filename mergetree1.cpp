@@ -0,0 +1,188 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#include "mergetree.h"
+#include "keyconvert.h"
+#include "gtest/gtest.h"
+
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <stdint.h>
+
+namespace {
+
+  using ::external_sort::DiskRun;
+
+  // Each source is a sorted vector of 4 byte keys; the merged output is
+  // recorded as (key, source) pairs so that the tie order can be checked.
+  typedef std::vector<uint32_t> Source;
+  typedef std::pair<uint32_t, unsigned int> Output;
+
+  template <typename Tree>
+  std::vector<Output> mergeSources(const std::vector<Source>& sources)
+  {
+    std::vector<std::vector<char> > keys(sources.size());
+    std::vector<unsigned int> positions(sources.size(), 0);
+    for (unsigned int i = 0; i < sources.size(); ++i)
+    {
+      keys[i].resize(4 * sources[i].size());
+      for (unsigned int j = 0; j < sources[i].size(); ++j)
+      {
+        ::external_sort::uint32ToKey(sources[i][j], &keys[i][4*j]);
+      }
+    }
+
+    Tree tree;
+    tree.reset(sources.size());
+    for (unsigned int i = 0; i < sources.size(); ++i)
+    {
+      if (!sources[i].empty())
+      {
+        tree.setKey(i, DiskRun::Item(&keys[i][0], 4));
+      }
+    }
+    tree.build();
+
+    std::vector<Output> result;
+    while (!tree.empty())
+    {
+      unsigned int i = tree.top();
+      result.push_back({sources[i][positions[i]], i});
+      if (++positions[i] < sources[i].size())
+      {
+        tree.replaceTop(DiskRun::Item(&keys[i][4*positions[i]], 4));
+      }
+      else
+      {
+        tree.removeTop();
+      }
+    }
+    return result;
+  }
+
+  // Presents an OffsetValueMergeTree through the interface of the others,
+  // working out each key's prefix shared with the source's previous key
+  // as a front-coded run would, and checking the tree's topOffset().
+  class CodedTree {
+  public:
+    void reset(unsigned int sources)
+    {
+      _tree.reset(sources);
+      _previous.assign(sources, DiskRun::Item());
+      _output = DiskRun::Item();
+    }
+
+    void setKey(unsigned int source, const DiskRun::Item& key)
+    {
+      _tree.setKey(source, key);
+      _previous[source] = key;
+    }
+
+    void build()
+    {
+      _tree.build();
+    }
+
+    bool empty() const
+    {
+      return _tree.empty();
+    }
+
+    unsigned int top() const
+    {
+      return _tree.top();
+    }
+
+    void replaceTop(const DiskRun::Item& key)
+    {
+      checkTopOffset();
+      DiskRun::Item& previous = _previous[_tree.top()];
+      unsigned int shared = sharedLength(previous, key);
+      previous = key;
+      _tree.replaceTop(key, shared);
+    }
+
+    void removeTop()
+    {
+      checkTopOffset();
+      _tree.removeTop();
+    }
+
+  private:
+    external_sort::OffsetValueMergeTree _tree;
+    std::vector<DiskRun::Item> _previous;
+    DiskRun::Item _output;
+
+    static unsigned int sharedLength(const DiskRun::Item& left, const DiskRun::Item& right)
+    {
+      return DiskRun::commonPrefixLength((const char*) left._data, left._length,
+                                         (const char*) right._data, right._length);
+    }
+
+    void checkTopOffset()
+    {
+      const DiskRun::Item& top = _previous[_tree.top()];
+      EXPECT_EQ(sharedLength(_output, top), _tree.topOffset());
+      _output = top;
+    }
+  };
+
+  template <typename Tree>
+  void checkMerge(unsigned int fanIn, uint32_t keyRange)
+  {
+    std::mt19937 generator(fanIn);
+    std::uniform_int_distribution<uint32_t> keys(0, keyRange);
+    std::uniform_int_distribution<unsigned int> lengths(0, 50);
+    std::vector<Source> sources(fanIn);
+    std::vector<Output> expected;
+    for (unsigned int i = 0; i < fanIn; ++i)
+    {
+      sources[i].resize(lengths(generator));
+      for (auto& key: sources[i])
+      {
+        key = keys(generator);
+      }
+      std::sort(sources[i].begin(), sources[i].end());
+      for (auto key: sources[i])
+      {
+        expected.push_back({key, i});
+      }
+    }
+    // Equal keys are expected in source order.
+    std::sort(expected.begin(), expected.end());
+
+    std::vector<Output> result = mergeSources<Tree>(sources);
+    ASSERT_EQ(expected, result) << "fan-in " << fanIn;
+  }
+
+  TEST(MergeTree, Heap)
+  {
+    for (unsigned int fanIn = 0; fanIn <= 70; ++fanIn)
+    {
+      checkMerge<external_sort::HeapMergeTree>(fanIn, 1000);
+      checkMerge<external_sort::HeapMergeTree>(fanIn, 3);
+    }
+  }
+
+  TEST(MergeTree, Loser)
+  {
+    for (unsigned int fanIn = 0; fanIn <= 70; ++fanIn)
+    {
+      checkMerge<external_sort::LoserMergeTree>(fanIn, 1000);
+      checkMerge<external_sort::LoserMergeTree>(fanIn, 3);
+    }
+  }
+
+  TEST(MergeTree, OffsetValue)
+  {
+    for (unsigned int fanIn = 0; fanIn <= 70; ++fanIn)
+    {
+      checkMerge<CodedTree>(fanIn, 1000);
+      checkMerge<CodedTree>(fanIn, 3);
+      checkMerge<CodedTree>(fanIn, 0xFFFFFFFF);
+    }
+  }
+}
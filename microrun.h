@@ -0,0 +1,166 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#ifndef EXTERNAL_SORT_MICRORUN_H
+#define EXTERNAL_SORT_MICRORUN_H
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <unistd.h> // for sysconf
+
+/*
+  Support for sorting a large array of entries as microruns, pieces
+  small enough to sort while they are cache resident, followed by one
+  multiway merge of the pieces.
+
+  The merge is a tournament tree of losers, like LoserMergeTree in
+  mergetree.h, but over in-memory ranges of entries rather than disk
+  runs. It keeps a copy of each range's current entry next to the tree,
+  so the comparisons touch a few cache lines, and each range is read
+  (and the output written) strictly sequentially, which the prefetcher
+  handles well. Equal entries are ordered by range index, so merging
+  ranges that were stably sorted, in order, is stable.
+
+  Like runstate.h, this is all inline, so there is no .cpp file.
+*/
+
+namespace external_sort {
+
+  // The number of bytes of entries to sort as one microrun: half the L2
+  // cache, leaving the rest for the keys compared beyond their entries.
+  inline
+  size_t microrunBytes()
+  {
+    static const long DEFAULT_L2_CACHE_SIZE = 256 * 1024;
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (l2 <= 0)
+    {
+      l2 = DEFAULT_L2_CACHE_SIZE;
+    }
+    return (size_t) l2 / 2;
+  }
+
+  template <typename Entry, typename Less>
+  class MicrorunMerger {
+  public:
+    typedef std::pair<const Entry*, const Entry*> Range;
+
+    MicrorunMerger(const Less& less)
+      : _less(less)
+      , _sources(0)
+      , _winner(0) {}
+    // default dtor OK
+
+    // Merges the sorted ranges into target, which must have room for
+    // all of their entries.
+    void merge(const std::vector<Range>& ranges, Entry* target)
+    {
+      _sources = ranges.size();
+      if (_sources == 0)
+      {
+        return;
+      }
+      _ranges = ranges;
+      _current.resize(_sources);
+      _exhausted.assign(_sources, false);
+      _losers.assign(_sources, 0);
+      unsigned int live = 0;
+      for (unsigned int i = 0; i < _sources; ++i)
+      {
+        if (_ranges[i].first == _ranges[i].second)
+        {
+          _exhausted[i] = true;
+        }
+        else
+        {
+          _current[i] = *_ranges[i].first++;
+          ++ live;
+        }
+      }
+      _winner = play(1);
+
+      while (live > 0)
+      {
+        *target++ = _current[_winner];
+        Range& range = _ranges[_winner];
+        if (range.first == range.second)
+        {
+          _exhausted[_winner] = true;
+          -- live;
+        }
+        else
+        {
+          _current[_winner] = *range.first++;
+        }
+        replay();
+      }
+    }
+
+  private:
+    // prohibit copy/assign; do not implement
+    MicrorunMerger(const MicrorunMerger&);
+    MicrorunMerger& operator=(const MicrorunMerger&);
+
+    // Exhausted ranges lose to everything.
+    inline
+    bool less(unsigned int left, unsigned int right) const
+    {
+      if (_exhausted[left] || _exhausted[right])
+      {
+        return _exhausted[right] && (!_exhausted[left] || left < right);
+      }
+      if (_less(_current[left], _current[right]))
+      {
+        return true;
+      }
+      return !_less(_current[right], _current[left]) && left < right;
+    }
+
+    unsigned int play(unsigned int node)
+    {
+      if (node >= _sources)
+      {
+        return node - _sources;
+      }
+      unsigned int left = play(2*node);
+      unsigned int right = play(2*node + 1);
+      if (less(right, left))
+      {
+        _losers[node] = left;
+        return right;
+      }
+      _losers[node] = right;
+      return left;
+    }
+
+    inline
+    void replay()
+    {
+      unsigned int winner = _winner;
+      for (unsigned int node = (winner + _sources)/2; node > 0; node /= 2)
+      {
+        unsigned int loser = _losers[node];
+        if (less(loser, winner))
+        {
+          _losers[node] = winner;
+          winner = loser;
+        }
+      }
+      _winner = winner;
+    }
+
+    Less _less;
+    unsigned int _sources;
+    unsigned int _winner;
+    std::vector<Range> _ranges;
+    std::vector<Entry> _current;
+    std::vector<char> _exhausted;
+    std::vector<unsigned int> _losers;
+  };
+
+} // namespace external_sort
+
+#endif // EXTERNAL_SORT_MICRORUN_H
@@ -0,0 +1,192 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#ifndef EXTERNAL_SORT_RADIXSORT_H
+#define EXTERNAL_SORT_RADIXSORT_H
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+
+/*
+  A most-significant-digit radix sort over byte-string keys. Each pass
+  distributes a range into 257 buckets by the key byte at the current
+  depth - bucket 0 holds the keys that have already ended, which are all
+  equal, and bucket b+1 holds the keys whose byte is b - and then sorts
+  each bucket one byte deeper. Ranges smaller than SMALL_RANGE are handed
+  to a comparison sort instead, as are ranges more than MAX_RECURSION
+  splits deep: keys nested as prefixes of each other ("a", "aa", "aaa",
+  ...) would otherwise recurse once per key, each level with its own
+  counts on the stack.
+
+  The unstable variant permutes each range in place, American flag
+  style. The stable variant distributes through a scratch array instead
+  and falls back to a stable comparison sort.
+
+  The sort is parameterized by the entry type, by a Digit functor:
+
+    unsigned int operator() (const Entry& e, unsigned int depth) const
+
+  returning 0 if e's key is shorter than depth+1 bytes, or else 1 plus
+  the key's byte at depth, and by a Less functor ordering entire keys.
+  Like runstate.h, this is all inline, so there is no .cpp file.
+*/
+
+namespace external_sort {
+
+  template <typename Entry, typename Digit, typename Less>
+  class RadixSorter {
+  public:
+    static const unsigned int BUCKETS = 257;
+    static const size_t SMALL_RANGE = 64;
+    static const unsigned int MAX_RECURSION = 32;
+
+    RadixSorter(const Digit& digit, const Less& less, bool stable)
+      : _digit(digit)
+      , _less(less)
+      , _stable(stable) {}
+    // default dtor OK
+
+    void sort(Entry* begin, Entry* end)
+    {
+      if (_stable)
+      {
+        _scratch.resize(end - begin);
+      }
+      sortRange(begin, end, 0, 0);
+    }
+
+  private:
+    // prohibit copy/assign; do not implement
+    RadixSorter(const RadixSorter&);
+    RadixSorter& operator=(const RadixSorter&);
+
+    void sortRange(Entry* begin, Entry* end, unsigned int depth,
+                   unsigned int recursion)
+    {
+      size_t counts[BUCKETS];
+      for (;;)
+      {
+        size_t length = end - begin;
+        if (length < SMALL_RANGE || recursion > MAX_RECURSION)
+        {
+          comparisonSort(begin, end);
+          return;
+        }
+
+        std::fill(counts, counts + BUCKETS, 0);
+        for (Entry* e = begin; e != end; ++e)
+        {
+          ++ counts[_digit(*e, depth)];
+        }
+
+        // Keys sharing their leading bytes (small integers, timestamps
+        // from the same day...) land in one bucket; just go deeper.
+        unsigned int only = _digit(*begin, depth);
+        if (counts[only] == length)
+        {
+          if (only == 0)
+          {
+            return; // all equal
+          }
+          ++ depth;
+          continue;
+        }
+        break;
+      }
+
+      if (_stable)
+      {
+        distributeStable(begin, end, depth, counts);
+      }
+      else
+      {
+        distributeInPlace(begin, end, depth, counts);
+      }
+
+      // bucket 0 is all equal keys, already in order
+      Entry* bucket = begin + counts[0];
+      for (unsigned int b = 1; b < BUCKETS; ++b)
+      {
+        if (counts[b] > 1)
+        {
+          sortRange(bucket, bucket + counts[b], depth + 1, recursion + 1);
+        }
+        bucket += counts[b];
+      }
+    }
+
+    void distributeInPlace(Entry* begin, Entry*, unsigned int depth,
+                           const size_t* counts)
+    {
+      Entry* heads[BUCKETS];
+      Entry* tails[BUCKETS];
+      Entry* next = begin;
+      for (unsigned int b = 0; b < BUCKETS; ++b)
+      {
+        heads[b] = next;
+        next += counts[b];
+        tails[b] = next;
+      }
+
+      // Take the first misplaced entry in each bucket and swap it along
+      // the cycle of buckets it displaces until one belongs here.
+      for (unsigned int b = 0; b < BUCKETS; ++b)
+      {
+        while (heads[b] < tails[b])
+        {
+          Entry entry = *heads[b];
+          unsigned int digit = _digit(entry, depth);
+          while (digit != b)
+          {
+            std::swap(entry, *heads[digit]++);
+            digit = _digit(entry, depth);
+          }
+          *heads[b]++ = entry;
+        }
+      }
+    }
+
+    void distributeStable(Entry* begin, Entry* end, unsigned int depth,
+                          const size_t* counts)
+    {
+      // Buckets are sorted only after the distribution is complete, so
+      // every level can reuse the front of the one scratch array.
+      size_t offsets[BUCKETS];
+      size_t offset = 0;
+      for (unsigned int b = 0; b < BUCKETS; ++b)
+      {
+        offsets[b] = offset;
+        offset += counts[b];
+      }
+      Entry* scratch = &_scratch[0];
+      for (Entry* e = begin; e != end; ++e)
+      {
+        scratch[offsets[_digit(*e, depth)]++] = *e;
+      }
+      std::copy(scratch, scratch + (end - begin), begin);
+    }
+
+    void comparisonSort(Entry* begin, Entry* end)
+    {
+      if (_stable)
+      {
+        std::stable_sort(begin, end, _less);
+      }
+      else
+      {
+        std::sort(begin, end, _less);
+      }
+    }
+
+    Digit _digit;
+    Less _less;
+    bool _stable;
+    std::vector<Entry> _scratch;
+  };
+
+} // namespace external_sort
+
+#endif // EXTERNAL_SORT_RADIXSORT_H
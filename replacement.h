@@ -0,0 +1,367 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#ifndef EXTERNAL_SORT_REPLACEMENT_H
+#define EXTERNAL_SORT_REPLACEMENT_H
+
+#include "sorter.h" // for exceptions
+#include "runstate.h" // for KeyPointer::prefixOf
+#include "diskrun.h"
+#include "mergetree.h" // for compareKeys
+
+#include <cstring> // for memcpy
+#include <vector>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <stdint.h>
+
+/*
+  Run generation by replacement selection. Records are held in a fixed
+  memory area, with a heap ordered by (run, key, arrival) over them. Once
+  the memory is full, the lowest record is written to the current run
+  and its space is reused for the next record. A record whose key is
+  lower than the last one written can't join the current run, so it is
+  tagged for the next one. On random input the runs average about twice
+  the memory size; on input that is nearly sorted, there may be just one.
+
+  Equal keys leave in order of arrival, and a record is only put off to
+  a later run when a greater key has already been written, so the runs,
+  merged oldest first, sort stably.
+
+  The records are variable length, so the memory is managed by a simple
+  size-class allocator: each record takes a chunk rounded up to
+  CHUNK_ALIGNMENT (or, beyond SMALL_CHUNK_LIMIT, to a power of two), and
+  freed chunks are kept on a free list per size. A chunk is only reused
+  for a record of the same class; when no chunk is free and the heap is
+  empty, the whole area is reset. A record must fit in a chunk no larger
+  than the whole area.
+
+  The caller drives the output:
+
+    while (!selection.store(key, ...))
+    {
+      // start a new run first if selection.topRun() has changed
+      selection.writeTop(run);
+    }
+
+  Like runstate.h, this is all inline for performance, so there is no
+  corresponding .cpp file.
+*/
+
+namespace external_sort {
+
+  class ReplacementSelection {
+  public:
+    static const unsigned int CHUNK_ALIGNMENT = 16;
+    static const unsigned int SMALL_CHUNK_LIMIT = 1024;
+
+    ReplacementSelection(unsigned int memorySize)
+      : _memory(new char[memorySize])
+      , _size(memorySize)
+      , _outputRun(0)
+      , _written(false)
+      , _sequence(0)
+      , _receiveKeys(false)
+    {
+      _freeLists.assign(classOf(memorySize) + 1, (unsigned int) NO_CHUNK);
+      clear();
+    }
+    // default dtor OK
+
+    // Returns false if there is no room for the record until more have
+    // been written.
+    inline
+    bool store(const void* key, unsigned int keyLength,
+               const void* payload, unsigned int payloadLength)
+    {
+      unsigned long long chunkSize = chunkSizeFor(keyLength, payloadLength);
+      if (chunkSize > _size || classSize(classOf(chunkSize)) > _size)
+      {
+        throw new RecordSizeException(keyLength, payloadLength, _size);
+      }
+      unsigned int chunkClass = classOf(chunkSize);
+      unsigned int offset = allocate(chunkClass);
+      if (offset == NO_CHUNK)
+      {
+        return false;
+      }
+
+      ChunkHeader* header = (ChunkHeader*) (_memory.get() + offset);
+      header->_class = chunkClass;
+      header->_keyLength = keyLength;
+      header->_payloadLength = payloadLength;
+      memcpy(header->keyData(), key, keyLength);
+      memcpy(header->payloadData(), payload, payloadLength);
+
+      // A key below the last one written has to wait for the next run.
+      unsigned int run = _outputRun;
+      if (_written &&
+          compareKeys(key, keyLength, _lastKey.data(), _lastKey.size()) < 0)
+      {
+        ++ run;
+      }
+      HeapEntry entry = {KeyPointer::prefixOf(key, keyLength), _sequence++,
+                         run, offset};
+      _heap.push_back(entry);
+      std::push_heap(_heap.begin(), _heap.end(), HeapOrder(_memory.get()));
+      return true;
+    }
+
+    bool empty() const
+    {
+      return _heap.empty();
+    }
+
+    unsigned int records() const
+    {
+      return _heap.size();
+    }
+
+    // The run that the next record written belongs to
+    unsigned int topRun() const
+    {
+      return _heap.front()._run;
+    }
+
+    void writeTop(DiskRun* run)
+    {
+      const ChunkHeader* header = top();
+      run->write(header->keyData(), header->_keyLength,
+                 header->payloadData(), header->_payloadLength);
+      removeTop();
+    }
+
+    void writeTop(Receiver* receiver)
+    {
+      const ChunkHeader* header = top();
+      if (_receiveKeys)
+      {
+        receiver->receive(header->keyData(), header->_keyLength);
+      }
+      else
+      {
+        receiver->receive(header->payloadData(), header->_payloadLength);
+      }
+      removeTop();
+    }
+
+    // Or read the records out in place: the lowest record's key and
+    // payload are valid until dropTop().
+    DiskRun::Item topKey() const
+    {
+      const ChunkHeader* header = top();
+      return DiskRun::Item(header->keyData(), header->_keyLength);
+    }
+
+    DiskRun::Item topPayload() const
+    {
+      const ChunkHeader* header = top();
+      return DiskRun::Item(header->payloadData(), header->_payloadLength);
+    }
+
+    void dropTop()
+    {
+      removeTop();
+    }
+
+    // Have writeTop(Receiver*) hand over keys rather than payloads, for
+    // a sort of keys only.
+    void setReceiveKeys(bool receiveKeys)
+    {
+      _receiveKeys = receiveKeys;
+    }
+
+    void clear()
+    {
+      _heap.clear();
+      resetMemory();
+      _outputRun = 0;
+      _written = false;
+      _lastKey.clear();
+    }
+
+  private:
+    // prohibit copy/assign; do not implement
+    ReplacementSelection(const ReplacementSelection&);
+    ReplacementSelection& operator=(const ReplacementSelection&);
+
+    static const unsigned int NO_CHUNK = ~0u;
+
+    struct ChunkHeader {
+      // default ctor/dtor/copy/assign OK
+      unsigned int _class;
+      unsigned int _keyLength;
+      unsigned int _payloadLength;
+      // char _keyData[] and char _payloadData[] follow
+
+      inline
+      char* keyData()
+      {
+        return ((char*) this) + sizeof(ChunkHeader);
+      }
+
+      inline
+      const char* keyData() const
+      {
+        return ((const char*) this) + sizeof(ChunkHeader);
+      }
+
+      inline
+      char* payloadData()
+      {
+        return keyData() + _keyLength;
+      }
+
+      inline
+      const char* payloadData() const
+      {
+        return keyData() + _keyLength;
+      }
+    };
+
+    struct HeapEntry {
+      // default ctor/dtor/copy/assign OK
+      uint64_t _prefix;
+      unsigned long long _sequence;
+      unsigned int _run;
+      unsigned int _offset;
+    };
+
+    // std::push_heap and std::pop_heap keep the greatest element first,
+    // so this is the reverse of the output order.
+    struct HeapOrder {
+      HeapOrder(const char* memory)
+        : _memory(memory) {}
+      // default dtor/copy/assign OK
+
+      inline
+      bool operator() (const HeapEntry& left, const HeapEntry& right) const
+      {
+        if (left._run != right._run)
+        {
+          return left._run > right._run;
+        }
+        if (left._prefix != right._prefix)
+        {
+          return left._prefix > right._prefix;
+        }
+        const ChunkHeader* l = (const ChunkHeader*) (_memory + left._offset);
+        const ChunkHeader* r = (const ChunkHeader*) (_memory + right._offset);
+        int result = compareKeys(l->keyData(), l->_keyLength,
+                                 r->keyData(), r->_keyLength);
+        if (result != 0)
+        {
+          return result > 0;
+        }
+        return left._sequence > right._sequence;
+      }
+
+      const char* _memory;
+    };
+
+    static inline
+    unsigned long long chunkSizeFor(unsigned int keyLength,
+                                    unsigned int payloadLength)
+    {
+      unsigned long long size = sizeof(ChunkHeader);
+      size += keyLength;
+      size += payloadLength;
+      return (size + CHUNK_ALIGNMENT - 1) & ~(CHUNK_ALIGNMENT - 1ULL);
+    }
+
+    // Classes 1..SMALL_CHUNK_LIMIT/CHUNK_ALIGNMENT are exact multiples of
+    // CHUNK_ALIGNMENT; above that, each class is a power of two.
+    static inline
+    unsigned int classOf(unsigned long long chunkSize)
+    {
+      if (chunkSize <= SMALL_CHUNK_LIMIT)
+      {
+        return (chunkSize + CHUNK_ALIGNMENT - 1)/CHUNK_ALIGNMENT;
+      }
+      unsigned int power = 64 - __builtin_clzll(chunkSize - 1);
+      return SMALL_CHUNK_LIMIT/CHUNK_ALIGNMENT + power - 10;
+    }
+
+    static inline
+    unsigned long long classSize(unsigned int chunkClass)
+    {
+      if (chunkClass <= SMALL_CHUNK_LIMIT/CHUNK_ALIGNMENT)
+      {
+        return chunkClass * CHUNK_ALIGNMENT;
+      }
+      return 1ULL << (chunkClass - SMALL_CHUNK_LIMIT/CHUNK_ALIGNMENT + 10);
+    }
+
+    inline
+    unsigned int allocate(unsigned int chunkClass)
+    {
+      unsigned int offset = _freeLists[chunkClass];
+      if (offset != NO_CHUNK)
+      {
+        // the link to the next free chunk is kept in the chunk itself
+        memcpy(&_freeLists[chunkClass], _memory.get() + offset, sizeof(offset));
+        return offset;
+      }
+      if (_heap.empty())
+      {
+        // Nothing is in use, so start over; this also undoes any
+        // fragmentation among the size classes.
+        resetMemory();
+      }
+      unsigned long long size = classSize(chunkClass);
+      if (_unallocated + size > _size)
+      {
+        return NO_CHUNK;
+      }
+      offset = _unallocated;
+      _unallocated += size;
+      return offset;
+    }
+
+    inline
+    const ChunkHeader* top() const
+    {
+      return (const ChunkHeader*) (_memory.get() + _heap.front()._offset);
+    }
+
+    inline
+    void removeTop()
+    {
+      const HeapEntry entry = _heap.front();
+      ChunkHeader* header = (ChunkHeader*) (_memory.get() + entry._offset);
+      _outputRun = entry._run;
+      _written = true;
+      _lastKey.assign(header->keyData(), header->_keyLength);
+
+      std::pop_heap(_heap.begin(), _heap.end(), HeapOrder(_memory.get()));
+      _heap.pop_back();
+
+      unsigned int chunkClass = header->_class;
+      memcpy(header, &_freeLists[chunkClass], sizeof(entry._offset));
+      _freeLists[chunkClass] = entry._offset;
+    }
+
+    void resetMemory()
+    {
+      std::fill(_freeLists.begin(), _freeLists.end(), (unsigned int) NO_CHUNK);
+      _unallocated = 0;
+    }
+
+    std::unique_ptr<char[]> _memory;
+    unsigned int _size;
+    unsigned long long _unallocated;   // offset of the never-used space
+    std::vector<unsigned int> _freeLists; // first free chunk of each class
+    std::vector<HeapEntry> _heap;
+    unsigned int _outputRun;           // the run of the last record written
+    bool _written;                     // whether _lastKey is set
+    std::string _lastKey;
+    unsigned long long _sequence;
+    bool _receiveKeys;
+  };
+
+} // namespace external_sort
+
+#endif // EXTERNAL_SORT_REPLACEMENT_H
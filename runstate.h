@@ -7,11 +7,20 @@
 #define EXTERNAL_SORT_RUNSTATE_H
 
 #include "sorter.h" // for exceptions
+#include "diskrun.h"
+#include "radixsort.h"
+#include "microrun.h"
+#include "combine.h"
 
 #include <cstring> // for memcmp/memcpy
 #include <vector>
+#include <deque>
+#include <string>
 #include <memory>
 #include <algorithm>
+#include <thread>
+#include <exception>
+#include <stdint.h>
 
 /*
   This header provides all of the functionality related to initially
@@ -100,34 +109,104 @@ namespace external_sort {
     }
   };
 
+  // The entries that are actually sorted. Each holds the first eight
+  // bytes of its key as a big-endian integer (zero padded), so most
+  // comparisons are settled by one integer compare without touching
+  // the run block; only on equal prefixes is the rest of the key
+  // compared. The key's bytes are found by their offset in the run block
+  // (just after the KeyItem, unless the records are of fixed length).
   struct KeyPointer {
-    KeyItem* _key;
+    uint64_t _prefix;
+    unsigned int _offset;
+    unsigned int _keyLength;
 
     KeyPointer() {} // needed for vector initialization
-    KeyPointer(KeyItem* key) : _key(key) {}
+    KeyPointer(const void* key, unsigned int keyLength, unsigned int offset)
+      : _prefix(prefixOf(key, keyLength))
+      , _offset(offset)
+      , _keyLength(keyLength) {}
     // default dtor/copy/assign OK
 
+    static inline
+    uint64_t prefixOf(const void* key, unsigned int keyLength)
+    {
+      uint64_t prefix = 0;
+      memcpy(&prefix, key,
+             (size_t) std::min(keyLength, (unsigned int) sizeof(prefix)));
+      return __builtin_bswap64(prefix); // little-endian host assumed
+    }
+
     inline
-    bool operator< (const KeyPointer& rhs) const
+    const char* keyData(const char* blockBase) const
     {
-      return _key->less(*rhs._key);
+      return blockBase + _offset;
     }
 
     inline
-    explicit operator bool() const 
+    bool less(const KeyPointer& rhs, const char* blockBase) const
     {
-      return _key != nullptr;
+      if (_prefix != rhs._prefix)
+      {
+        return _prefix < rhs._prefix;
+      }
+      // The prefixes cover the first min(length, 8) bytes of both keys.
+      unsigned int compareLength = std::min(_keyLength, rhs._keyLength);
+      if (compareLength > sizeof(_prefix))
+      {
+        int result = memcmp(keyData(blockBase) + sizeof(_prefix),
+                            rhs.keyData(blockBase) + sizeof(_prefix),
+                            (size_t) (compareLength - sizeof(_prefix)));
+        if (result != 0)
+        {
+          return result < 0;
+        }
+      }
+      return _keyLength < rhs._keyLength;
     }
+  };
 
-    inline 
-    const PayloadItem* payload(const char* blockBase) const
+  struct KeyPointerLess {
+    KeyPointerLess(const char* blockBase)
+      : _blockBase(blockBase) {}
+    // default dtor/copy/assign OK
+
+    inline
+    bool operator() (const KeyPointer& left, const KeyPointer& right) const
     {
-      return (const PayloadItem*) (blockBase + _key->_dataOffset);
+      return left.less(right, _blockBase);
     }
 
+    const char* _blockBase;
+  };
+
+  // The key byte at a given depth, as RadixSorter wants it
+  struct KeyPointerDigit {
+    KeyPointerDigit(const char* blockBase)
+      : _blockBase(blockBase) {}
+    // default dtor/copy/assign OK
+
+    inline
+    unsigned int operator() (const KeyPointer& p, unsigned int depth) const
+    {
+      if (depth >= p._keyLength)
+      {
+        return 0;
+      }
+      if (depth < sizeof(p._prefix))
+      {
+        return ((unsigned int) (p._prefix >> (56 - 8 * depth)) & 0xff) + 1;
+      }
+      return ((const unsigned char*) p.keyData(_blockBase))[depth] + 1;
+    }
+
+    const char* _blockBase;
   };
   typedef std::vector<KeyPointer> KeyVector;
 
+  // Variable length records are stored as a KeyItem growing up from the
+  // start of the block and a PayloadItem growing down from the end. Once
+  // setFixedLength() has been called, every record is just its key and
+  // payload, stored back to back from the start of the block.
   class RunBlock {
   public:
     RunBlock(unsigned int size)
@@ -135,6 +214,9 @@ namespace external_sort {
       , _size(size)
       , _keyOffset(0)
       , _dataOffset(size)
+      , _fixedLength(false)
+      , _fixedKeyLength(0)
+      , _fixedPayloadLength(0)
     {}
 
     ~RunBlock()
@@ -154,6 +236,37 @@ namespace external_sort {
       return _data;
     }
 
+    unsigned int size() const {
+      return _size;
+    }
+
+    unsigned int fixedKeyLength() const {
+      return _fixedKeyLength;
+    }
+
+    unsigned int fixedPayloadLength() const {
+      return _fixedPayloadLength;
+    }
+
+    void setFixedLength(unsigned int keyLength, unsigned int payloadLength)
+    {
+      _fixedLength = true;
+      _fixedKeyLength = keyLength;
+      _fixedPayloadLength = payloadLength;
+    }
+
+    inline
+    DiskRun::Item payload(const KeyPointer& p) const
+    {
+      if (_fixedLength)
+      {
+        return DiskRun::Item(p.keyData(_data) + _fixedKeyLength, _fixedPayloadLength);
+      }
+      const KeyItem* key = (const KeyItem*) (p.keyData(_data) - sizeof(KeyItem));
+      const PayloadItem* item = (const PayloadItem*) (_data + key->_dataOffset);
+      return DiskRun::Item(item->payloadData(), item->_payloadLength);
+    }
+
   private:
 
     inline
@@ -170,22 +283,50 @@ namespace external_sort {
     KeyPointer storeKey(const void* key, unsigned int keyLength,
                         unsigned int dataOffset)
     {
-      KeyItem* keyItem = (KeyItem*) (_data + _keyOffset);
+      unsigned int keyOffset = _keyOffset;
+      KeyItem* keyItem = (KeyItem*) (_data + keyOffset);
       keyItem->store(key, keyLength, dataOffset);
       _keyOffset += KeyItem::itemSize(keyLength);
-      return KeyPointer(keyItem);
+      return KeyPointer(key, keyLength, keyOffset + sizeof(KeyItem));
+    }
+
+    inline
+    bool storeFixed(const void* key, const void* payload, KeyPointer& result)
+    {
+      unsigned int recordSize = _fixedKeyLength + _fixedPayloadLength;
+      if (recordSize > _size - _keyOffset)
+      {
+        if (recordSize > _size)
+        {
+          throw new RecordSizeException(_fixedKeyLength, _fixedPayloadLength, _size);
+        }
+        return false;
+      }
+      char* record = _data + _keyOffset;
+      memcpy(record, key, (size_t) _fixedKeyLength);
+      memcpy(record + _fixedKeyLength, payload, (size_t) _fixedPayloadLength);
+      result = KeyPointer(key, _fixedKeyLength, _keyOffset);
+      _keyOffset += recordSize;
+      return true;
     }
 
   public:
 
-    KeyPointer store(const void* key, unsigned int keyLength,
-                     const void* payload, unsigned int payloadLength)
+    // Returns false if the record doesn't fit.
+    bool store(const void* key, unsigned int keyLength,
+               const void* payload, unsigned int payloadLength,
+               KeyPointer& result)
     {
+      if (_fixedLength)
+      {
+        return storeFixed(key, payload, result);
+      }
       unsigned int available = _dataOffset - _keyOffset;
       if (spaceNeededFor(keyLength, payloadLength) <= available)
       {
         unsigned int dataOffset = storeData(payload, payloadLength);
-        return storeKey(key, keyLength, dataOffset);
+        result = storeKey(key, keyLength, dataOffset);
+        return true;
       }
       else
       {
@@ -196,8 +337,26 @@ namespace external_sort {
         {
           throw new RecordSizeException(keyLength, payloadLength, _size);
         }
-        return KeyPointer(nullptr);
+        return false;
+      }
+    }
+
+    // Fixed length records only: stores as many of count packed records
+    // as fit, in one copy, returning how many, and in offset where the
+    // first of them went.
+    unsigned int storePacked(const char* records, unsigned int count,
+                             unsigned int& offset)
+    {
+      unsigned int recordSize = _fixedKeyLength + _fixedPayloadLength;
+      if (recordSize > _size)
+      {
+        throw new RecordSizeException(_fixedKeyLength, _fixedPayloadLength, _size);
       }
+      unsigned int fit = std::min(count, (_size - _keyOffset)/recordSize);
+      offset = _keyOffset;
+      memcpy(_data + _keyOffset, records, (size_t) fit * recordSize);
+      _keyOffset += fit * recordSize;
+      return fit;
     }
 
     void clear()
@@ -214,13 +373,21 @@ namespace external_sort {
     unsigned int _size;
     unsigned int _keyOffset;
     unsigned int _dataOffset;
+    bool _fixedLength;
+    unsigned int _fixedKeyLength;
+    unsigned int _fixedPayloadLength;
   };
 
   class RunState {
   public:
-    RunState(unsigned int runBlockSize, bool stable)
+    RunState(unsigned int runBlockSize, bool stable,
+             SortAlgorithm algorithm = COMPARISON_SORT)
       : _runBlock(runBlockSize)
       , _stable(stable)
+      , _algorithm(algorithm)
+      , _microrunLength(std::max(microrunBytes()/sizeof(KeyPointer), (size_t) 2))
+      , _sortThreads(1)
+      , _receiveKeys(false)
     {
       // This initial capacity is based on the overhead for a key/payload pair 
       // key/payload pair size of 20 bytes (entirely arbitrary...).
@@ -237,8 +404,9 @@ namespace external_sort {
     bool store(const void* key, unsigned int keyLength,
                const void* payload, unsigned int payloadLength)
     {
-      KeyPointer p = _runBlock.store(key, keyLength, payload, payloadLength);
-      if (p)
+      KeyPointer p;
+      bool stored = _runBlock.store(key, keyLength, payload, payloadLength, p);
+      if (stored)
       {
         _keyVector.push_back(p);
         ++ _records;
@@ -250,7 +418,54 @@ namespace external_sort {
           _maxRecordSize = recordSize;
         }
       }
-      return (bool) p;
+      return stored;
+    }
+
+    // Stores as many of the count records as fit, returning how many.
+    // payloads may be null if every payload is empty. Each record is
+    // counted as it is stored, as in store(), so that if one is too
+    // large to ever fit, those before it are kept.
+    unsigned int storeBatch(const Span* keys, const Span* payloads, unsigned int count)
+    {
+      reserveFor(count);
+      unsigned int i = 0;
+      for (; i < count; ++i)
+      {
+        Span payload = (payloads ? payloads[i] : Span());
+        KeyPointer p;
+        if (!_runBlock.store(keys[i]._data, keys[i]._length,
+                             payload._data, payload._length, p))
+        {
+          break;
+        }
+        _keyVector.push_back(p);
+        ++ _records;
+        _keySize += keys[i]._length;
+        _payloadSize += payload._length;
+        _maxRecordSize = std::max(_maxRecordSize, keys[i]._length + payload._length);
+      }
+      return i;
+    }
+
+    // Fixed length records only: stores as many of the count packed
+    // records as fit, returning how many.
+    unsigned int storePacked(const void* records, unsigned int count)
+    {
+      unsigned int offset;
+      unsigned int stored = _runBlock.storePacked((const char*) records, count, offset);
+      reserveFor(stored);
+      unsigned int keyLength = _runBlock.fixedKeyLength();
+      unsigned int recordSize = keyLength + _runBlock.fixedPayloadLength();
+      const char* blockBase = _runBlock.data();
+      for (unsigned int i = 0; i < stored; ++i, offset += recordSize)
+      {
+        _keyVector.push_back(KeyPointer(blockBase + offset, keyLength, offset));
+      }
+      _records += stored;
+      _keySize += stored * keyLength;
+      _payloadSize += stored * (recordSize - keyLength);
+      _maxRecordSize = std::max(_maxRecordSize, stored ? recordSize : 0);
+      return stored;
     }
 
     // I want the sort mechanism to be improvable (using, for instance,
@@ -260,25 +475,128 @@ namespace external_sort {
 
     void sort(Receiver* receiver)
     {
-      if (_stable)
+      sortKeys();
+
+      BatchReceiver* batchReceiver = dynamic_cast<BatchReceiver*>(receiver);
+      if (batchReceiver)
       {
-        std::stable_sort(_keyVector.begin(), _keyVector.end());
+        sortedToBatches(batchReceiver);
+        return;
       }
-      else
+      if (_combining.active())
+      {
+        forEachSorted([this, receiver](const DiskRun::Item& key, const DiskRun::Item& payload)
+                      {
+                        const DiskRun::Item& item = (_receiveKeys ? key : payload);
+                        receiver->receive(item._data, item._length);
+                      },
+                      false);
+        return;
+      }
+      const char* blockBase = _runBlock.data();
+      for (auto keyPointer: _keyVector)
       {
-        std::sort(_keyVector.begin(), _keyVector.end());
+        if (_receiveKeys)
+        {
+          receiver->receive(keyPointer.keyData(blockBase), keyPointer._keyLength);
+          continue;
+        }
+        DiskRun::Item payload = _runBlock.payload(keyPointer);
+        receiver->receive(payload._data, payload._length);
       }
+    }
 
+    void sort(DiskRun* run)
+    {
+      sortKeys();
+
+      if (_combining.active())
+      {
+        forEachSorted([run](const DiskRun::Item& key, const DiskRun::Item& payload)
+                      {
+                        run->write(key._data, key._length, payload._data, payload._length);
+                      },
+                      false);
+        return;
+      }
       const char* blockBase = _runBlock.data();
       for (auto keyPointer: _keyVector)
       {
-        const PayloadItem* item = keyPointer.payload(blockBase);
-        receiver->receive(item->payloadData(), item->_payloadLength);
+        DiskRun::Item payload = _runBlock.payload(keyPointer);
+        run->write(keyPointer.keyData(blockBase), keyPointer._keyLength,
+                   payload._data, payload._length);
       }
     }
 
+    // Or sort, and then read the records back in order, in place (they
+    // stay put until clear()).
+    void sort()
+    {
+      sortKeys();
+    }
+
+    DiskRun::Item sortedKey(unsigned int i) const
+    {
+      const KeyPointer& keyPointer = _keyVector[i];
+      return DiskRun::Item(keyPointer.keyData(_runBlock.data()), keyPointer._keyLength);
+    }
+
+    DiskRun::Item sortedPayload(unsigned int i) const
+    {
+      return _runBlock.payload(_keyVector[i]);
+    }
+
+    unsigned int records() const
+    {
+      return _records;
+    }
+
+    unsigned int keySize() const
+    {
+      return _keySize;
+    }
+
+    unsigned int payloadSize() const
+    {
+      return _payloadSize;
+    }
+
+    // The number of entries in each MICRORUN_SORT microrun; defaults to
+    // half the L2 cache's worth.
+    void setMicrorunLength(size_t entries)
+    {
+      _microrunLength = std::max(entries, (size_t) 2);
+    }
+
+    // The number of threads sorting each run; defaults to 1. Each thread
+    // gets at least MIN_PARALLEL_PIECE records.
+    static const size_t MIN_PARALLEL_PIECE = 4096;
+
+    void setSortThreads(unsigned int threads)
+    {
+      _sortThreads = std::max(threads, 1u);
+    }
+
+    // Store every record densely as a key of keyLength bytes and a
+    // payload of payloadLength; store() must be given nothing else. With
+    // no payload, sorting to a receiver hands it the keys instead.
+    void setFixedLength(unsigned int keyLength, unsigned int payloadLength)
+    {
+      _runBlock.setFixedLength(keyLength, payloadLength);
+      _receiveKeys = (payloadLength == 0);
+      _keyVector.reserve(_runBlock.size()/(keyLength + payloadLength));
+    }
+
+    // Combine the records with equal keys as the run is sorted out
+    // (though not when it is read back through sortedKey/sortedPayload).
+    void setCombining(const Combining& combining)
+    {
+      _combining = combining;
+    }
+
     void clear()
     {
+      _combinedPayloads.clear();
       _keyVector.resize(0);
       _runBlock.clear();
       _records = 0;
@@ -292,9 +610,266 @@ namespace external_sort {
     RunState(const RunState&);
     RunState& operator=(const RunState&);
 
+    // Calls emit(key, payload) for each sorted record, or, when
+    // combining, once for each key, with the group's combined payload.
+    // A combined payload is only valid until the next call, unless
+    // keepCombined, in which case it lasts until clear().
+    template <typename Emit>
+    void forEachSorted(Emit emit, bool keepCombined)
+    {
+      const char* blockBase = _runBlock.data();
+      auto next = _keyVector.begin();
+      const auto end = _keyVector.end();
+      while (next != end)
+      {
+        DiskRun::Item key(next->keyData(blockBase), next->_keyLength);
+        DiskRun::Item payload = _runBlock.payload(*next);
+        ++ next;
+        if (_combining.active() && next != end &&
+            Combining::sameKey(key._data, key._length,
+                               next->keyData(blockBase), next->_keyLength))
+        {
+          if (keepCombined)
+          {
+            _combinedPayloads.push_back(std::string());
+          }
+          std::string& accumulator = (keepCombined ? _combinedPayloads.back() : _accumulator);
+          accumulator.assign((const char*) payload._data, payload._length);
+          do
+          {
+            DiskRun::Item other = _runBlock.payload(*next);
+            _combining.combine(accumulator, key._length, other._data, other._length);
+            ++ next;
+          }
+          while (next != end &&
+                 Combining::sameKey(key._data, key._length,
+                                    next->keyData(blockBase), next->_keyLength));
+          payload = DiskRun::Item(accumulator.data(), accumulator.size());
+        }
+        emit(key, payload);
+      }
+    }
+
+    // The run block (and any combined payloads) stay put until the next
+    // run, so the batches can just point into them.
+    void sortedToBatches(BatchReceiver* receiver)
+    {
+      std::vector<Span> batch;
+      batch.reserve(std::min((size_t) BatchReceiver::MAX_BATCH_RECORDS, _keyVector.size()));
+      forEachSorted([this, receiver, &batch](const DiskRun::Item& key, const DiskRun::Item& payload)
+                    {
+                      const DiskRun::Item& item = (_receiveKeys ? key : payload);
+                      batch.push_back(Span(item._data, item._length));
+                      if (batch.size() == BatchReceiver::MAX_BATCH_RECORDS)
+                      {
+                        receiver->receiveBatch(batch.data(), batch.size());
+                        batch.clear();
+                      }
+                    },
+                    true);
+      if (!batch.empty())
+      {
+        receiver->receiveBatch(batch.data(), batch.size());
+      }
+    }
+
+    void sortKeys()
+    {
+      if (_keyVector.empty())
+      {
+        return;
+      }
+      KeyPointer* begin = &_keyVector[0];
+      KeyPointer* end = begin + _keyVector.size();
+      unsigned int threads = (unsigned int)
+        std::min((size_t) _sortThreads, _keyVector.size()/MIN_PARALLEL_PIECE);
+      if (threads > 1)
+      {
+        sortParallel(threads);
+      }
+      else if (_algorithm == MICRORUN_SORT &&
+               _keyVector.size() > _microrunLength)
+      {
+        sortMicroruns();
+      }
+      else
+      {
+        sortPiece(begin, end);
+      }
+    }
+
+    // Sort part of _keyVector by itself
+    void sortPiece(KeyPointer* begin, KeyPointer* end)
+    {
+      const char* blockBase = _runBlock.data();
+      KeyPointerLess less(blockBase);
+      if (_algorithm == RADIX_SORT)
+      {
+        KeyPointerDigit digit(blockBase);
+        RadixSorter<KeyPointer, KeyPointerDigit, KeyPointerLess>
+          sorter(digit, less, _stable);
+        sorter.sort(begin, end);
+      }
+      else if (_stable)
+      {
+        std::stable_sort(begin, end, less);
+      }
+      else
+      {
+        std::sort(begin, end, less);
+      }
+    }
+
+    // Make room for count more entries at once, growing geometrically
+    // so that many small batches don't each reallocate.
+    void reserveFor(unsigned int count)
+    {
+      size_t needed = _keyVector.size() + count;
+      if (needed > _keyVector.capacity())
+      {
+        _keyVector.reserve(std::max(needed, 2 * _keyVector.capacity()));
+      }
+    }
+
+    typedef MicrorunMerger<KeyPointer, KeyPointerLess> Merger;
+
+    // Sort each cache-sized piece of _keyVector while it is resident,
+    // then merge the pieces into _mergeVector and swap the two.
+    void sortMicroruns()
+    {
+      std::vector<Merger::Range> ranges;
+      KeyPointer* base = &_keyVector[0];
+      for (size_t start = 0; start < _keyVector.size(); start += _microrunLength)
+      {
+        size_t end = std::min(start + _microrunLength, _keyVector.size());
+        sortPiece(base + start, base + end);
+        ranges.push_back(Merger::Range(base + start, base + end));
+      }
+      _mergeVector.resize(_keyVector.size());
+      Merger merger(KeyPointerLess(_runBlock.data()));
+      merger.merge(ranges, &_mergeVector[0]);
+      _keyVector.swap(_mergeVector);
+    }
+
+    // Each thread sorts one piece of _keyVector. Then splitters sampled
+    // from the sorted pieces cut every piece into one part per thread,
+    // such that all the keys in part j of any piece are greater than all
+    // of the keys in part j-1 of every piece (equal keys always go to
+    // the same part, which keeps the sort stable). Each thread merges
+    // part j of all the pieces into its place in _mergeVector.
+    void sortParallel(unsigned int threads)
+    {
+      static const unsigned int SAMPLES_PER_PIECE_AND_THREAD = 16;
+      size_t records = _keyVector.size();
+      KeyPointer* base = &_keyVector[0];
+      std::vector<KeyPointer*> pieces(threads + 1);
+      for (unsigned int i = 0; i <= threads; ++i)
+      {
+        pieces[i] = base + (records * i)/threads;
+      }
+      runInParallel(threads, [&](unsigned int i)
+                    {
+                      sortPiece(pieces[i], pieces[i + 1]);
+                    });
+
+      KeyPointerLess less(_runBlock.data());
+      KeyVector samples;
+      unsigned int samplesPerPiece = SAMPLES_PER_PIECE_AND_THREAD * threads;
+      for (unsigned int i = 0; i < threads; ++i)
+      {
+        size_t length = pieces[i + 1] - pieces[i];
+        for (unsigned int j = 0; j < samplesPerPiece; ++j)
+        {
+          samples.push_back(pieces[i][(length * j)/samplesPerPiece]);
+        }
+      }
+      std::sort(samples.begin(), samples.end(), less);
+
+      // cuts[i][j] is where part j of piece i begins
+      std::vector<std::vector<const KeyPointer*>> cuts(threads);
+      std::vector<size_t> offsets(threads + 1, 0);
+      for (unsigned int i = 0; i < threads; ++i)
+      {
+        cuts[i].push_back(pieces[i]);
+        for (unsigned int j = 1; j < threads; ++j)
+        {
+          const KeyPointer& splitter = samples[(samples.size() * j)/threads];
+          cuts[i].push_back(std::upper_bound((const KeyPointer*) cuts[i].back(),
+                                             (const KeyPointer*) pieces[i + 1],
+                                             splitter, less));
+          offsets[j] += cuts[i][j] - pieces[i];
+        }
+        cuts[i].push_back(pieces[i + 1]);
+      }
+      offsets[threads] = records;
+
+      _mergeVector.resize(records);
+      runInParallel(threads, [&](unsigned int j)
+                    {
+                      std::vector<Merger::Range> ranges;
+                      for (unsigned int i = 0; i < threads; ++i)
+                      {
+                        ranges.push_back(Merger::Range(cuts[i][j], cuts[i][j + 1]));
+                      }
+                      Merger merger(less);
+                      merger.merge(ranges, &_mergeVector[offsets[j]]);
+                    });
+      _keyVector.swap(_mergeVector);
+    }
+
+    // Calls work(0) .. work(count-1), each but the first on a thread of
+    // its own, and rethrows the first exception thrown, if any.
+    template <typename Work>
+    static void runInParallel(unsigned int count, const Work& work)
+    {
+      std::vector<std::exception_ptr> errors(count);
+      std::vector<std::thread> workers;
+      for (unsigned int i = 1; i < count; ++i)
+      {
+        workers.emplace_back([&work, &errors, i]
+                             {
+                               try
+                               {
+                                 work(i);
+                               }
+                               catch (...)
+                               {
+                                 errors[i] = std::current_exception();
+                               }
+                             });
+      }
+      try
+      {
+        work(0);
+      }
+      catch (...)
+      {
+        errors[0] = std::current_exception();
+      }
+      for (auto& worker: workers)
+      {
+        worker.join();
+      }
+      for (auto& error: errors)
+      {
+        if (error)
+        {
+          std::rethrow_exception(error);
+        }
+      }
+    }
+
     KeyVector _keyVector;
+    KeyVector _mergeVector; // MICRORUN_SORT's merge output
     RunBlock _runBlock;
     bool _stable;
+    SortAlgorithm _algorithm;
+    size_t _microrunLength;
+    unsigned int _sortThreads;
+    bool _receiveKeys;
+    Combining _combining;
+    std::string _accumulator;
+    std::deque<std::string> _combinedPayloads; // for sortedToBatches
 
     // per-run statistics
     unsigned int _records;
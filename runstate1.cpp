@@ -31,8 +31,9 @@ namespace {
     PayloadVector result;
     ::external_sort::RunState sorter;
 
-    RunStateSortTest()
-      : sorter(RUN_BLOCK_SIZE, true)
+    RunStateSortTest(::external_sort::SortAlgorithm algorithm
+                       = ::external_sort::COMPARISON_SORT)
+      : sorter(RUN_BLOCK_SIZE, true, algorithm)
     {
      
     }
@@ -96,6 +97,10 @@ namespace {
   template <typename KT>
   class WhateverStringRunStateSortTest : public RunStateSortTest<KT, std::string> {
   protected:
+    WhateverStringRunStateSortTest(::external_sort::SortAlgorithm algorithm
+                                   = ::external_sort::COMPARISON_SORT)
+      : RunStateSortTest<KT, std::string>(algorithm) {}
+
     virtual std::string preparePayload(const std::string& payload)
     {
       return payload;
@@ -107,6 +112,33 @@ namespace {
     }
   };
 
+  TEST(KeyPointer, ShortKeysComparedByPrefix)
+  {
+    // Keys of up to eight bytes are ordered by their inline prefixes and
+    // lengths alone; the run block (null here) is never looked at.
+    std::vector<std::string> keys;
+    keys.push_back(std::string());
+    keys.push_back(std::string("a"));
+    keys.push_back(std::string("a\0", 2));
+    keys.push_back(std::string("a\0\0", 3));
+    keys.push_back(std::string("ab"));
+    keys.push_back(std::string("abcdefg"));
+    keys.push_back(std::string("abcdefgh"));
+    keys.push_back(std::string("abcdefgi"));
+    keys.push_back(std::string("b"));
+    keys.push_back(std::string("\xff"));
+    for (auto& left: keys)
+    {
+      ::external_sort::KeyPointer leftPointer(left.data(), left.size(), 0);
+      for (auto& right: keys)
+      {
+        ::external_sort::KeyPointer rightPointer(right.data(), right.size(), 0);
+        EXPECT_EQ(left < right, leftPointer.less(rightPointer, nullptr))
+          << "comparing lengths " << left.size() << " and " << right.size();
+      }
+    }
+  }
+
   class Uint32StringRunStateSortTest: public WhateverStringRunStateSortTest<uint32_t> {
     virtual std::string prepareKey(const uint32_t& key)
     {
@@ -188,4 +220,178 @@ namespace {
     push_back("c", "letter c");
     sortAndCheck();
   }
+
+  TEST_F(StringStringRunStateSortTest, LongKeysTieOnPrefix)
+  {
+    // All these keys have the same inline prefix, so they are told apart
+    // by the rest of the key (or its length), read from the run block.
+    push_back("commonprefix-b", "b");
+    push_back("commonprefix-a", "a");
+    push_back("commonpr", "prefix only");
+    push_back("commonprefix-a-longer", "a longer");
+    push_back("commonprefix-", "dash");
+    for (auto& kp: source)
+    {
+      ASSERT_EQ(::external_sort::KeyPointer::prefixOf("commonpr", 8),
+                ::external_sort::KeyPointer::prefixOf(kp.first.data(), kp.first.size()));
+    }
+    sortAndCheck();
+  }
+
+  class Int64StringRunStateSortTest : public WhateverStringRunStateSortTest<int64_t> {
+  protected:
+    Int64StringRunStateSortTest(::external_sort::SortAlgorithm algorithm)
+      : WhateverStringRunStateSortTest<int64_t>(algorithm) {}
+
+    virtual std::string prepareKey(const int64_t& key)
+    {
+      char buffer[8];
+      ::external_sort::int64ToKey(key, buffer);
+      return std::string(buffer, 8);
+    }
+
+    // Pseudo-random keys, with every third one small, so that there are
+    // duplicates to check stability and runs of shared leading bytes.
+    void generate(unsigned int count)
+    {
+      uint64_t state = 12345;
+      for (unsigned int i = 0; i < count; ++i)
+      {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        int64_t key = (int64_t) (state >> 16);
+        if (i % 3 == 0)
+        {
+          key %= 1000;
+        }
+        push_back(key, std::to_string(i));
+      }
+    }
+  };
+
+  class Int64RadixRunStateSortTest : public Int64StringRunStateSortTest {
+  protected:
+    Int64RadixRunStateSortTest()
+      : Int64StringRunStateSortTest(::external_sort::RADIX_SORT) {}
+  };
+
+  TEST_F(Int64RadixRunStateSortTest, Radix)
+  {
+    generate(20000);
+    sortAndCheck();
+  }
+
+  class Int64MicrorunRunStateSortTest : public Int64StringRunStateSortTest {
+  protected:
+    Int64MicrorunRunStateSortTest()
+      : Int64StringRunStateSortTest(::external_sort::MICRORUN_SORT) {}
+  };
+
+  TEST_F(Int64MicrorunRunStateSortTest, Microrun)
+  {
+    // 20 microruns, the last one short
+    sorter.setMicrorunLength(1000);
+    generate(19500);
+    sortAndCheck();
+  }
+
+  class Int64ParallelRunStateSortTest : public Int64StringRunStateSortTest {
+  protected:
+    Int64ParallelRunStateSortTest()
+      : Int64StringRunStateSortTest(::external_sort::COMPARISON_SORT) {}
+  };
+
+  TEST_F(Int64ParallelRunStateSortTest, Parallel)
+  {
+    // Four pieces of just over MIN_PARALLEL_PIECE
+    sorter.setSortThreads(4);
+    generate(20000);
+    sortAndCheck();
+  }
+
+  class StringRadixRunStateSortTest : public WhateverStringRunStateSortTest<std::string> {
+  protected:
+    StringRadixRunStateSortTest()
+      : WhateverStringRunStateSortTest<std::string>(::external_sort::RADIX_SORT) {}
+
+    virtual std::string prepareKey(const std::string& key)
+    {
+      return key;
+    }
+  };
+
+  TEST_F(StringRadixRunStateSortTest, Radix)
+  {
+    // Keys that end inside and beyond the inline prefix, embedded zero
+    // bytes, and long shared prefixes.
+    static const std::string prefix("a common prefix, longer than 8 bytes");
+    uint64_t state = 54321;
+    for (unsigned int i = 0; i < 5000; ++i)
+    {
+      state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+      unsigned int length = (unsigned int) (state >> 59);
+      std::string key(i % 2 ? prefix : std::string());
+      for (unsigned int j = 0; j < length; ++j)
+      {
+        key += (char) ("ab\0z"[(state >> (j * 2)) & 3]);
+      }
+      push_back(key, std::to_string(i));
+    }
+    sortAndCheck();
+  }
+
+  TEST_F(StringRadixRunStateSortTest, NestedPrefixes)
+  {
+    // Each key a prefix of the next, which would split off one key per
+    // byte of depth, were the recursion not capped.
+    std::vector<unsigned int> lengths;
+    for (unsigned int i = 1; i <= 1000; ++i)
+    {
+      lengths.push_back(i);
+    }
+    std::reverse(lengths.begin(), lengths.end());
+    for (auto length: lengths)
+    {
+      push_back(std::string(length, 'n'), std::to_string(length));
+    }
+    sortAndCheck();
+  }
+
+  class Int64FixedRunStateSortTest : public Int64StringRunStateSortTest {
+  protected:
+    Int64FixedRunStateSortTest()
+      : Int64StringRunStateSortTest(::external_sort::COMPARISON_SORT) {}
+
+    // Fixed length payloads: the position, zero padded to 8 digits
+    virtual std::string preparePayload(const std::string& payload)
+    {
+      return std::string(8 - payload.size(), '0') + payload;
+    }
+
+    virtual std::string reconstructPayload(const void* payload, unsigned int payloadLength)
+    {
+      return std::to_string(std::stoul(std::string((const char*) payload, payloadLength)));
+    }
+  };
+
+  TEST_F(Int64FixedRunStateSortTest, FixedLength)
+  {
+    sorter.setFixedLength(8, 8);
+    generate(20000);
+    sortAndCheck();
+  }
+
+  TEST(RunState, FixedLengthCapacity)
+  {
+    // A full block holds exactly block size / record size records, with
+    // no per-record overhead.
+    ::external_sort::RunState sorter(16 * 1024, false);
+    sorter.setFixedLength(8, 8);
+    char record[16] = {0};
+    unsigned int stored = 0;
+    while (sorter.store(record, 8, record + 8, 8))
+    {
+      ++ stored;
+    }
+    ASSERT_EQ(1024u, stored);
+  }
 }
@@ -4,15 +4,62 @@
 // for the detailed license.
 
 #include "sorterimpl.h"
+#include "compress.h"
+
+#include <algorithm>
 
 namespace external_sort {
 
   static const unsigned int DEFAULT_RUN_BLOCK_SIZE = 64 * 1024 * 1024; 
+  static const unsigned int DEFAULT_MAX_MERGE_WIDTH = 64;
+  static const unsigned long long DEFAULT_READ_AHEAD_MEMORY = 64 * 1024 * 1024;
+  static const unsigned int DEFAULT_WRITE_BEHIND_DEPTH = 8;
 
-  Sorter::Sorter()
-    : _impl(nullptr)
+  SorterConfig::SorterConfig()
+    : _receiver(nullptr)
+    , _combiner(nullptr)
     , _runSize(DEFAULT_RUN_BLOCK_SIZE)
+    , _maxMergeWidth(DEFAULT_MAX_MERGE_WIDTH)
+    , _ioBufferSize(DiskRun::DEFAULT_BUFFER_SIZE)
+    , _readAheadMemory(DEFAULT_READ_AHEAD_MEMORY)
+    , _writeBehindDepth(DEFAULT_WRITE_BEHIND_DEPTH)
+    , _maxMappedRunSize(0)
+    , _threads(1)
+    , _sortThreads(1)
+    , _mergeAlgorithm(LOSER_TREE_MERGE)
+    , _sortAlgorithm(COMPARISON_SORT)
+    , _runGeneration(FILL_AND_SORT)
+    , _compression(NO_COMPRESSION)
+    , _compressionLevel(DEFAULT_COMPRESSION_LEVEL)
     , _stable(false)
+    , _directIO(false)
+    , _frontCodeKeys(false)
+    , _fixedLength(false)
+    , _fixedKeyLength(0)
+    , _fixedPayloadLength(0)
+    , _cursor(false)
+    , _asyncOutputBlocks(0)
+    , _limit(0)
+  {}
+
+  SorterStatistics::SorterStatistics()
+    : _writeBehindBlocks(0)
+    , _writeBehindBytes(0)
+    , _writeBehindWaits(0)
+    , _writeBehindWaitNanoseconds(0)
+    , _runs(0)
+    , _mappedRuns(0)
+    , _offsetValueMerges(0)
+    , _outputBlocks(0)
+    , _outputBytes(0)
+    , _outputWaits(0)
+    , _outputWaitNanoseconds(0)
+    , _outputLatencyNanoseconds(0)
+  {}
+
+  Sorter::Sorter()
+    : _impl(nullptr)
+    , _finished(false)
   {}
 
   Sorter::~Sorter()
@@ -23,13 +70,103 @@ namespace external_sort {
   Sorter& Sorter::withRunSize(unsigned int runSize)
   {
     // TBD: some sanity checking
-    _runSize = runSize;
+    _config._runSize = runSize;
+    return *this;
+  }
+
+  Sorter& Sorter::withMaxMergeWidth(unsigned int width)
+  {
+    // A merge of fewer than two runs never makes progress.
+    _config._maxMergeWidth = std::max(width, 2u);
+    return *this;
+  }
+
+  Sorter& Sorter::withIOBufferSize(unsigned int size)
+  {
+    _config._ioBufferSize = size;
+    return *this;
+  }
+
+  Sorter& Sorter::withReadAheadMemory(unsigned long long bytes)
+  {
+    // 0 turns off read-ahead
+    _config._readAheadMemory = bytes;
+    return *this;
+  }
+
+  Sorter& Sorter::withWriteBehindDepth(unsigned int blocks)
+  {
+    // 0 turns off write-behind
+    _config._writeBehindDepth = blocks;
+    return *this;
+  }
+
+  Sorter& Sorter::withAsyncOutput(unsigned int blocks)
+  {
+    _config._asyncOutputBlocks = blocks;
+    return *this;
+  }
+
+  Sorter& Sorter::withMaxMappedRunSize(unsigned long long bytes)
+  {
+    // Runs this size or smaller are memory-mapped when merged; worth
+    // doing when they are on tmpfs or fast flash.
+    _config._maxMappedRunSize = bytes;
+    return *this;
+  }
+
+  Sorter& Sorter::withThreads(unsigned int threads)
+  {
+    // Spilling always happens off the caller's thread, so at least one.
+    _config._threads = std::max(threads, 1u);
+    return *this;
+  }
+
+  Sorter& Sorter::withSortThreads(unsigned int threads)
+  {
+    _config._sortThreads = std::max(threads, 1u);
+    return *this;
+  }
+
+  Sorter& Sorter::withMergeAlgorithm(MergeAlgorithm algorithm)
+  {
+    _config._mergeAlgorithm = algorithm;
+    return *this;
+  }
+
+  Sorter& Sorter::withSortAlgorithm(SortAlgorithm algorithm)
+  {
+    _config._sortAlgorithm = algorithm;
+    return *this;
+  }
+
+  Sorter& Sorter::withRunGeneration(RunGeneration generation)
+  {
+    _config._runGeneration = generation;
     return *this;
   }
 
   Sorter& Sorter::withReceiver(Receiver* receiver)
   {
-    _receiver = receiver;
+    _config._receiver = receiver;
+    return *this;
+  }
+
+  Sorter& Sorter::withLimit(unsigned long long n)
+  {
+    _config._limit = n;
+    return *this;
+  }
+
+  Sorter& Sorter::withCombiner(Combiner* combiner)
+  {
+    _config._combiner = combiner;
+    return *this;
+  }
+
+  Sorter& Sorter::withCursor()
+  {
+    _config._cursor = true;
     return *this;
   }
 
@@ -39,7 +176,46 @@ namespace external_sort {
 
   Sorter& Sorter::setStable(bool makeStable)
   {
-    _stable = makeStable;
+    _config._stable = makeStable;
+    return *this;
+  }
+
+  Sorter& Sorter::withCompression(Compression compression, unsigned int level)
+  {
+    _config._compression = compression;
+    _config._compressionLevel = std::max(1u, std::min(level, MAX_COMPRESSION_LEVEL));
+    return *this;
+  }
+
+  Sorter& Sorter::directIO() {
+    return setDirectIO(true);
+  }
+
+  Sorter& Sorter::setDirectIO(bool useDirectIO)
+  {
+    _config._directIO = useDirectIO;
+    return *this;
+  }
+
+  Sorter& Sorter::frontCodeKeys() {
+    return setFrontCodeKeys(true);
+  }
+
+  Sorter& Sorter::setFrontCodeKeys(bool frontCode)
+  {
+    _config._frontCodeKeys = frontCode;
+    return *this;
+  }
+
+  Sorter& Sorter::withFixedLengthRecords(unsigned int keyLength, unsigned int payloadLength)
+  {
+    if (keyLength == 0)
+    {
+      throw new FixedKeyLengthException();
+    }
+    _config._fixedLength = true;
+    _config._fixedKeyLength = keyLength;
+    _config._fixedPayloadLength = payloadLength;
     return *this;
   }
 
@@ -49,11 +225,11 @@ namespace external_sort {
     {
       throw new SorterCreatedMoreThanOnceException();
     }
-    if (!_receiver)
+    if (!_config._receiver && !_config._cursor)
     {
       throw new NoReceiverException();
     }
-    _impl = new SorterImpl(_runSize, _stable, _receiver);
+    _impl = new SorterImpl(_config);
   }
 
   inline 
@@ -72,13 +248,73 @@ namespace external_sort {
     _impl->sort(key, keyLength, payload, payloadLength);
   }
 
+  void Sorter::sortBatch(const Span* keys, const Span* payloads, unsigned int count)
+  {
+    checkForCreation();
+    _impl->sortBatch(keys, payloads, count);
+  }
+
+  void Sorter::sortBatch(const void* records, unsigned int count)
+  {
+    checkForCreation();
+    if (!_config._fixedLength)
+    {
+      throw new FixedLengthRequiredException();
+    }
+    _impl->sortBatch(records, count);
+  }
+
   void Sorter::finish()
   {
     checkForCreation();
+    if (!_config._receiver)
+    {
+      throw new NoReceiverException();
+    }
+    checkForFinishing();
     _impl->finish();
   }
 
+  Cursor& Sorter::finishToCursor()
+  {
+    checkForCreation();
+    checkForFinishing();
+    return _impl->finishToCursor();
+  }
+
+  // The sort can only be finished once, one way or the other.
+  void Sorter::checkForFinishing()
+  {
+    if (_finished)
+    {
+      throw new SorterFinishedMoreThanOnceException();
+    }
+    _finished = true;
+  }
+
+  SorterStatistics Sorter::statistics() const
+  {
+    if (!_impl)
+    {
+      throw new SorterNotCreatedException();
+    }
+    return _impl->statistics();
+  }
+
   // This has to be here (well, somewhere other than the header) to get the vtable created.
   Receiver::~Receiver() {}
 
+  Cursor::~Cursor() {}
+
+  Combiner::~Combiner() {}
+
+  const unsigned int BatchReceiver::MAX_BATCH_RECORDS;
+  const unsigned int BatchReceiver::MAX_BATCH_BYTES;
+
+  void BatchReceiver::receive(const void* payload, unsigned int payloadLength)
+  {
+    Span span(payload, payloadLength);
+    receiveBatch(&span, 1);
+  }
+
 }
@@ -7,6 +7,7 @@
 #define EXTERNAL_SORT_SORTER_H
 
 #include <exception>
+#include <string>
 
 namespace external_sort {
 
@@ -30,12 +31,22 @@ namespace external_sort {
     }
   };
 
+  class SorterFinishedMoreThanOnceException : public SorterException {
+  public:
+    // default ctor/dtor/copy/assign OK
+    virtual const char* what() const noexcept 
+    {
+      return "finish() or finishToCursor() was called more than once.";
+    }
+  };
+
   class NoReceiverException : public SorterException {
   public:
     // default ctor/dtor/copy/assign OK
     virtual const char* what() const noexcept 
     {
-      return "A receiver was not provided (by calling withReceiver()).";
+      return "A receiver was not provided (by calling withReceiver()), "
+        "nor a cursor asked for (by calling withCursor()).";
     }
   };
 
@@ -63,7 +74,177 @@ namespace external_sort {
     unsigned int _runBlockSize;
   };
 
+  class FixedRecordSizeException : public SorterException {
+  public:
+    FixedRecordSizeException(unsigned int keyLength, 
+                             unsigned int payloadLength)
+      : _keyLength(keyLength)
+      , _payloadLength(payloadLength) {}
+
+    virtual const char* what() const noexcept 
+    {
+      return "The record size differs from the fixed record size";
+    }
+
+    unsigned int keyLength() const noexcept { return _keyLength; }
+    unsigned int payloadLength() const noexcept { return _payloadLength; }
+  private:
+    // default dtor/copy/assign OK
+    unsigned int _keyLength;
+    unsigned int _payloadLength;
+  };
+
+  class FixedKeyLengthException : public SorterException {
+  public:
+    // default ctor/dtor/copy/assign OK
+    virtual const char* what() const noexcept 
+    {
+      return "Fixed length records need a key of at least one byte.";
+    }
+  };
+
+  class FixedLengthRequiredException : public SorterException {
+  public:
+    // default ctor/dtor/copy/assign OK
+    virtual const char* what() const noexcept 
+    {
+      return "Packed records need fixed length records (withFixedLengthRecords()).";
+    }
+  };
+
+  // Creating, reading or writing a temporary run file failed. error() is
+  // the errno, or 0 if a read or write came up short or a compressed
+  // block read back doesn't decompress.
+  class DiskIOException : public SorterException {
+  public:
+    DiskIOException(const char* operation, int error)
+      : _operation(operation)
+      , _error(error) {}
+
+    virtual const char* what() const noexcept 
+    {
+      return "I/O on a temporary run file failed";
+    }
+
+    const char* operation() const noexcept { return _operation; }
+    int error() const noexcept { return _error; }
+  private:
+    // default dtor/copy/assign OK
+    const char* _operation;
+    int _error;
+  };
+
   class SorterImpl;
+  class Receiver;
+  class Combiner;
+
+  // A key or payload, as handed to Sorter::sortBatch()
+  struct Span {
+    Span()
+      : _data(nullptr)
+      , _length(0) {}
+
+    Span(const void* data, unsigned int length)
+      : _data(data)
+      , _length(length) {}
+
+    // default dtor/copy/assign OK
+    const void* _data;
+    unsigned int _length;
+  };
+
+  // How the merge picks the next record from its sources
+  enum MergeAlgorithm {
+    HEAP_MERGE,       // binary heap, about 2*log2(k) comparisons per record
+    LOSER_TREE_MERGE  // tournament tree, log2(k) comparisons per record;
+                      // with front-coded keys, mostly offset-value code compares
+  };
+
+  // How each run is sorted in memory before it is spilled
+  enum SortAlgorithm {
+    COMPARISON_SORT,  // std::sort, or std::stable_sort
+    RADIX_SORT,       // MSD radix sort on the key bytes
+    MICRORUN_SORT     // cache-sized std::sorts, then a multiway merge
+  };
+
+  // How spilled runs are stored
+  enum Compression {
+    NO_COMPRESSION,
+    LZ_COMPRESSION    // the built-in LZ block codec (see compress.h)
+  };
+
+  // How the initial runs are formed
+  enum RunGeneration {
+    FILL_AND_SORT,         // fill a run block, sort it, spill it
+    REPLACEMENT_SELECTION  // a heap over the run block; runs about twice
+                           // its size, with no sort algorithm or threads
+  };
+
+  // The parameters collected by the Sorter's with...() methods and handed
+  // to the implementation by create().
+  struct SorterConfig {
+    SorterConfig();
+    // default dtor/copy/assign OK
+
+    Receiver* _receiver;
+    Combiner* _combiner;
+    unsigned int _runSize;
+    unsigned int _maxMergeWidth;
+    unsigned int _ioBufferSize;
+    unsigned long long _readAheadMemory;
+    unsigned int _writeBehindDepth;
+    unsigned long long _maxMappedRunSize;
+    unsigned int _threads;
+    unsigned int _sortThreads;
+    MergeAlgorithm _mergeAlgorithm;
+    SortAlgorithm _sortAlgorithm;
+    RunGeneration _runGeneration;
+    Compression _compression;
+    unsigned int _compressionLevel;
+    bool _stable;
+    bool _directIO;
+    bool _frontCodeKeys;
+    bool _fixedLength;
+    unsigned int _fixedKeyLength;
+    unsigned int _fixedPayloadLength;
+    bool _cursor;
+    unsigned int _asyncOutputBlocks;
+    unsigned long long _limit;
+  };
+
+  // Counters describing a sort, available from Sorter::statistics()
+  struct SorterStatistics {
+    SorterStatistics();
+    // default dtor/copy/assign OK
+
+    // Blocks written behind, and how often and for how long the sorting
+    // and merging threads waited for the writes (back-pressure), summed
+    // over the spill threads' queues.
+    unsigned long long _writeBehindBlocks;
+    unsigned long long _writeBehindBytes;
+    unsigned long long _writeBehindWaits;
+    unsigned long long _writeBehindWaitNanoseconds;
+
+    // Initial runs written to disk (0 if the sort fit in memory)
+    unsigned long long _runs;
+
+    // Runs memory-mapped rather than read, over all the merges
+    // (see withMaxMappedRunSize())
+    unsigned long long _mappedRuns;
+
+    // Merges of front-coded runs that compared offset-value codes
+    unsigned long long _offsetValueMerges;
+
+    // With withAsyncOutput(): the output blocks delivered to the
+    // receiver, how often and for how long the merge waited for a free
+    // block (back-pressure from the receiver), and the total time blocks
+    // spent queued before their delivery started.
+    unsigned long long _outputBlocks;
+    unsigned long long _outputBytes;
+    unsigned long long _outputWaits;
+    unsigned long long _outputWaitNanoseconds;
+    unsigned long long _outputLatencyNanoseconds;
+  };
 
   class Receiver {
   public:
@@ -74,6 +255,62 @@ namespace external_sort {
     // default copy/assign OK
   };
 
+  // A Receiver that is handed the sorted payloads a batch (of up to a
+  // few thousand) at a time, rather than one call per record. The
+  // payloads are only valid during the call. Those of a batch from a
+  // merge are packed back to back, in order, in a single buffer.
+  class BatchReceiver : public Receiver {
+  public:
+    static const unsigned int MAX_BATCH_RECORDS = 4096;
+    static const unsigned int MAX_BATCH_BYTES = 1 << 20; // unless one payload is bigger
+    virtual void receiveBatch(const Span* payloads, unsigned int count) = 0;
+    // A batch of one
+    virtual void receive(const void* payload, unsigned int payloadLength);
+  protected:
+    BatchReceiver() {}
+    // default copy/assign OK
+  };
+
+  // For a sort that is really a group-by: folds together the payloads of
+  // records with equal keys, so that each key comes out once. It's
+  // applied wherever such records meet - within each run before it is
+  // spilled, and in every merge - so duplicates collapse before they
+  // reach the disk. The accumulator starts out as one record's payload,
+  // and combine() folds another's into it; which records are combined
+  // in which order isn't defined, so combining should be associative
+  // and commutative. With fixed length records the accumulator has to
+  // keep its length.
+  class Combiner {
+  public:
+    virtual ~Combiner();
+    virtual void combine(std::string& accumulator,
+                         const void* payload, unsigned int payloadLength) = 0;
+  protected:
+    Combiner() {}
+    // default copy/assign OK
+  };
+
+  // The sorted records, pulled one at a time (from
+  // Sorter::finishToCursor()) rather than pushed to a Receiver. The key
+  // and payload point into the sort's own buffers - the run block, or
+  // the merge's read buffers - and are only valid until the next call
+  // to next(). The cursor belongs to, and must not outlive, the Sorter.
+  class Cursor {
+  public:
+    virtual ~Cursor();
+    // Moves to the next record (to the first, the first time); false
+    // once there are no more.
+    virtual bool next() = 0;
+    virtual Span key() const = 0;
+    virtual Span payload() const = 0;
+  protected:
+    Cursor() {}
+  private:
+    // prohibit copy/assign; do not implement
+    Cursor(const Cursor&);
+    Cursor& operator=(const Cursor&);
+  };
+
   class Sorter {
   public:
     Sorter();
@@ -81,26 +318,75 @@ namespace external_sort {
 
     // parameterization
     Sorter& withRunSize(unsigned int runSize); // Defaults to 64MB
+    Sorter& withMaxMergeWidth(unsigned int width); // Defaults to 64 runs
+    Sorter& withIOBufferSize(unsigned int size); // Per run; defaults to 1MB
+    Sorter& withReadAheadMemory(unsigned long long bytes); // Per merge; defaults to 64MB
+    Sorter& withWriteBehindDepth(unsigned int blocks); // Per spill thread; defaults to 8
+    // Hand the output to the receiver on a thread of its own, through a
+    // ring of this many blocks; defaults to 0 (on the merging thread).
+    Sorter& withAsyncOutput(unsigned int blocks);
+    Sorter& withMaxMappedRunSize(unsigned long long bytes); // Defaults to 0 (none)
+    Sorter& withThreads(unsigned int threads); // Defaults to 1
+    Sorter& withSortThreads(unsigned int threads); // Per run sort; defaults to 1
+    Sorter& withMergeAlgorithm(MergeAlgorithm); // Defaults to LOSER_TREE_MERGE
+    Sorter& withSortAlgorithm(SortAlgorithm); // Defaults to COMPARISON_SORT
+    Sorter& withRunGeneration(RunGeneration); // Defaults to FILL_AND_SORT
     Sorter& withReceiver(Receiver*); 
+    Sorter& withCombiner(Combiner*); // Defaults to none (duplicate keys are kept)
+    Sorter& withCursor(); // finishToCursor() will be used, so no receiver is needed
     Sorter& stable(); // defaults to not stable
     Sorter& setStable(bool makeStable);
+    Sorter& withCompression(Compression, unsigned int level = 1); // Defaults to NO_COMPRESSION
+    Sorter& directIO(); // spill with O_DIRECT; defaults to the page cache
+    Sorter& setDirectIO(bool useDirectIO);
+    Sorter& frontCodeKeys(); // spill keys as prefix length + suffix; defaults to whole keys
+    Sorter& setFrontCodeKeys(bool frontCode);
+    // Every record has this key and payload length, so none is stored
+    // per record, in memory or on disk (and keys aren't front coded). With
+    // a payloadLength of 0 the sort is of keys only, and the receiver is
+    // given each key as its payload. The key can't be empty. Defaults to
+    // variable length records.
+    Sorter& withFixedLengthRecords(unsigned int keyLength, unsigned int payloadLength);
+    // Only the first n records in sort order are output. Just those are
+    // kept, in memory; the rest are dropped as they arrive, and nothing
+    // is spilled. Can't be combined with a combiner. Defaults to 0 (no
+    // limit).
+    Sorter& withLimit(unsigned long long n);
     void create();
 
     void sort(const void* key, unsigned int keyLength,
               const void* payload, unsigned int payloadLength);
+
+    // Sorts count records at once, the same as calling sort() for each
+    // keys[i] and payloads[i] in turn (payloads may be null if every
+    // payload is empty), but with the per-call work done once.
+    void sortBatch(const Span* keys, const Span* payloads, unsigned int count);
+
+    // With fixed length records only: count records packed back to back,
+    // each its key then its payload, which are copied into the sort in
+    // bulk.
+    void sortBatch(const void* records, unsigned int count);
+
     void finish();
 
+    // Instead of finish(): finishes the sort, but leaves the output to be
+    // pulled from the cursor returned. A sort is finished only once,
+    // one way or the other.
+    Cursor& finishToCursor();
+
+    SorterStatistics statistics() const;
+
   private:
     // prohibit copy/assign; do not implement
     Sorter(const Sorter&);
     Sorter& operator=(const Sorter&);
 
     SorterImpl* _impl;
-    Receiver* _receiver;
-    unsigned int _runSize;
-    bool _stable;
+    SorterConfig _config;
+    bool _finished;
 
     void checkForCreation();
+    void checkForFinishing();
   };
 }
 
@@ -4,6 +4,10 @@
 // for the detailed license.
 
 #include "sorterimpl.h"
+#include "merger.h"
+
+#include <string>
+#include <algorithm>
 
 namespace external_sort {
 
@@ -21,52 +25,806 @@ namespace external_sort {
     std::string _what;
   };
 
-  SorterImpl::SorterImpl(unsigned int runSize, bool stable, Receiver* receiver)
-    : _receiver(receiver)
-    , _runSize(runSize)
-    , _stable(stable)
+  SorterImpl::SorterImpl(const SorterConfig& config)
+    : _config(config)
     , _firstRun(true)
+    , _runStatesAllocated(0)
+    , _queuedSequence(0)
+    , _addedSequence(0)
+    , _addingRuns(false)
+    , _spillDone(false)
+    , _runs(0)
+    , _mappedRuns(0)
+    , _offsetValueMerges(0)
+    , _selectionRunNumber(0)
   {
-    _currentRunState = getRunState();
+    if (_config._limit)
+    {
+      if (_config._combiner)
+      {
+        throw new NotYetSupportedException("A limit can't be used with a combiner.");
+      }
+      _topK.reset(new TopK(_config._limit));
+    }
+    else if (_config._runGeneration == REPLACEMENT_SELECTION)
+    {
+      _selection.reset(new ReplacementSelection(_config._runSize));
+      _selection->setReceiveKeys(receiveKeys());
+    }
+    else
+    {
+      _currentRunState = getRunState();
+    }
   }
 
   SorterImpl::~SorterImpl()
   {
-    // TBD
+    {
+      // Anything still queued is of no interest to anyone.
+      std::lock_guard<std::mutex> lock(_mutex);
+      _runQueue.clear();
+    }
+    stopSpillThreads();
+  }
+
+  void SorterImpl::sortBatch(const Span* keys, const Span* payloads, unsigned int count)
+  {
+    if (_config._fixedLength)
+    {
+      // Reject the whole batch before any of it is stored.
+      for (unsigned int i = 0; i < count; ++i)
+      {
+        unsigned int payloadLength = (payloads ? payloads[i]._length : 0);
+        if (keys[i]._length != _config._fixedKeyLength ||
+            payloadLength != _config._fixedPayloadLength)
+        {
+          throw new FixedRecordSizeException(keys[i]._length, payloadLength);
+        }
+      }
+    }
+
+    if (_selection || _topK)
+    {
+      // replacement selection and a limit take records one at a time anyway
+      Span none;
+      for (unsigned int i = 0; i < count; ++i)
+      {
+        const Span& payload = (payloads ? payloads[i] : none);
+        sort(keys[i]._data, keys[i]._length, payload._data, payload._length);
+      }
+      return;
+    }
+
+    unsigned int done = 0;
+    while (done < count)
+    {
+      if (!_currentRunState)
+      {
+        _currentRunState = getRunState();
+      }
+      done += _currentRunState->storeBatch(keys + done, 
+                                           payloads ? payloads + done : nullptr,
+                                           count - done);
+      if (done < count)
+      {
+        // the rest start a new run
+        addToRunQueue(_currentRunState);
+        _currentRunState = getRunState();
+      }
+    }
+  }
+
+  void SorterImpl::sortBatch(const void* records, unsigned int count)
+  {
+    unsigned int keyLength = _config._fixedKeyLength;
+    unsigned int recordSize = keyLength + _config._fixedPayloadLength;
+    const char* next = (const char*) records;
+    if (_selection || _topK)
+    {
+      for (unsigned int i = 0; i < count; ++i, next += recordSize)
+      {
+        sort(next, keyLength, next + keyLength, recordSize - keyLength);
+      }
+      return;
+    }
+
+    unsigned int done = 0;
+    while (done < count)
+    {
+      if (!_currentRunState)
+      {
+        _currentRunState = getRunState();
+      }
+      done += _currentRunState->storePacked(next + (size_t) done * recordSize,
+                                            count - done);
+      if (done < count)
+      {
+        addToRunQueue(_currentRunState);
+        _currentRunState = getRunState();
+      }
+    }
   }
 
   void SorterImpl::finish()
   {
-    if (_firstRun)
+    Receiver* receiver = _config._receiver;
+    if (_config._asyncOutputBlocks)
+    {
+      _asyncOutput.reset(new AsyncOutput(receiver, _config._asyncOutputBlocks));
+      receiver = _asyncOutput.get();
+    }
+
+    if (_topK)
+    {
+      _topK->sort(receiver, receiveKeys());
+    }
+    else if (_selection)
+    {
+      if (!_selectionRun)
+      {
+        // Everything fit; no runs are required
+        drainSelection(receiver);
+      }
+      else
+      {
+        while (!_selection->empty())
+        {
+          writeSelected();
+        }
+        finishSelectedRun();
+        awaitMergeCompletion(receiver);
+      }
+    }
+    else if (_firstRun)
     {
       // No merges are required
-      _currentRunState->sort(_receiver);
+      _currentRunState->sort(receiver);
     }
     else
     {
       addToRunQueue(_currentRunState);
       _currentRunState.reset();
-      awaitMergeCompletion();
+      awaitMergeCompletion(receiver);
+    }
+
+    if (_asyncOutput)
+    {
+      _asyncOutput->finish();
     }
   }
     
+  // Reads an in-memory run in place, out of its run block.
+  class RunStateCursor : public Cursor {
+  public:
+    RunStateCursor(RunStateSPtr runState)
+      : _runState(runState)
+      , _next(0)
+    {
+      _runState->sort();
+    }
+    // default dtor OK
+
+    bool next()
+    {
+      if (_next >= _runState->records())
+      {
+        return false;
+      }
+      ++ _next;
+      return true;
+    }
+
+    Span key() const
+    {
+      DiskRun::Item key = _runState->sortedKey(_next - 1);
+      return Span(key._data, key._length);
+    }
+
+    Span payload() const
+    {
+      DiskRun::Item payload = _runState->sortedPayload(_next - 1);
+      return Span(payload._data, payload._length);
+    }
+
+  private:
+    RunStateSPtr _runState;
+    unsigned int _next; // one past the current record
+  };
+
+  // Reads the records kept for a limit, in place.
+  class TopKCursor : public Cursor {
+  public:
+    TopKCursor(TopK& topK)
+      : _topK(topK)
+      , _next(0)
+    {
+      _topK.sort();
+    }
+    // default dtor OK
+
+    bool next()
+    {
+      if (_next >= _topK.records())
+      {
+        return false;
+      }
+      ++ _next;
+      return true;
+    }
+
+    Span key() const
+    {
+      DiskRun::Item key = _topK.key(_next - 1);
+      return Span(key._data, key._length);
+    }
+
+    Span payload() const
+    {
+      DiskRun::Item payload = _topK.payload(_next - 1);
+      return Span(payload._data, payload._length);
+    }
+
+  private:
+    TopK& _topK;
+    unsigned long long _next; // one past the current record
+  };
+
+  // Reads the records out of replacement selection's memory, when they
+  // all fit; each is dropped only when the cursor moves past it.
+  class SelectionCursor : public Cursor {
+  public:
+    SelectionCursor(ReplacementSelection& selection)
+      : _selection(selection)
+      , _started(false) {}
+    // default dtor OK
+
+    bool next()
+    {
+      if (_started && !_selection.empty())
+      {
+        _selection.dropTop();
+      }
+      _started = true;
+      return !_selection.empty();
+    }
+
+    Span key() const
+    {
+      DiskRun::Item key = _selection.topKey();
+      return Span(key._data, key._length);
+    }
+
+    Span payload() const
+    {
+      DiskRun::Item payload = _selection.topPayload();
+      return Span(payload._data, payload._length);
+    }
+
+  private:
+    ReplacementSelection& _selection;
+    bool _started;
+  };
+
+  // Reads the final merge's records in place, out of its sources.
+  class MergeCursor : public Cursor {
+  public:
+    MergeCursor(Merger& merger)
+      : _merger(merger)
+      , _current(nullptr) {}
+    // default dtor OK
+
+    bool next()
+    {
+      _current = _merger.next();
+      return _current != nullptr;
+    }
+
+    Span key() const
+    {
+      DiskRun::Item key = _current->getKey();
+      return Span(key._data, key._length);
+    }
+
+    Span payload() const
+    {
+      DiskRun::Item payload = _current->getPayload();
+      return Span(payload._data, payload._length);
+    }
+
+  private:
+    Merger& _merger;
+    const DiskRun* _current;
+  };
+
+  // Combines the records with equal keys that another cursor yields;
+  // the group's key and combined payload are copied, since the other
+  // cursor has moved on to the next group by then.
+  class CombiningCursor : public Cursor {
+  public:
+    CombiningCursor(Cursor* source, const Combining& combining)
+      : _source(source)
+      , _combining(combining)
+      , _started(false)
+      , _sourceValid(false) {}
+    // default dtor OK
+
+    bool next()
+    {
+      if (!_started)
+      {
+        _started = true;
+        _sourceValid = _source->next();
+      }
+      if (!_sourceValid)
+      {
+        return false;
+      }
+      Span key = _source->key();
+      Span payload = _source->payload();
+      _key.assign((const char*) key._data, key._length);
+      _payload.assign((const char*) payload._data, payload._length);
+      while ((_sourceValid = _source->next()))
+      {
+        key = _source->key();
+        if (!Combining::sameKey(key._data, key._length, _key.data(), _key.size()))
+        {
+          break;
+        }
+        payload = _source->payload();
+        _combining.combine(_payload, key._length, payload._data, payload._length);
+      }
+      return true;
+    }
+
+    Span key() const
+    {
+      return Span(_key.data(), _key.size());
+    }
+
+    Span payload() const
+    {
+      return Span(_payload.data(), _payload.size());
+    }
+
+  private:
+    std::unique_ptr<Cursor> _source;
+    Combining _combining;
+    bool _started;
+    bool _sourceValid;
+    std::string _key;
+    std::string _payload;
+  };
+
+  // Writes out everything held by _selection, when it all fit in memory.
+  void SorterImpl::drainSelection(Receiver* receiver)
+  {
+    if (!_config._combiner)
+    {
+      while (!_selection->empty())
+      {
+        _selection->writeTop(receiver);
+      }
+      return;
+    }
+    CombiningCursor cursor(new SelectionCursor(*_selection), combining());
+    while (cursor.next())
+    {
+      Span item = (receiveKeys() ? cursor.key() : cursor.payload());
+      receiver->receive(item._data, item._length);
+    }
+  }
+
+  // As finish(), up to the point where the records would be handed to
+  // the receiver.
+  Cursor& SorterImpl::finishToCursor()
+  {
+    _cursor.reset(uncombinedCursor());
+    if (_config._combiner)
+    {
+      _cursor.reset(new CombiningCursor(_cursor.release(), combining()));
+    }
+    return *_cursor;
+  }
+
+  Cursor* SorterImpl::uncombinedCursor()
+  {
+    if (_topK)
+    {
+      return new TopKCursor(*_topK);
+    }
+    if (_selection)
+    {
+      if (!_selectionRun)
+      {
+        return new SelectionCursor(*_selection);
+      }
+      while (!_selection->empty())
+      {
+        writeSelected();
+      }
+      finishSelectedRun();
+    }
+    else if (_firstRun)
+    {
+      return new RunStateCursor(_currentRunState);
+    }
+    else
+    {
+      addToRunQueue(_currentRunState);
+      _currentRunState.reset();
+    }
+    _finalMerger.reset(new Merger(mergerOptions()));
+    prepareFinalMerge(*_finalMerger);
+    return new MergeCursor(*_finalMerger);
+  }
+
+  SorterStatistics SorterImpl::statistics()
+  {
+    SorterStatistics result;
+    for (auto& writeBehind: _writeBehind)
+    {
+      AsyncIO::Statistics writes = writeBehind->statistics();
+      result._writeBehindBlocks += writes._requests;
+      result._writeBehindBytes += writes._bytes;
+      result._writeBehindWaits += writes._waits;
+      result._writeBehindWaitNanoseconds += writes._waitNanoseconds;
+    }
+    if (_asyncOutput)
+    {
+      AsyncOutput::Statistics output = _asyncOutput->statistics();
+      result._outputBlocks = output._blocks;
+      result._outputBytes = output._bytes;
+      result._outputWaits = output._waits;
+      result._outputWaitNanoseconds = output._waitNanoseconds;
+      result._outputLatencyNanoseconds = output._latencyNanoseconds;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    result._runs = _runs;
+    result._mappedRuns = _mappedRuns;
+    result._offsetValueMerges = _offsetValueMerges;
+    if (_finalMerger)
+    {
+      // still being read through the cursor
+      result._mappedRuns += _finalMerger->mappedSources();
+      result._offsetValueMerges += (_finalMerger->offsetValueCoded() ? 1 : 0);
+    }
+    return result;
+  }
+
+  DiskRun::Options SorterImpl::diskRunOptions(AsyncIO* writeBehind) const
+  {
+    DiskRun::Options options;
+    options._bufferSize = _config._ioBufferSize;
+    options._writeBehind = writeBehind;
+    options._directIO = _config._directIO;
+    options._compression = _config._compression;
+    options._compressionLevel = _config._compressionLevel;
+    options._frontCodedKeys = _config._frontCodeKeys;
+    options._fixedLength = _config._fixedLength;
+    options._fixedKeyLength = _config._fixedKeyLength;
+    options._fixedPayloadLength = _config._fixedPayloadLength;
+    return options;
+  }
+
+  Merger::Options SorterImpl::mergerOptions() const
+  {
+    Merger::Options options;
+    options._algorithm = _config._mergeAlgorithm;
+    options._readAheadMemory = _config._readAheadMemory;
+    options._maxMappedRunSize = _config._maxMappedRunSize;
+    options._receiveKeys = receiveKeys();
+    options._combining = combining();
+    return options;
+  }
+
   RunStateSPtr SorterImpl::getRunState()
   {
-    // TBD
-    return RunStateSPtr(new RunState(_runSize, _stable));
+    // One RunState is being filled while each spill thread sorts another.
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_freeRunStates.empty() && _runStatesAllocated < _config._threads + 1)
+    {
+      ++ _runStatesAllocated;
+      RunStateSPtr runState(new RunState(_config._runSize, _config._stable,
+                                         _config._sortAlgorithm));
+      runState->setSortThreads(_config._sortThreads);
+      runState->setCombining(combining());
+      if (_config._fixedLength)
+      {
+        runState->setFixedLength(_config._fixedKeyLength, _config._fixedPayloadLength);
+      }
+      return runState;
+    }
+    while (_freeRunStates.empty() && !_spillError)
+    {
+      _runFreed.wait(lock);
+    }
+    checkSpillError();
+    RunStateSPtr result = _freeRunStates.back();
+    _freeRunStates.pop_back();
+    return result;
   }
     
-  void SorterImpl::addToRunQueue(RunStateSPtr)
+  void SorterImpl::addToRunQueue(RunStateSPtr runState)
   {
     _firstRun = false;
-    // TBD
-    throw new NotYetSupportedException("addToRunQueue called");
+    std::lock_guard<std::mutex> lock(_mutex);
+    checkSpillError();
+    if (_spillThreads.empty())
+    {
+      startWriteBehind();
+      for (unsigned int i = 0; i < _config._threads; ++i)
+      {
+        _spillThreads.push_back(std::thread(&SorterImpl::spillLoop, this,
+                                            writeBehind(i)));
+      }
+    }
+    QueuedRun queued = {runState, _queuedSequence++};
+    _runQueue.push_back(queued);
+    _runQueued.notify_one();
   }
 
-  void SorterImpl::awaitMergeCompletion()
+  void SorterImpl::startWriteBehind()
   {
-    // TBD
-    throw new NotYetSupportedException("awaitMergeCompletion called");
+    if (_writeBehind.empty() && _config._writeBehindDepth)
+    {
+      for (unsigned int i = 0; i < _config._threads; ++i)
+      {
+        _writeBehind.emplace_back(new AsyncIO(_config._writeBehindDepth));
+      }
+    }
+  }
+
+  // The given spill thread's write-behind queue; null if writes are
+  // synchronous.
+  AsyncIO* SorterImpl::writeBehind(unsigned int thread) const
+  {
+    return (_writeBehind.empty() ? nullptr : _writeBehind[thread].get());
+  }
+
+  // Writes the lowest record held by _selection, first starting a new
+  // run if it belongs to the next one.
+  void SorterImpl::writeSelected()
+  {
+    if (!_selectionRun || _selection->topRun() != _selectionRunNumber)
+    {
+      finishSelectedRun();
+      _firstRun = false;
+      startWriteBehind();
+      _selectionRunNumber = _selection->topRun();
+      _selectionRun = DiskRun::getDiskRun(0, 0, 0, diskRunOptions(writeBehind(0)));
+    }
+    _selection->writeTop(_selectionRun.get());
+  }
+
+  void SorterImpl::finishSelectedRun()
+  {
+    if (_selectionRun)
+    {
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        ++ _runs;
+      }
+      // There are no spill threads, so the levels are this thread's alone.
+      addDiskRun(_selectionRun, writeBehind(0));
+      _selectionRun.reset();
+    }
+  }
+
+  void SorterImpl::awaitMergeCompletion(Receiver* receiver)
+  {
+    Merger merger(mergerOptions());
+    prepareFinalMerge(merger);
+    merger.merge(receiver);
+    countMerge(merger);
+  }
+
+  void SorterImpl::countMerge(const Merger& merger)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _mappedRuns += merger.mappedSources();
+    _offsetValueMerges += (merger.offsetValueCoded() ? 1 : 0);
+  }
+
+  // Waits for the spills, then merges down to the runs of the final
+  // merge, and adds those to the merger.
+  void SorterImpl::prepareFinalMerge(Merger& merger)
+  {
+    stopSpillThreads();
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      checkSpillError();
+    }
+
+    // The higher levels hold the older records, so gather the runs
+    // oldest first to keep the final merge stable.
+    DiskRunVector runs;
+    for (unsigned int level = _levels.size(); level > 0; --level)
+    {
+      const DiskRunVector& levelRuns = _levels[level-1];
+      runs.insert(runs.end(), levelRuns.begin(), levelRuns.end());
+    }
+    _levels.clear();
+
+    // Merge just enough of the oldest runs that the final merge fits
+    // within the maximum width.
+    const unsigned int width = _config._maxMergeWidth;
+    while (runs.size() > width)
+    {
+      unsigned int count = std::min(width, (unsigned int) runs.size() - width + 1);
+      DiskRunVector oldest(runs.begin(), runs.begin() + count);
+      unsigned int level = 0;
+      for (auto run: oldest)
+      {
+        level = std::max(level, run->level());
+      }
+      DiskRunSPtr merged = mergeRuns(oldest, level + 1, writeBehind(0));
+      runs.erase(runs.begin() + 1, runs.begin() + count);
+      runs[0] = merged;
+    }
+
+    for (auto run: runs)
+    {
+      merger.addSource(run);
+    }
+  }
+
+  void SorterImpl::spillLoop(AsyncIO* writeBehind)
+  {
+    for (;;)
+    {
+      QueuedRun queued;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (_runQueue.empty() && !_spillDone && !_spillError)
+        {
+          _runQueued.wait(lock);
+        }
+        if (_runQueue.empty() || _spillError)
+        {
+          return;
+        }
+        queued = _runQueue.front();
+        _runQueue.pop_front();
+      }
+
+      try
+      {
+        DiskRunSPtr run = spill(queued._runState, writeBehind);
+        queued._runState->clear();
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          _freeRunStates.push_back(queued._runState);
+          _runFreed.notify_one();
+          _spilledRuns[queued._sequence] = run;
+          if (run)
+          {
+            ++ _runs;
+          }
+          if (_addingRuns)
+          {
+            // The thread adding runs will pick this one up.
+            continue;
+          }
+          _addingRuns = true;
+        }
+        addSpilledRuns(writeBehind);
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _spillError = std::current_exception();
+        _runFreed.notify_all();
+        _runQueued.notify_all();
+        return;
+      }
+    }
+  }
+
+  DiskRunSPtr SorterImpl::spill(RunStateSPtr runState, AsyncIO* writeBehind)
+  {
+    if (runState->records() == 0)
+    {
+      return DiskRunSPtr();
+    }
+    DiskRunSPtr run = DiskRun::getDiskRun(0, runState->keySize(), 
+                                          runState->payloadSize(),
+                                          diskRunOptions(writeBehind));
+    runState->sort(run.get());
+    return run;
+  }
+
+  // Called with _addingRuns set by this thread; adds the spilled runs
+  // in sequence for as long as the next one is available.
+  void SorterImpl::addSpilledRuns(AsyncIO* writeBehind)
+  {
+    for (;;)
+    {
+      DiskRunSPtr run;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto next = _spilledRuns.find(_addedSequence);
+        if (next == _spilledRuns.end() || _spillError)
+        {
+          _addingRuns = false;
+          return;
+        }
+        run = next->second;
+        _spilledRuns.erase(next);
+        ++ _addedSequence;
+      }
+      if (run)
+      {
+        try
+        {
+          addDiskRun(run, writeBehind);
+        }
+        catch (...)
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          _addingRuns = false;
+          throw;
+        }
+      }
+    }
+  }
+
+  void SorterImpl::addDiskRun(DiskRunSPtr run, AsyncIO* writeBehind)
+  {
+    unsigned int level = run->level();
+    if (_levels.size() <= level)
+    {
+      _levels.resize(level + 1);
+    }
+    DiskRunVector& levelRuns = _levels[level];
+    levelRuns.push_back(run);
+    if (levelRuns.size() >= _config._maxMergeWidth)
+    {
+      DiskRunVector full;
+      full.swap(levelRuns);
+      addDiskRun(mergeRuns(full, level + 1, writeBehind), writeBehind);
+    }
+  }
+
+  DiskRunSPtr SorterImpl::mergeRuns(const DiskRunVector& runs, unsigned int level,
+                                     AsyncIO* writeBehind)
+  {
+    unsigned long long keyBytes = 0;
+    unsigned long long payloadBytes = 0;
+    Merger merger(mergerOptions());
+    for (auto run: runs)
+    {
+      keyBytes += run->keyBytes();
+      payloadBytes += run->payloadBytes();
+      merger.addSource(run);
+    }
+    DiskRunSPtr target = DiskRun::getDiskRun(level, keyBytes, payloadBytes,
+                                             diskRunOptions(writeBehind));
+    merger.merge(target);
+    countMerge(merger);
+    return target;
+  }
+
+  void SorterImpl::stopSpillThreads()
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _spillDone = true;
+      _runQueued.notify_all();
+    }
+    for (auto& thread: _spillThreads)
+    {
+      thread.join();
+    }
+    _spillThreads.clear();
+  }
+
+  // Must be called with _mutex held
+  void SorterImpl::checkSpillError()
+  {
+    if (_spillError)
+    {
+      std::rethrow_exception(_spillError);
+    }
   }
 
 }
@@ -8,18 +8,53 @@
 
 #include "sorter.h"
 #include "runstate.h"
+#include "replacement.h"
+#include "topk.h"
+#include "diskrun.h"
+#include "merger.h"
+#include "asyncoutput.h"
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 
 namespace external_sort {
 
   class SorterImpl {
   public:
-    SorterImpl(unsigned int runSize, bool stable, Receiver* receiver);
+    SorterImpl(const SorterConfig& config);
     ~SorterImpl();
 
     inline
     void sort(const void* key, unsigned int keyLength,
               const void* payload, unsigned int payloadLength)
     {
+      if (_config._fixedLength &&
+          (keyLength != _config._fixedKeyLength ||
+           payloadLength != _config._fixedPayloadLength))
+      {
+        throw new FixedRecordSizeException(keyLength, payloadLength);
+      }
+
+      if (_topK)
+      {
+        _topK->store(key, keyLength, payload, payloadLength);
+        return;
+      }
+
+      if (_selection)
+      {
+        while (!_selection->store(key, keyLength, payload, payloadLength))
+        {
+          writeSelected();
+        }
+        return;
+      }
+
       if (!_currentRunState)
       {
         _currentRunState = getRunState();
@@ -27,29 +62,122 @@ namespace external_sort {
 
       if (!_currentRunState->store(key, keyLength, payload, payloadLength))
       {
-        // didn't fit
+        // didn't fit; start a new run with this record
         addToRunQueue(_currentRunState);
         _currentRunState = getRunState();
+        _currentRunState->store(key, keyLength, payload, payloadLength);
       }
       
     }
 
+    void sortBatch(const Span* keys, const Span* payloads, unsigned int count);
+    void sortBatch(const void* records, unsigned int count);
+
     void finish();
+    Cursor& finishToCursor();
+
+    SorterStatistics statistics();
 
   private:
     // prohibit copy/assign; do not implement
     SorterImpl(const SorterImpl&);
     SorterImpl& operator=(const SorterImpl&);
 
+    typedef std::vector<DiskRunSPtr> DiskRunVector;
+
     RunStateSPtr _currentRunState;
-    Receiver* _receiver;
-    unsigned int _runSize;
-    bool _stable;
+    SorterConfig _config;
     bool _firstRun;
+
+    // One write-behind queue per spill thread, so that the spills (and
+    // the merges each thread does) aren't all serialized on a single
+    // writer. The caller's thread uses the first: with replacement
+    // selection, and for the final merges once the spill threads are
+    // done. They must outlive the DiskRuns written through them.
+    std::vector<std::unique_ptr<AsyncIO> > _writeBehind;
+
+    struct QueuedRun {
+      // default ctor/dtor/copy/assign OK
+      RunStateSPtr _runState;
+      unsigned int _sequence;
+    };
+
+    // Filled runs are handed to a pool of _threads spill threads, each of
+    // which sorts a run into a level 0 DiskRun and then returns the
+    // RunState to the free list for reuse. Runs can finish spilling out
+    // of order, so each is numbered when queued and the DiskRuns are
+    // added to the levels strictly in that order (by whichever spill 
+    // thread holds _addingRuns). Whenever a level accumulates 
+    // _maxMergeWidth runs they are merged into a single run one level up,
+    // which bounds the number of open runs (and file descriptors).
+    std::mutex _mutex;
+    std::condition_variable _runQueued;
+    std::condition_variable _runFreed;
+    std::deque<QueuedRun> _runQueue;
+    std::vector<RunStateSPtr> _freeRunStates;
+    unsigned int _runStatesAllocated;
+    unsigned int _queuedSequence;
+    std::map<unsigned int, DiskRunSPtr> _spilledRuns;
+    unsigned int _addedSequence;
+    bool _addingRuns;
+    std::vector<DiskRunVector> _levels; // only touched while _addingRuns
+    std::exception_ptr _spillError;
+    bool _spillDone;
+    std::vector<std::thread> _spillThreads;
+    unsigned long long _runs;
+    unsigned long long _mappedRuns; // in the merges finished so far
+    unsigned long long _offsetValueMerges; // likewise
+
+    // With REPLACEMENT_SELECTION there is no RunState or spill thread;
+    // the caller's thread writes each record as it leaves _selection,
+    // and adds each finished run to the levels itself.
+    std::unique_ptr<ReplacementSelection> _selection;
+    DiskRunSPtr _selectionRun;
+    unsigned int _selectionRunNumber;
+
+    // With a limit there is neither; every record goes to _topK.
+    std::unique_ptr<TopK> _topK;
+
+    // For finishToCursor(); the cursor may be reading from the merger.
+    std::unique_ptr<Merger> _finalMerger;
+    std::unique_ptr<Cursor> _cursor;
+
+    // With _asyncOutputBlocks, what finish() hands the output to
+    std::unique_ptr<AsyncOutput> _asyncOutput;
     
+    // A sort of fixed length keys with no payload hands the receiver keys.
+    bool receiveKeys() const
+    {
+      return _config._fixedLength && _config._fixedPayloadLength == 0;
+    }
+
+    Combining combining() const
+    {
+      return Combining(_config._combiner, _config._fixedLength, _config._fixedPayloadLength);
+    }
+
+    DiskRun::Options diskRunOptions(AsyncIO* writeBehind) const;
+    Merger::Options mergerOptions() const;
     RunStateSPtr getRunState();
     void addToRunQueue(RunStateSPtr);
-    void awaitMergeCompletion();
+    void startWriteBehind();
+    AsyncIO* writeBehind(unsigned int thread) const;
+    void writeSelected();
+    void drainSelection(Receiver*);
+    Cursor* uncombinedCursor();
+    void finishSelectedRun();
+    void awaitMergeCompletion(Receiver*);
+    void prepareFinalMerge(Merger&);
+    void countMerge(const Merger&);
+
+    void spillLoop(AsyncIO* writeBehind);
+    DiskRunSPtr spill(RunStateSPtr, AsyncIO* writeBehind);
+    void addSpilledRuns(AsyncIO* writeBehind);
+    void addDiskRun(DiskRunSPtr, AsyncIO* writeBehind);
+    DiskRunSPtr mergeRuns(const DiskRunVector& runs, unsigned int level,
+                          AsyncIO* writeBehind);
+    void stopSpillThreads();
+    void checkSpillError();
   };
 }
 
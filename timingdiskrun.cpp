@@ -0,0 +1,90 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#include "diskrun.h"
+#include "asyncio.h"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+
+/*
+  Compares spilling through the page cache with O_DIRECT, and with
+  compression, writing a run and then reading it back, in the current
+  directory. Buffered runs will usually read back from the page cache;
+  that is what direct mode gives up in exchange for leaving the cache
+  alone. The records are mostly repeated bytes, so they compress well.
+*/
+
+namespace {
+
+  typedef std::chrono::high_resolution_clock clock;
+  typedef std::chrono::high_resolution_clock::time_point instant;
+  typedef std::chrono::duration<double> seconds;
+
+  static const unsigned int KEY_SIZE = 16;
+  static const unsigned int PAYLOAD_SIZE = 84;
+
+  void timeRun(bool directIO, external_sort::Compression compression,
+               unsigned long long bytes)
+  {
+    using namespace std;
+    external_sort::AsyncIO writeBehind(8);
+    external_sort::DiskRun::Options options;
+    options._directIO = directIO;
+    options._compression = compression;
+    options._writeBehind = &writeBehind;
+    external_sort::DiskRunSPtr run = 
+      external_sort::DiskRun::getDiskRun(0, 0, 0, options);
+
+    std::vector<char> record(KEY_SIZE + PAYLOAD_SIZE, 'x');
+    unsigned long long records = bytes/record.size();
+    instant start = clock::now();
+    for (unsigned long long i = 0; i < records; ++i)
+    {
+      *(unsigned long long*) &record[0] = i;
+      run->write(&record[0], KEY_SIZE, &record[KEY_SIZE], PAYLOAD_SIZE);
+    }
+    run->resetForRead();
+    instant written = clock::now();
+
+    external_sort::AsyncIO readAhead;
+    run->startReadAhead(&readAhead, 4 * 1024 * 1024);
+    unsigned long long count = 0;
+    while (run->next())
+    {
+      ++ count;
+    }
+    instant read = clock::now();
+
+    double megabytes = (double) bytes / (1024.0 * 1024.0);
+    const char* mode = (run->isCompressed() ? "LZ" :
+                        directIO ? (run->isDirect() ? "direct" : "(n/a)") : "buffered");
+    cout << setw(8) << mode
+         << " | " << setw(13) << megabytes / seconds(written - start).count()
+         << " | " << setw(12) << megabytes / seconds(read - written).count()
+         << endl;
+    if (count != records)
+    {
+      cout << "record count mismatch: " << count << " of " << records << endl;
+    }
+  }
+
+}
+
+int main()
+{
+  using namespace std;
+  static const unsigned long long bytes = 512ULL * 1024 * 1024;
+  cout << "    mode | write (MB/s) | read (MB/s)" << endl;
+  for (unsigned int i = 0; i < 2; ++i)
+  {
+    timeRun(false, external_sort::NO_COMPRESSION, bytes);
+    timeRun(true, external_sort::NO_COMPRESSION, bytes);
+    timeRun(false, external_sort::LZ_COMPRESSION, bytes);
+  }
+  return 0;
+}
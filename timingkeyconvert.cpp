@@ -0,0 +1,109 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#include "keyconvert.h"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <cstring>
+#include <stdint.h>
+
+/*
+  Compares converting a column of values to keys one value at a time
+  (the single-value routines, in a loop) with the array routines, using
+  each KeyConversion, both packed and spread out 16 bytes apart (as if
+  into fixed length records).
+*/
+
+namespace {
+
+  typedef std::chrono::high_resolution_clock clock;
+  typedef std::chrono::high_resolution_clock::time_point instant;
+  typedef std::chrono::nanoseconds interval;
+
+  static const unsigned int VALUES = 1 << 20;
+  static const unsigned int ITERATIONS = 20;
+  static const size_t SPREAD_STRIDE = 16;
+
+  template <typename T>
+  double oneAtATime(const std::vector<T>& values, std::vector<char>& keys,
+                    size_t stride, void (*one)(T, void*))
+  {
+    instant start = clock::now();
+    for (unsigned int i = 0; i < ITERATIONS; ++i)
+    {
+      char* target = keys.data();
+      for (auto value: values)
+      {
+        one(value, target);
+        target += stride;
+      }
+    }
+    instant stop = clock::now();
+    return (double) interval(stop - start).count() / ((double) ITERATIONS * values.size());
+  }
+
+  template <typename T>
+  double arrayAtATime(const std::vector<T>& values, std::vector<char>& keys,
+                      size_t stride, external_sort::KeyConversion conversion,
+                      void (*array)(const T*, size_t, void*, size_t,
+                                    external_sort::KeyConversion))
+  {
+    instant start = clock::now();
+    for (unsigned int i = 0; i < ITERATIONS; ++i)
+    {
+      array(values.data(), values.size(), keys.data(), stride, conversion);
+    }
+    instant stop = clock::now();
+    return (double) interval(stop - start).count() / ((double) ITERATIONS * values.size());
+  }
+
+  template <typename T>
+  void timeType(const char* name, void (*one)(T, void*),
+                void (*array)(const T*, size_t, void*, size_t,
+                              external_sort::KeyConversion))
+  {
+    using namespace std;
+    std::mt19937_64 generator(1);
+    std::vector<T> values(VALUES);
+    for (auto& value: values)
+    {
+      uint64_t bits = generator();
+      memcpy(&value, &bits, sizeof(value));
+    }
+    std::vector<char> keys(SPREAD_STRIDE * VALUES);
+    for (size_t stride: {sizeof(T), SPREAD_STRIDE})
+    {
+      cout << setw(7) << name << " | " << setw(6) << stride
+           << " | " << setw(8) << oneAtATime(values, keys, stride, one);
+      for (auto conversion: {external_sort::SCALAR_CONVERSION,
+                             external_sort::SSSE3_CONVERSION,
+                             external_sort::AVX2_CONVERSION})
+      {
+        cout << " | " << setw(8)
+             << arrayAtATime(values, keys, stride, conversion, array);
+      }
+      cout << endl;
+    }
+  }
+}
+
+int main()
+{
+  using namespace std;
+  cout << "(ns/value; best conversion here is "
+       << external_sort::bestKeyConversion() << ")" << endl;
+  cout << "   type | stride |   single |   scalar |    ssse3 |     avx2" << endl;
+  timeType<uint32_t>("uint32", external_sort::uint32ToKey, external_sort::uint32ArrayToKeys);
+  timeType<int32_t>("int32", external_sort::int32ToKey, external_sort::int32ArrayToKeys);
+  timeType<uint64_t>("uint64", external_sort::uint64ToKey, external_sort::uint64ArrayToKeys);
+  timeType<int64_t>("int64", external_sort::int64ToKey, external_sort::int64ArrayToKeys);
+  timeType<float>("float", external_sort::floatToKey, external_sort::floatArrayToKeys);
+  timeType<double>("double", external_sort::doubleToKey, external_sort::doubleArrayToKeys);
+  return 0;
+}
@@ -0,0 +1,164 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#include "mergetree.h"
+#include "keyconvert.h"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <stdint.h>
+
+/*
+  Compares the selection cost of the heap and loser tree merges across
+  fan-ins. The sources are in memory, so this measures only the work of
+  picking the next record, not the DiskRun I/O. The offset-value coded
+  tree is given each key's shared prefix with the one before it, as a
+  front-coded run would; a second table gives every key the same long
+  prefix, where the codes save the most.
+*/
+
+namespace {
+
+  typedef std::chrono::high_resolution_clock clock;
+  typedef std::chrono::high_resolution_clock::time_point instant;
+  typedef std::chrono::nanoseconds interval;
+
+  using ::external_sort::DiskRun;
+
+  class MergeTimingTest
+  {
+  public:
+    // Each key is prefixLength zero bytes, then 8 random ones.
+    MergeTimingTest(unsigned int fanIn, unsigned int records,
+                    unsigned int prefixLength)
+      : _keySize(prefixLength + 8)
+      , _keys(fanIn)
+      , _shared(fanIn)
+    {
+      std::mt19937_64 generator(fanIn);
+      std::vector<uint64_t> values(records/fanIn);
+      for (unsigned int s = 0; s < fanIn; ++s)
+      {
+        for (auto& value: values)
+        {
+          value = generator();
+        }
+        std::sort(values.begin(), values.end());
+        std::vector<char>& source = _keys[s];
+        source.assign(_keySize * values.size(), 0);
+        _shared[s].resize(values.size());
+        for (unsigned int i = 0; i < values.size(); ++i)
+        {
+          char* key = &source[_keySize*i];
+          ::external_sort::uint64ToKey(values[i], key + prefixLength);
+          _shared[s][i] = (i == 0 ? 0 : 
+                           DiskRun::commonPrefixLength(key - _keySize, _keySize,
+                                                       key, _keySize));
+        }
+      }
+    }
+
+    template <typename Tree>
+    double nanosecondsPerRecord(unsigned int iterations)
+    {
+      double total = 0;
+      unsigned long long records = 0;
+      for (unsigned int i = 0; i < iterations; ++i)
+      {
+        Tree tree;
+        instant start = clock::now();
+        records += merge(tree);
+        instant stop = clock::now();
+        total += (double) interval(stop - start).count();
+      }
+      return total/((double) records);
+    }
+
+  private:
+    unsigned int _keySize;
+    std::vector<std::vector<char> > _keys;
+    std::vector<std::vector<unsigned int> > _shared;
+
+    template <typename Tree>
+    void replaceTop(Tree& tree, unsigned int, const char* key)
+    {
+      tree.replaceTop(DiskRun::Item(key, _keySize));
+    }
+
+    void replaceTop(::external_sort::OffsetValueMergeTree& tree, unsigned int source,
+                    const char* key)
+    {
+      unsigned int record = (unsigned int) ((key - _keys[source].data()) / _keySize);
+      tree.replaceTop(DiskRun::Item(key, _keySize), _shared[source][record]);
+    }
+
+    template <typename Tree>
+    unsigned long long merge(Tree& tree)
+    {
+      std::vector<const char*> positions(_keys.size());
+      std::vector<const char*> ends(_keys.size());
+      tree.reset(_keys.size());
+      for (unsigned int i = 0; i < _keys.size(); ++i)
+      {
+        positions[i] = _keys[i].data();
+        ends[i] = positions[i] + _keys[i].size();
+        if (positions[i] != ends[i])
+        {
+          tree.setKey(i, DiskRun::Item(positions[i], _keySize));
+        }
+      }
+      tree.build();
+
+      unsigned long long records = 0;
+      while (!tree.empty())
+      {
+        unsigned int i = tree.top();
+        ++ records;
+        positions[i] += _keySize;
+        if (positions[i] != ends[i])
+        {
+          replaceTop(tree, i, positions[i]);
+        }
+        else
+        {
+          tree.removeTop();
+        }
+      }
+      return records;
+    }
+  };
+
+}
+
+int main()
+{
+  using namespace std;
+  static const unsigned int records = 1 << 21;
+  static const unsigned int iterations = 5;
+  static const unsigned int prefixLengths[] = {0, 24};
+  for (auto prefixLength: prefixLengths)
+  {
+    cout << "keys with a " << prefixLength << " byte common prefix" << endl;
+    cout << "   fan-in |  heap (ns/record) | loser tree (ns/record)"
+         << " | offset-value (ns/record)" << endl;
+    for (unsigned int fanIn = 2; fanIn <= 1024; fanIn *= 2)
+    {
+      MergeTimingTest tester(fanIn, records, prefixLength);
+      double heap = 
+        tester.nanosecondsPerRecord<external_sort::HeapMergeTree>(iterations);
+      double loser = 
+        tester.nanosecondsPerRecord<external_sort::LoserMergeTree>(iterations);
+      double coded = 
+        tester.nanosecondsPerRecord<external_sort::OffsetValueMergeTree>(iterations);
+      cout << setw(9) << fanIn << " | " << setw(17) << heap 
+           << " | " << setw(22) << loser << " | " << setw(10) << coded << endl;
+    }
+  }
+  return 0;
+}
@@ -53,7 +53,9 @@ namespace {
     }
 
   public:
-    double nanosecondsPerRecord(unsigned int count, unsigned int iterations, bool stable)
+    double nanosecondsPerRecord(unsigned int count, unsigned int iterations, bool stable,
+                                external_sort::SortAlgorithm algorithm,
+                                unsigned int threads)
     {
       unsigned int bytesPerRecord = external_sort::RunBlock::spaceNeededFor(keySize(), 1);
       // Make sure the block size never exceeds (magic number) 256MB
@@ -63,7 +65,8 @@ namespace {
       {
         return -1;
       }
-      _sorter.reset(new external_sort::RunState(limit, stable));
+      _sorter.reset(new external_sort::RunState(limit, stable, algorithm));
+      _sorter->setSortThreads(threads);
       double total = 0;
       // Adjust the iterations for small record counts, since there is so much variability
       if (count < 100) 
@@ -104,20 +107,32 @@ int main(int argc, const char* const argv[])
   Uint32TimingTest tester;
   static const unsigned int limit = 1000000;
   static const unsigned int iterations = 10;
-  cout << "  records | time (stable)" << endl;
-  for (unsigned int i = 1; i <= limit; i *= 10)
-  {
-    double rate = tester.nanosecondsPerRecord(i, iterations, true);
-    if (rate < 0) break;
-    cout << setw(9) << i << " | " << rate << " nanoseconds/record" << endl;
-  }
-
-  cout << endl << "  records | time (not stable)" << endl;
-  for (unsigned int i = 1; i <= limit; i *= 10)
+  static const struct {
+    const char* _title;
+    bool _stable;
+    external_sort::SortAlgorithm _algorithm;
+    unsigned int _threads;
+  } tables[] = {
+    {"stable", true, external_sort::COMPARISON_SORT, 1},
+    {"not stable", false, external_sort::COMPARISON_SORT, 1},
+    {"radix, stable", true, external_sort::RADIX_SORT, 1},
+    {"radix, not stable", false, external_sort::RADIX_SORT, 1},
+    {"microruns, stable", true, external_sort::MICRORUN_SORT, 1},
+    {"microruns, not stable", false, external_sort::MICRORUN_SORT, 1},
+    {"4 threads, stable", true, external_sort::COMPARISON_SORT, 4},
+    {"4 threads, not stable", false, external_sort::COMPARISON_SORT, 4}
+  };
+  for (auto table: tables)
   {
-    double rate = tester.nanosecondsPerRecord(i, iterations, false);
-    if (rate < 0) break;
-    cout << setw(9) << i << " | " << rate << " nanoseconds/record" << endl;
+    cout << "  records | time (" << table._title << ")" << endl;
+    for (unsigned int i = 1; i <= limit; i *= 10)
+    {
+      double rate = tester.nanosecondsPerRecord(i, iterations, table._stable,
+                                                table._algorithm, table._threads);
+      if (rate < 0) break;
+      cout << setw(9) << i << " | " << rate << " nanoseconds/record" << endl;
+    }
+    cout << endl;
   }
   return 0;
 }
@@ -0,0 +1,172 @@
+// -*- mode: c++ -*-
+
+// Copyright (c) 2014 by Jerry L. Callen. See the LICENSE file
+// for the detailed license.
+
+#ifndef EXTERNAL_SORT_TOPK_H
+#define EXTERNAL_SORT_TOPK_H
+
+#include "sorter.h" // for Receiver
+#include "runstate.h" // for KeyPointer::prefixOf
+#include "diskrun.h"
+#include "mergetree.h" // for compareKeys
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdint.h>
+
+/*
+  A sort with a limit (Sorter::withLimit()): only the first limit records
+  in sort order are wanted, so only that many are ever held. They are
+  kept in a heap with the greatest (key, arrival) on top, which is the
+  threshold a new record has to beat. Until the heap is full every record
+  goes in; after that, a record that doesn't sort before the top is
+  dropped as it arrives (usually on its key prefix alone), and one that
+  does takes the top's place. A record with the same key as the top
+  arrived later, so it sorts after it and is dropped too, which keeps
+  the result exactly what a full stable sort would start with.
+
+  Nothing is ever spilled, and the memory held is that of the records
+  kept, not a run block.
+
+  Like replacement.h, this is all inline, so there is no corresponding
+  .cpp file.
+*/
+
+namespace external_sort {
+
+  class TopK {
+  public:
+    TopK(unsigned long long limit)
+      : _limit(limit)
+      , _sequence(0)
+    {
+      _heap.reserve((size_t) std::min(limit, (unsigned long long) MAX_INITIAL_RESERVE));
+    }
+    // default dtor OK
+
+    inline
+    void store(const void* key, unsigned int keyLength,
+               const void* payload, unsigned int payloadLength)
+    {
+      uint64_t prefix = KeyPointer::prefixOf(key, keyLength);
+      if (_heap.size() < _limit)
+      {
+        _heap.push_back(Entry());
+        _heap.back().assign(prefix, _sequence++, key, keyLength, payload, payloadLength);
+        std::push_heap(_heap.begin(), _heap.end(), HeapOrder());
+        return;
+      }
+      ++ _sequence;
+      const Entry& top = _heap.front();
+      if (prefix > top._prefix ||
+          (prefix == top._prefix &&
+           compareKeys(key, keyLength, top.keyData(), top._keyLength) >= 0))
+      {
+        // can't make the cut
+        return;
+      }
+      std::pop_heap(_heap.begin(), _heap.end(), HeapOrder());
+      // reuse the evicted record's space
+      _heap.back().assign(prefix, _sequence - 1, key, keyLength, payload, payloadLength);
+      std::push_heap(_heap.begin(), _heap.end(), HeapOrder());
+    }
+
+    // Puts the records kept in order, after which they are read back by
+    // key(i) and payload(i).
+    void sort()
+    {
+      std::sort_heap(_heap.begin(), _heap.end(), HeapOrder());
+    }
+
+    unsigned long long records() const
+    {
+      return _heap.size();
+    }
+
+    DiskRun::Item key(size_t i) const
+    {
+      return DiskRun::Item(_heap[i].keyData(), _heap[i]._keyLength);
+    }
+
+    DiskRun::Item payload(size_t i) const
+    {
+      const Entry& entry = _heap[i];
+      return DiskRun::Item(entry.keyData() + entry._keyLength,
+                           entry._record.size() - entry._keyLength);
+    }
+
+    // Sorts, then hands the receiver each payload (or key) in order.
+    void sort(Receiver* receiver, bool receiveKeys)
+    {
+      sort();
+      for (size_t i = 0; i < _heap.size(); ++i)
+      {
+        DiskRun::Item item = (receiveKeys ? key(i) : payload(i));
+        receiver->receive(item._data, item._length);
+      }
+    }
+
+  private:
+    // prohibit copy/assign; do not implement
+    TopK(const TopK&);
+    TopK& operator=(const TopK&);
+
+    static const unsigned long long MAX_INITIAL_RESERVE = 64 * 1024;
+
+    struct Entry {
+      // default ctor/dtor/copy/assign OK
+      uint64_t _prefix;
+      unsigned long long _sequence;
+      unsigned int _keyLength;
+      std::string _record; // the key, then the payload
+
+      inline
+      void assign(uint64_t prefix, unsigned long long sequence,
+                  const void* key, unsigned int keyLength,
+                  const void* payload, unsigned int payloadLength)
+      {
+        _prefix = prefix;
+        _sequence = sequence;
+        _keyLength = keyLength;
+        _record.assign((const char*) key, keyLength);
+        _record.append((const char*) payload, payloadLength);
+      }
+
+      inline
+      const char* keyData() const
+      {
+        return _record.data();
+      }
+    };
+
+    // The output order; std::push_heap and std::pop_heap keep the
+    // greatest element first.
+    struct HeapOrder {
+      // default ctor/dtor/copy/assign OK
+      inline
+      bool operator() (const Entry& left, const Entry& right) const
+      {
+        if (left._prefix != right._prefix)
+        {
+          return left._prefix < right._prefix;
+        }
+        int result = compareKeys(left.keyData(), left._keyLength,
+                                 right.keyData(), right._keyLength);
+        if (result != 0)
+        {
+          return result < 0;
+        }
+        return left._sequence < right._sequence;
+      }
+    };
+
+    unsigned long long _limit;
+    unsigned long long _sequence;
+    std::vector<Entry> _heap;
+  };
+
+} // namespace external_sort
+
+#endif // EXTERNAL_SORT_TOPK_H